@@ -332,7 +332,7 @@ std::function<bool(const cfepi::filtration_setup<states_t, any_event> &,
       // std::cout << "\n";
 
       auto incidence_counts =
-        cfepi::aggregate_state(setup.states_entered).potential_state_counts[1 <<
+        setup.entered_counts().potential_state_counts[1 <<
 compartment_to_filter];
 
       // if (incidence_counts < counts_to_filter_to[this_time]) {
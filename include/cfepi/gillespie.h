@@ -0,0 +1,311 @@
+#include <cfepi/sir.h>
+
+#include <cmath>
+#include <limits>
+#include <random>
+#include <utility>
+
+#ifndef __GILLESPIE_H_
+#  define __GILLESPIE_H_
+
+namespace cfepi {
+
+  namespace detail {
+    /*!
+     * \class indexed_priority_queue
+     * \brief Binary min-heap over a fixed set of keys 0..n-1 that supports changing the priority
+     * of any key in O(log n).
+     *
+     * Used by the next reaction method to keep the putative firing time of every event type.
+     */
+    class indexed_priority_queue {
+    private:
+      std::vector<double> priorities_;
+      std::vector<size_t> heap_;
+      std::vector<size_t> position_;
+
+      bool less(size_t lhs, size_t rhs) const {
+        return (priorities_[heap_[lhs]] < priorities_[heap_[rhs]]);
+      }
+      void swap_nodes(size_t lhs, size_t rhs) {
+        std::swap(heap_[lhs], heap_[rhs]);
+        position_[heap_[lhs]] = lhs;
+        position_[heap_[rhs]] = rhs;
+      }
+      void sift_up(size_t node) {
+        while ((node > 0) && less(node, (node - 1) / 2)) {
+          swap_nodes(node, (node - 1) / 2);
+          node = (node - 1) / 2;
+        }
+      }
+      void sift_down(size_t node) {
+        while (true) {
+          size_t smallest = node;
+          for (auto child : {2 * node + 1, 2 * node + 2}) {
+            if ((child < std::size(heap_)) && less(child, smallest)) {
+              smallest = child;
+            }
+          }
+          if (smallest == node) {
+            return;
+          }
+          swap_nodes(node, smallest);
+          node = smallest;
+        }
+      }
+
+    public:
+      //! \brief Construct from the initial priority of each key
+      explicit indexed_priority_queue(const std::vector<double> &priorities)
+          : priorities_(priorities),
+            heap_(std::size(priorities)),
+            position_(std::size(priorities)) {
+        std::iota(std::begin(heap_), std::end(heap_), 0UL);
+        std::iota(std::begin(position_), std::end(position_), 0UL);
+        for (size_t node = std::size(heap_) / 2; node-- > 0;) {
+          sift_down(node);
+        }
+      }
+      //! \brief The key with the smallest priority
+      size_t top() const { return (heap_[0]); }
+      //! \brief The priority of a key
+      double priority(size_t key) const { return (priorities_[key]); }
+      //! \brief Change the priority of a key, restoring the heap property
+      void update(size_t key, double priority) {
+        priorities_[key] = priority;
+        sift_up(position_[key]);
+        sift_down(position_[key]);
+      }
+    };
+  }  // namespace detail
+
+  /*!
+   * \class compartment_membership
+   * \brief The people in each compartment of a single world, supporting O(1) moves and O(1)
+   * uniform sampling from a set of compartments.
+   *
+   * Requires every person to be in exactly one compartment.
+   */
+  template <typename states_t> struct compartment_membership {
+    std::array<std::vector<person_t>, std::size(states_t{})> members;
+    std::vector<size_t> position;
+    std::vector<size_t> compartment;
+
+    explicit compartment_membership(const sir_state<states_t> &state)
+        : position(state.size()), compartment(state.size()) {
+      for (auto person : std::ranges::views::iota(0UL, state.size())) {
+        const auto &this_state = state.potential_states[person];
+        if (this_state.count() != 1) {
+          throw "Exact simulation requires every person to be in exactly one compartment";
+        }
+        size_t this_compartment = 0;
+        while (!this_state[this_compartment]) {
+          ++this_compartment;
+        }
+        compartment[person] = this_compartment;
+        position[person] = std::size(members[this_compartment]);
+        members[this_compartment].push_back(person);
+      }
+    }
+
+    //! \brief Number of people in any of the compartments in mask
+    size_t count(const std::bitset<std::size(states_t{})> &mask) const {
+      size_t rc = 0;
+      for (size_t this_compartment = 0; this_compartment < std::size(states_t{});
+           ++this_compartment) {
+        if (mask[this_compartment]) {
+          rc += std::size(members[this_compartment]);
+        }
+      }
+      return (rc);
+    }
+
+    //! \brief Pick a person uniformly from the people in any of the compartments in mask
+    person_t sample(const std::bitset<std::size(states_t{})> &mask, auto &random_source) const {
+      std::uniform_int_distribution<size_t> dist(0UL, count(mask) - 1);
+      size_t offset = dist(random_source);
+      for (size_t this_compartment = 0; this_compartment < std::size(states_t{});
+           ++this_compartment) {
+        if (mask[this_compartment]) {
+          if (offset < std::size(members[this_compartment])) {
+            return (members[this_compartment][offset]);
+          }
+          offset -= std::size(members[this_compartment]);
+        }
+      }
+      throw "Sampled past the end of the compartments";
+    }
+
+    //! \brief Move a person to another compartment
+    void move(person_t person, size_t to_compartment) {
+      auto &from = members[compartment[person]];
+      position[from.back()] = position[person];
+      from[position[person]] = from.back();
+      from.pop_back();
+      compartment[person] = to_compartment;
+      position[person] = std::size(members[to_compartment]);
+      members[to_compartment].push_back(person);
+    }
+
+    //! \brief Aggregate counts of the world, without a population scan
+    aggregated_sir_state<states_t> aggregate(epidemic_time_t time) const {
+      potential_state_counts_t<states_t> counts{};
+      for (size_t this_compartment = 0; this_compartment < std::size(states_t{});
+           ++this_compartment) {
+        counts[1UL << this_compartment] = std::size(members[this_compartment]);
+      }
+      return (aggregated_sir_state<states_t>{counts, time});
+    }
+  };
+
+  //! \defgroup Exact_Simulation Exact Simulation
+  //! @{
+  /*!
+   * \brief Run an exact continuous time simulation of a single world
+   *
+   * Uses the next reaction method (Gibson and Bruck 2000). Each event type has a putative firing
+   * time stored in an indexed priority queue; after an event fires only the event types whose
+   * preconditions involve a compartment that changed are updated, so each event costs
+   * O(log(number of event types)) plus the number of dependent event types.
+   *
+   * The propensity of an event type is its rate times the number of candidate events, i.e. the
+   * product over its preconditions of the number of people satisfying that precondition, which
+   * is the size of the cartesian product used by single_type_event_generator. When an event fires,
+   * one person is drawn uniformly for each precondition.
+   *
+   * @param all_event_types A tuple of sir_event_types, as passed to run_simulation.
+   * @param initial_conditions A simple sir_state (every person in exactly one compartment).
+   * @param event_rates An array with one element for each event type containing the rate at which
+   * each candidate event happens per unit time. For the small per step probabilities used by
+   * run_simulation the probability can be passed as is.
+   * @param snapshot_times Times at which to record the state, in increasing order.
+   * @param simulation_seed Random seed.
+   * @return A vector of aggregated states, one for each snapshot time.
+   */
+  template <typename states_t, typename any_event_type,
+            typename random_engine_t = std::default_random_engine>
+  auto run_exact_simulation(
+      const auto &all_event_types, const sir_state<states_t> &initial_conditions,
+      const std::array<double, std::variant_size_v<any_event_type>> &event_rates,
+      const std::vector<epidemic_time_t> &snapshot_times, size_t simulation_seed = 2) {
+    if (!std::ranges::is_sorted(snapshot_times)) {
+      throw "Snapshot times should be in increasing order";
+    }
+    constexpr size_t number_of_event_types = std::variant_size_v<any_event_type>;
+    constexpr double never = std::numeric_limits<double>::infinity();
+
+    random_engine_t random_source{simulation_seed};
+    std::exponential_distribution<> waiting_time(1.0);
+
+    const event_type_table<states_t, any_event_type> event_types{all_event_types};
+    compartment_membership<states_t> membership{initial_conditions};
+
+    // Compartments read by each event type, and compartments changed by each event type
+    std::array<std::bitset<std::size(states_t{})>, number_of_event_types> reads{};
+    std::array<std::bitset<std::size(states_t{})>, number_of_event_types> writes{};
+    for (auto event_index : std::ranges::views::iota(0UL, number_of_event_types)) {
+      const auto &type = event_types[event_index];
+      for (auto person_index : std::ranges::views::iota(0UL, type.size)) {
+        reads[event_index] |= type.preconditions[person_index];
+        if (type.postconditions[person_index]) {
+          writes[event_index] |= type.preconditions[person_index];
+          writes[event_index].set(static_cast<size_t>(type.postconditions[person_index].value()));
+        }
+      }
+    }
+    std::array<std::vector<size_t>, number_of_event_types> dependents{};
+    for (auto event_index : std::ranges::views::iota(0UL, number_of_event_types)) {
+      for (auto other_index : std::ranges::views::iota(0UL, number_of_event_types)) {
+        if ((writes[event_index] & reads[other_index]).any()) {
+          dependents[event_index].push_back(other_index);
+        }
+      }
+    }
+
+    const auto propensity = [&event_types, &event_rates, &membership](size_t event_index) {
+      const auto &type = event_types[event_index];
+      double rc = event_rates[event_index];
+      for (auto person_index : std::ranges::views::iota(0UL, type.size)) {
+        rc *= static_cast<double>(membership.count(type.preconditions[person_index]));
+      }
+      return (rc);
+    };
+    const auto putative_time = [&random_source, &waiting_time](double now, double rate) {
+      return (rate > 0 ? now + waiting_time(random_source) / rate : never);
+    };
+
+    double now = static_cast<double>(std::empty(snapshot_times) ? 0 : snapshot_times.front());
+    std::vector<double> propensities(number_of_event_types);
+    std::vector<double> firing_times(number_of_event_types);
+    for (auto event_index : std::ranges::views::iota(0UL, number_of_event_types)) {
+      propensities[event_index] = propensity(event_index);
+      firing_times[event_index] = putative_time(now, propensities[event_index]);
+    }
+    detail::indexed_priority_queue queue{firing_times};
+
+    std::vector<aggregated_sir_state<states_t>> results{};
+    results.reserve(std::size(snapshot_times));
+    for (auto snapshot_time : snapshot_times) {
+      while (queue.priority(queue.top()) <= static_cast<double>(snapshot_time)) {
+        const size_t fired = queue.top();
+        now = queue.priority(fired);
+        const auto &type = event_types[fired];
+
+        std::array<person_t, event_type_table<states_t, any_event_type>::max_size>
+            affected_people{};
+        for (auto person_index : std::ranges::views::iota(0UL, type.size)) {
+          affected_people[person_index]
+              = membership.sample(type.preconditions[person_index], random_source);
+        }
+        for (auto person_index : std::ranges::views::iota(0UL, type.size)) {
+          if (type.postconditions[person_index]) {
+            membership.move(affected_people[person_index],
+                            static_cast<size_t>(type.postconditions[person_index].value()));
+          }
+        }
+
+        for (auto event_index : dependents[fired]) {
+          const double old_propensity = propensities[event_index];
+          propensities[event_index] = propensity(event_index);
+          if ((event_index == fired) || (old_propensity == 0)) {
+            queue.update(event_index, putative_time(now, propensities[event_index]));
+          } else if (propensities[event_index] == 0) {
+            queue.update(event_index, never);
+          } else {
+            queue.update(event_index,
+                         now
+                             + (old_propensity / propensities[event_index])
+                                   * (queue.priority(event_index) - now));
+          }
+        }
+        if (std::ranges::find(dependents[fired], fired) == std::end(dependents[fired])) {
+          queue.update(fired, putative_time(now, propensities[fired]));
+        }
+      }
+      results.push_back(membership.aggregate(snapshot_time));
+    }
+    return (results);
+  }
+
+  /*!
+   * \brief Run an exact continuous time simulation, recording the state once per time step
+   *
+   * Convenience wrapper around run_exact_simulation reporting on the same grid as run_simulation
+   * (times 0 through epidemic_duration).
+   */
+  template <typename states_t, typename any_event_type,
+            typename random_engine_t = std::default_random_engine>
+  auto run_exact_simulation(
+      const auto &all_event_types, const sir_state<states_t> &initial_conditions,
+      const std::array<double, std::variant_size_v<any_event_type>> &event_rates,
+      const epidemic_time_t epidemic_duration = 365, size_t simulation_seed = 2) {
+    std::vector<epidemic_time_t> snapshot_times(static_cast<size_t>(epidemic_duration + 1));
+    std::iota(std::begin(snapshot_times), std::end(snapshot_times), epidemic_time_t{0});
+    return (run_exact_simulation<states_t, any_event_type, random_engine_t>(
+        all_event_types, initial_conditions, event_rates, snapshot_times, simulation_seed));
+  }
+  //! @}
+
+}  // namespace cfepi
+
+#endif
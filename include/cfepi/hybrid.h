@@ -0,0 +1,368 @@
+#include <cfepi/modeling.h>
+#include <cfepi/sample_view.h>
+#include <cfepi/sir.h>
+
+#include <random>
+#include <set>
+
+#ifndef __HYBRID_H_
+#  define __HYBRID_H_
+
+namespace cfepi {
+
+  /*!
+   * \class hybrid_population
+   * \brief A population where large compartments are tracked as counts.
+   *
+   * People in a counted compartment who have never been touched by an event are interchangeable
+   * and are in the same state in every world, so they are stored as a single count (the pool).
+   * When an event picks someone from the pool they are materialized: given a person index and a
+   * potential_states entry in every world, after which they are tracked like everyone else.
+   * People materialized during a step are staged until commit, so a step the state filters reject
+   * can put them back in the pool with roll_back.
+   */
+  template <typename states_t> struct hybrid_population {
+    //! \brief Compartments whose untouched members are tracked as counts
+    std::bitset<std::size(states_t{})> counted_compartments;
+    //! \brief Number of untouched people in each counted compartment
+    std::array<size_t, std::size(states_t{})> counts = {};
+    //! \brief Everyone else, at the start of the simulation
+    sir_state<states_t> initial_individuals;
+    //! \brief The compartment of each person materialized since the last commit, in order
+    std::vector<size_t> staged = {};
+
+    //! \brief Split a simple state, counting every compartment with at least threshold people
+    hybrid_population(const sir_state<states_t> &initial_conditions, const person_t threshold)
+        : initial_individuals(0UL) {
+      initial_individuals.time = initial_conditions.time;
+      const auto aggregates = aggregate_state(initial_conditions);
+      if (!is_simple(aggregates)) {
+        throw "Hybrid simulation requires every person to start in exactly one compartment";
+      }
+      for (size_t compartment = 0; compartment < std::size(states_t{}); ++compartment) {
+        if (aggregates.potential_state_counts[1UL << compartment] >= threshold) {
+          counted_compartments.set(compartment);
+          counts[compartment] = aggregates.potential_state_counts[1UL << compartment];
+        }
+      }
+      for (const auto &this_state : initial_conditions.potential_states) {
+        if (!(this_state & counted_compartments).any()) {
+          initial_individuals.potential_states.push_back(this_state);
+        }
+      }
+    }
+
+    //! \brief Take one person out of the pool for compartment and give them an entry in every
+    //! world
+    person_t materialize(size_t compartment, auto &setups_by_filter,
+                         sir_state<states_t> &current_state) {
+      std::bitset<std::size(states_t{})> this_state{};
+      this_state.set(compartment);
+      --counts[compartment];
+      for (auto &setup : setups_by_filter) {
+        setup.current_state.potential_states.push_back(this_state);
+        setup.states_entered.potential_states.emplace_back();
+        setup.states_remained.potential_states.push_back(this_state);
+      }
+      current_state.potential_states.push_back(this_state);
+      staged.push_back(compartment);
+      return (current_state.size() - 1);
+    }
+
+    //! \brief Keep the people materialized since the last commit
+    void commit() { staged.clear(); }
+
+    //! \brief Return the people materialized since the last commit to the pool. They are the last
+    //! people of every world, so this only shrinks the states.
+    void roll_back(auto &setups_by_filter, sir_state<states_t> &current_state) {
+      const size_t number_of_individuals = current_state.size() - std::size(staged);
+      for (auto &setup : setups_by_filter) {
+        setup.current_state.potential_states.resize(number_of_individuals);
+        setup.states_entered.potential_states.resize(number_of_individuals);
+        setup.states_remained.potential_states.resize(number_of_individuals);
+      }
+      current_state.potential_states.resize(number_of_individuals);
+      for (auto compartment : staged) {
+        ++counts[compartment];
+      }
+      staged.clear();
+    }
+
+    //! \brief Aggregate a world, adding the pool back in
+    aggregated_sir_state<states_t> aggregate(const sir_state<states_t> &individual_state) const {
+      auto rc = aggregate_state(individual_state);
+      for (size_t compartment = 0; compartment < std::size(states_t{}); ++compartment) {
+        rc.potential_state_counts[1UL << compartment] += counts[compartment];
+      }
+      return (rc);
+    }
+  };
+
+  namespace detail {
+    //! \brief count distinct values from [0, range), in increasing order (Floyd's algorithm)
+    inline std::set<size_t> sample_without_replacement(size_t count, size_t range,
+                                                       auto &random_source) {
+      std::set<size_t> rc{};
+      for (size_t upper = range - count; upper < range; ++upper) {
+        std::uniform_int_distribution<size_t> dist(0UL, upper);
+        if (!rc.insert(dist(random_source)).second) {
+          rc.insert(upper);
+        }
+      }
+      return (rc);
+    }
+  }  // namespace detail
+
+  /*!
+   * \brief Sample, filter and apply the events of one type in a hybrid population
+   *
+   * Events among individuals are sampled exactly as in single_event_type_run. For events with a
+   * precondition on a counted compartment, each combination of individuals for the other
+   * preconditions hits Binomial(pool size, probability) pool members, who are materialized. The
+   * cost is proportional to the number of individuals rather than the population size.
+   * random_source_1 is seeded from address as in sample_event_type.
+   */
+  template <typename states_t, typename any_event_type, typename any_event>
+  void hybrid_single_event_type_run(const auto &all_event_types, const auto &event_types,
+                                    hybrid_population<states_t> &population,
+                                    auto &setups_by_filter, auto &random_source_1,
+                                    sir_state<states_t> &current_state,
+                                    const auto &event_probabilities, const auto event_index,
+                                    random_stream_address address) {
+    using random_engine_t = std::remove_cvref_t<decltype(random_source_1)>;
+    address.event_type = event_index;
+    if constexpr (probability::counter_based_random_number_engine<random_engine_t>) {
+      random_source_1 = address.template stream<random_engine_t>();
+    } else {
+      random_source_1.seed(address.seed);
+    }
+    const auto &type = event_types[event_index];
+    const double probability = event_probabilities[event_index];
+    std::vector<any_event> sampled_events{};
+
+    {
+      auto event_range_generator
+          = single_type_event_generator<std::variant_alternative_t<event_index, any_event_type>>(
+              std::get<event_index>(all_event_types), current_state, event_index);
+      auto all_sampled_events_view = event_range_generator.template event_range<any_event>()
+                                     | probability::views::sample(probability, random_source_1);
+      sampled_events.reserve(all_sampled_events_view.expected_size());
+      for (const auto &event : all_sampled_events_view) {
+        sampled_events.push_back(event);
+      }
+    }
+
+    std::vector<size_t> pool_slots{};
+    for (auto person_index : std::ranges::views::iota(0UL, type.size)) {
+      if ((type.preconditions[person_index] & population.counted_compartments).any()) {
+        pool_slots.push_back(person_index);
+      }
+    }
+    if (std::size(pool_slots) > 1) {
+      throw "Hybrid simulation supports one precondition on counted compartments per event type";
+    }
+
+    if ((std::size(pool_slots) == 1) && (probability > 0)) {
+      const size_t pool_slot = pool_slots[0];
+      std::array<std::vector<person_t>, any_event::size()> candidates{};
+      size_t number_of_combinations = 1;
+      for (auto person_index : std::ranges::views::iota(0UL, type.size)) {
+        if (person_index == pool_slot) {
+          continue;
+        }
+        for (auto person : std::ranges::views::iota(0UL, current_state.size())) {
+          if ((type.preconditions[person_index] & current_state.potential_states[person]).any()) {
+            candidates[person_index].push_back(person);
+          }
+        }
+        number_of_combinations *= std::size(candidates[person_index]);
+      }
+
+      for (size_t compartment = 0; compartment < std::size(states_t{}); ++compartment) {
+        if (!(type.preconditions[pool_slot] & population.counted_compartments)[compartment]) {
+          continue;
+        }
+        const size_t pool_size = population.counts[compartment];
+        std::binomial_distribution<size_t> dist(pool_size, probability);
+        std::vector<person_t> materialized{};
+        for (size_t combination = 0; combination < number_of_combinations; ++combination) {
+          const size_t number_hit = dist(random_source_1);
+          if (number_hit == 0) {
+            continue;
+          }
+          any_event event{};
+          event.type_index = event_index;
+          size_t remainder = combination;
+          for (auto person_index : std::ranges::views::iota(0UL, type.size)) {
+            if (person_index != pool_slot) {
+              const auto &these_candidates = candidates[person_index];
+              event.affected_people[person_index]
+                  = these_candidates[remainder % std::size(these_candidates)];
+              remainder /= std::size(these_candidates);
+            }
+          }
+          // The first already_materialized pool positions are the people materialized by
+          // earlier combinations, the rest are still interchangeable
+          const size_t already_materialized = std::size(materialized);
+          for (auto position :
+               detail::sample_without_replacement(number_hit, pool_size, random_source_1)) {
+            if (position < already_materialized) {
+              event.affected_people[pool_slot] = materialized[position];
+            } else {
+              event.affected_people[pool_slot]
+                  = population.materialize(compartment, setups_by_filter, current_state);
+              materialized.push_back(event.affected_people[pool_slot]);
+            }
+            sampled_events.push_back(event);
+          }
+        }
+      }
+    }
+
+    for (auto &setup : setups_by_filter) {
+      for (const auto &event : sampled_events) {
+        if (setup.event_filter_(event, setup.current_state, random_source_1)
+            && any_state_check_preconditions<any_event_type, states_t>{setup.current_state,
+                                                                       event_types}(event)) {
+          apply_accepted_event(setup, event_types, event);
+        }
+      }
+    }
+  }
+
+  //! \defgroup Hybrid_Simulation Hybrid Simulation
+  //! @{
+  /*!
+   * \brief Run a counterfactual simulation tracking large compartments as counts
+   *
+   * Takes the same arguments as run_simulation, plus a threshold: every compartment with at least
+   * count_threshold people in the initial conditions is tracked as a count, and only people who
+   * have left it get potential states. Memory and per step cost are proportional to the number of
+   * people who have been touched by an event rather than to the population.
+   *
+   * Event filters, state filters and state modifiers only see individuals; people still in the
+   * pool are in the same state in every world. People materialized by a step the state filters
+   * reject go back to the pool. Random streams are chosen as in run_simulation, so a counter
+   * based engine gives every event type, reset and world its own stream.
+   *
+   * event_probabilities may be a fixed array or a probability_schedule.
+   *
+   * @return A vector of aggregated states for each world, one for each time step.
+   */
+  template <typename states_t, typename any_event_type, typename any_event,
+            typename random_engine_t = std::default_random_engine>
+  auto run_hybrid_simulation(
+      auto all_event_types, const sir_state<states_t> &initial_conditions,
+      const probability_schedule<std::variant_size_v<any_event_type>> &event_probabilities,
+      const std::vector<filtration_tuple<states_t, any_event, random_engine_t>> &filters,
+      const epidemic_time_t epidemic_duration = 365, size_t simulation_seed = 2,
+      const person_t count_threshold = 10000) {
+    if (std::begin(filters) == std::end(filters)) {
+      throw "There should be at least one setup\n";
+    }
+
+    random_engine_t random_source_1{simulation_seed};
+    const event_type_table<states_t, any_event_type> event_types{all_event_types};
+    hybrid_population<states_t> population{initial_conditions, count_threshold};
+
+    std::vector<filtration_setup<states_t, any_event, random_engine_t>> setups_by_filter{};
+    for (auto filter : filters) {
+      setups_by_filter.push_back(filtration_setup<states_t, any_event, random_engine_t>(
+          population.initial_individuals, filter));
+    }
+
+    // Called before the setups are reset, so each step carries the event counts of its events
+    const auto aggregate_all = [&population, &setups_by_filter]() {
+      std::vector<aggregated_sir_state<states_t>> rc{};
+      for (const auto &setup : setups_by_filter) {
+        rc.push_back(population.aggregate(setup.current_state));
+        rc.back().event_counts = setup.event_counts;
+        rc.back().event_counts.resize(std::variant_size_v<any_event_type>);
+      }
+      return (rc);
+    };
+
+    std::vector<std::vector<aggregated_sir_state<states_t>>> results{aggregate_all()};
+    results.reserve(static_cast<size_t>(epidemic_duration + 1));
+
+    for (epidemic_time_t t = 0UL; t < epidemic_duration; ++t) {
+      const auto event_probabilities_now = event_probabilities(t);
+      auto current_state = std::transform_reduce(
+          std::begin(setups_by_filter) + 1, std::end(setups_by_filter),
+          setups_by_filter[0].current_state, [](const auto &x, const auto &y) { return (x || y); },
+          [](const auto &x) { return (x.current_state); });
+
+      bool all_states_allowed = false;
+      std::vector<sir_state<states_t>> states_next{};
+      for (size_t reset = 0; !all_states_allowed; ++reset) {
+        population.roll_back(setups_by_filter, current_state);
+        for (auto &x : setups_by_filter) {
+          x.reset();
+        }
+        cfor::constexpr_for<0, std::variant_size_v<any_event_type>, 1>(
+            [&](const auto event_index) {
+              if constexpr (!probability::counter_based_random_number_engine<random_engine_t>) {
+                simulation_seed = random_source_1();
+              }
+              hybrid_single_event_type_run<states_t, any_event_type, any_event>(
+                  all_event_types, event_types, population, setups_by_filter, random_source_1,
+                  current_state, event_probabilities_now, event_index,
+                  random_stream_address{simulation_seed, t, reset});
+            });
+
+        states_next.clear();
+        all_states_allowed = true;
+        for (auto world : std::ranges::views::iota(0UL, std::size(setups_by_filter))) {
+          auto &setup = setups_by_filter[world];
+          auto next_state{setup.states_entered || setup.states_remained};
+          next_state.time = t;
+          if constexpr (probability::counter_based_random_number_engine<random_engine_t>) {
+            const random_stream_address address{simulation_seed, t, reset,
+                                                std::variant_size_v<any_event_type>, world};
+            random_source_1 = address.template stream<random_engine_t>(0);
+            if (setup.state_modifier_) {
+              setup.state_modifier_(next_state, random_source_1);
+            }
+            random_source_1 = address.template stream<random_engine_t>(1);
+          } else if (setup.state_modifier_) {
+            setup.state_modifier_(next_state, random_source_1);
+          }
+          all_states_allowed
+              = setup.state_filter_(setup, next_state, random_source_1) && all_states_allowed;
+          states_next.push_back(next_state);
+        }
+      }
+      population.commit();
+
+      for (auto i : std::ranges::views::iota(0UL, std::size(states_next))) {
+        setups_by_filter[i].current_state = states_next[i];
+      }
+      results.push_back(aggregate_all());
+      for (auto &setup : setups_by_filter) {
+        setup.reset();
+      }
+    }
+
+    return (results);
+  }
+
+  //! \brief Run a hybrid simulation with fixed event probabilities
+  template <typename states_t, typename any_event_type, typename any_event,
+            typename random_engine_t = std::default_random_engine>
+  auto run_hybrid_simulation(
+      auto all_event_types, const sir_state<states_t> &initial_conditions,
+      const std::array<double, std::variant_size_v<any_event_type>> event_probabilities,
+      const std::vector<filtration_tuple<states_t, any_event, random_engine_t>> &filters,
+      const epidemic_time_t epidemic_duration = 365, size_t simulation_seed = 2,
+      const person_t count_threshold = 10000) {
+    return (run_hybrid_simulation<states_t, any_event_type, any_event, random_engine_t>(
+        all_event_types, initial_conditions,
+        probability_schedule<std::variant_size_v<any_event_type>>(
+            [event_probabilities](epidemic_time_t) { return (event_probabilities); }),
+        filters, epidemic_duration, simulation_seed, count_threshold));
+  }
+  //! @}
+
+}  // namespace cfepi
+
+#endif
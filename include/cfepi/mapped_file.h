@@ -0,0 +1,79 @@
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <span>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+
+#ifndef __MAPPED_FILE_H_
+#  define __MAPPED_FILE_H_
+
+namespace cfepi {
+
+  /*!
+   * \class mapped_file
+   * \brief The read only contents of a whole file, memory mapped where the platform allows.
+   *
+   * Copies share the mapping, which is released when the last copy is destroyed, so spans into
+   * bytes() stay valid for as long as a copy is kept alongside them. Elsewhere the file is read
+   * into memory instead.
+   */
+  class mapped_file {
+  private:
+    std::shared_ptr<const void> mapping_;
+    std::span<const char> bytes_;
+
+  public:
+    explicit mapped_file(const std::string &path) {
+#  if defined(__unix__) || defined(__APPLE__)
+      const int file_descriptor = ::open(path.c_str(), O_RDONLY);
+      if (file_descriptor < 0) {
+        throw "Could not open file";
+      }
+      struct stat file_status {};
+      if (::fstat(file_descriptor, &file_status) != 0) {
+        ::close(file_descriptor);
+        throw "Could not read the size of the file";
+      }
+      const auto file_size = static_cast<size_t>(file_status.st_size);
+      if (file_size == 0) {
+        ::close(file_descriptor);
+        return;
+      }
+      void *address = ::mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, file_descriptor, 0);
+      ::close(file_descriptor);
+      if (address == MAP_FAILED) {
+        throw "Could not memory map the file";
+      }
+      mapping_ = std::shared_ptr<const void>(
+          address, [file_size](const void *x) { ::munmap(const_cast<void *>(x), file_size); });
+      bytes_ = std::span(static_cast<const char *>(address), file_size);
+#  else
+      std::ifstream file(path, std::ios::binary);
+      if (!file) {
+        throw "Could not open file";
+      }
+      auto contents = std::make_shared<std::vector<char>>(std::istreambuf_iterator<char>(file),
+                                                          std::istreambuf_iterator<char>());
+      bytes_ = std::span<const char>(*contents);
+      mapping_ = std::move(contents);
+#  endif
+    }
+
+    //! \brief The contents of the file
+    std::span<const char> bytes() const { return (bytes_); }
+    //! \brief Keeps the contents alive, for spans that outlive this object
+    const std::shared_ptr<const void> &mapping() const { return (mapping_); }
+  };
+
+}  // namespace cfepi
+
+#endif
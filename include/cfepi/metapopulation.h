@@ -0,0 +1,301 @@
+#include <cfepi/modeling.h>
+#include <cfepi/random.h>
+#include <cfepi/sir.h>
+
+#include <algorithm>
+#include <exception>
+#include <random>
+#include <thread>
+#include <vector>
+
+#ifndef __METAPOPULATION_H_
+#  define __METAPOPULATION_H_
+
+namespace cfepi {
+
+  /*!
+   * \class migration_matrix
+   * \brief Per step probabilities of a person moving between patches.
+   *
+   * rates is row major: rates[from * number_of_patches + to] is the probability that a person in
+   * patch from moves to patch to at the end of a step. The diagonal is ignored, and the rest of
+   * each row should sum to at most one.
+   */
+  struct migration_matrix {
+    size_t number_of_patches = 1;
+    std::vector<double> rates = {0.0};
+
+    double operator()(size_t from, size_t to) const {
+      return (rates[from * number_of_patches + to]);
+    }
+
+    //! \brief Probability that a person in patch from leaves it during a step
+    double leaving(size_t from) const {
+      double rc = 0;
+      for (auto to : std::ranges::views::iota(0UL, number_of_patches)) {
+        rc += (to == from) ? 0.0 : (*this)(from, to);
+      }
+      return (rc);
+    }
+
+    //! \brief Throw unless the matrix is consistent
+    void validate() const {
+      if (std::size(rates) != number_of_patches * number_of_patches) {
+        throw "Migration matrix should have one rate for each pair of patches";
+      }
+      if (std::ranges::any_of(rates, [](double x) { return (x < 0); })) {
+        throw "Migration rates should be non-negative";
+      }
+      for (auto from : std::ranges::views::iota(0UL, number_of_patches)) {
+        if (leaving(from) > 1.0) {
+          throw "Migration rates out of a patch should sum to at most one";
+        }
+      }
+    }
+  };
+
+  /*!
+   * \class metapopulation_patch
+   * \brief One patch of a metapopulation: a world for each filter and the patch's own random
+   * engine, so patches can be stepped independently.
+   */
+  template <typename states_t, typename any_event,
+            typename random_engine_t = std::default_random_engine>
+  struct metapopulation_patch {
+    std::vector<filtration_setup<states_t, any_event, random_engine_t>> setups_by_filter;
+    size_t seed;
+    random_engine_t random_source;
+    size_t resets = 0;
+
+    metapopulation_patch(const sir_state<states_t> &initial_conditions,
+                         const std::vector<filtration_tuple<states_t, any_event, random_engine_t>>
+                             &filters,
+                         size_t patch_seed)
+        : seed(patch_seed), random_source(patch_seed) {
+      for (const auto &filter : filters) {
+        setups_by_filter.emplace_back(initial_conditions, filter);
+      }
+    }
+
+    std::vector<aggregated_sir_state<states_t>> aggregate() const {
+      std::vector<aggregated_sir_state<states_t>> rc{};
+      for (const auto &setup : setups_by_filter) {
+        rc.push_back(setup.current_counts);
+      }
+      return (rc);
+    }
+  };
+
+  namespace detail {
+    /*!
+     * \brief Move people between patches
+     *
+     * A person moves with their state in every world. Emigrants are chosen from the state at
+     * the start of the phase, so nobody moves twice in one step, and are appended to their
+     * destination in patch order, so the result does not depend on thread scheduling.
+     */
+    template <typename states_t>
+    void migrate(auto &patches, const migration_matrix &migration, auto &random_source) {
+      using person_states = std::vector<std::bitset<std::size(states_t{})>>;
+      std::vector<std::vector<person_states>> arrivals(std::size(patches));
+      for (auto from : std::ranges::views::iota(0UL, std::size(patches))) {
+        auto &setups = patches[from].setups_by_filter;
+        const size_t population_size = setups.front().current_state.size();
+        const double leaving = migration.leaving(from);
+        if ((population_size == 0) || (leaving <= 0)) {
+          continue;
+        }
+        std::vector<double> destination_weights(std::size(patches));
+        for (auto to : std::ranges::views::iota(0UL, std::size(patches))) {
+          destination_weights[to] = (to == from) ? 0.0 : migration(from, to);
+        }
+        std::discrete_distribution<size_t> destination(std::begin(destination_weights),
+                                                       std::end(destination_weights));
+        std::vector<size_t> emigrants{};
+        for (auto person : std::ranges::views::iota(0UL, population_size)
+                               | probability::views::sample(leaving, random_source)) {
+          emigrants.push_back(person);
+        }
+        // Remove from the back so swapping in the last person never moves an emigrant
+        for (auto person : emigrants | std::ranges::views::reverse) {
+          person_states this_person{};
+          for (auto &setup : setups) {
+            auto &potential_states = setup.current_state.potential_states;
+            this_person.push_back(potential_states[person]);
+            --setup.current_counts.potential_state_counts[potential_states[person].to_ulong()];
+            potential_states[person] = potential_states.back();
+            potential_states.pop_back();
+          }
+          arrivals[destination(random_source)].push_back(std::move(this_person));
+        }
+      }
+      for (auto to : std::ranges::views::iota(0UL, std::size(patches))) {
+        for (auto &setup : patches[to].setups_by_filter) {
+          setup.current_state.potential_states.reserve(setup.current_state.size()
+                                                       + std::size(arrivals[to]));
+        }
+        for (const auto &this_person : arrivals[to]) {
+          for (auto world : std::ranges::views::iota(0UL, std::size(this_person))) {
+            auto &setup = patches[to].setups_by_filter[world];
+            setup.current_state.potential_states.push_back(this_person[world]);
+            ++setup.current_counts.potential_state_counts[this_person[world].to_ulong()];
+          }
+        }
+      }
+      // Pending changes are empty after a step, so only their size has to follow the population
+      for (auto &patch : patches) {
+        for (auto &setup : patch.setups_by_filter) {
+          setup.states_entered.potential_states.resize(setup.current_state.size());
+          setup.reset();
+        }
+      }
+    }
+  }  // namespace detail
+
+  //! \defgroup Metapopulation Metapopulation Simulation
+  //! @{
+  /*!
+   * \brief Run a counterfactual simulation of a population split into patches
+   *
+   * Each time step, every patch runs the same step as run_simulation on its own people (so
+   * interaction events only happen within a patch), with patches divided between threads. Then
+   * people move between patches according to migration. Each patch has its own random engine
+   * seeded from simulation_seed, and migration is done on one thread, so the results do not
+   * depend on number_of_threads.
+   *
+   * @param patch_initial_conditions The initial state of each patch.
+   * @param migration Per step probabilities of moving between patches, with one patch for each
+   * element of patch_initial_conditions.
+   * @param filters As for run_simulation. Every patch has one world for each filter, and the
+   * filters of different patches are called concurrently, so they must be thread safe. Person
+   * indices are per patch and change when people migrate.
+   * @param number_of_threads Threads to step patches on; 0 uses one per hardware thread.
+   *
+   * The other parameters are as for run_simulation.
+   * @return For each time step (with the initial conditions twice, as for run_simulation), for
+   * each patch, an aggregated state for each world.
+   */
+  template <typename states_t, typename any_event_type, typename any_event,
+            typename random_engine_t = std::default_random_engine>
+  auto run_metapopulation_simulation(
+      auto all_event_types, const std::vector<sir_state<states_t>> &patch_initial_conditions,
+      const probability_schedule<std::variant_size_v<any_event_type>> &event_probabilities,
+      const migration_matrix &migration,
+      const std::vector<filtration_tuple<states_t, any_event, random_engine_t>> &filters,
+      const epidemic_time_t epidemic_duration = 365, size_t simulation_seed = 2,
+      size_t number_of_threads = 0) {
+    if (std::begin(filters) == std::end(filters)) {
+      throw "There should be at least one setup\n";
+    }
+    if (std::empty(patch_initial_conditions)) {
+      throw "There should be at least one patch";
+    }
+    if (migration.number_of_patches != std::size(patch_initial_conditions)) {
+      throw "The migration matrix should have one row for each patch";
+    }
+    migration.validate();
+    if (number_of_threads == 0) {
+      number_of_threads = std::max(1U, std::thread::hardware_concurrency());
+    }
+    number_of_threads = std::min(number_of_threads, std::size(patch_initial_conditions));
+
+    const event_type_table<states_t, any_event_type> event_types{all_event_types};
+
+    probability::xoshiro256starstar seeder{simulation_seed};
+    std::vector<metapopulation_patch<states_t, any_event, random_engine_t>> patches{};
+    for (const auto &initial_conditions : patch_initial_conditions) {
+      patches.emplace_back(initial_conditions, filters, static_cast<size_t>(seeder()));
+    }
+    random_engine_t migration_random_source{static_cast<size_t>(seeder())};
+
+    const auto aggregate_patches = [&patches]() {
+      std::vector<std::vector<aggregated_sir_state<states_t>>> rc{};
+      for (const auto &patch : patches) {
+        rc.push_back(patch.aggregate());
+      }
+      return (rc);
+    };
+
+    std::vector<std::vector<std::vector<aggregated_sir_state<states_t>>>> results{
+        aggregate_patches()};
+    results.reserve(static_cast<size_t>(epidemic_duration + 2));
+    results.push_back(results.front());
+
+    for (epidemic_time_t t = 0UL; t < epidemic_duration; ++t) {
+      std::cout << "Time " << t << "\n";
+      auto event_probabilities_now = event_probabilities(t);
+
+      const auto step_patches = [&](size_t first_patch) {
+        for (size_t patch_index = first_patch; patch_index < std::size(patches);
+             patch_index += number_of_threads) {
+          auto &patch = patches[patch_index];
+          auto patch_time = t;
+          single_time_run<states_t, any_event_type, any_event>(
+              patch.setups_by_filter, all_event_types, event_types, patch_time,
+              patch.random_source, event_probabilities_now, patch.seed, patch.resets);
+        }
+      };
+      std::vector<std::exception_ptr> errors(number_of_threads);
+      {
+        std::vector<std::jthread> workers{};
+        for (auto worker : std::ranges::views::iota(1UL, number_of_threads)) {
+          workers.emplace_back([&step_patches, &errors, worker]() {
+            try {
+              step_patches(worker);
+            } catch (...) {
+              errors[worker] = std::current_exception();
+            }
+          });
+        }
+        try {
+          step_patches(0UL);
+        } catch (...) {
+          errors[0] = std::current_exception();
+        }
+      }
+      for (const auto &error : errors) {
+        if (error) {
+          std::rethrow_exception(error);
+        }
+      }
+
+      detail::migrate<states_t>(patches, migration, migration_random_source);
+      results.push_back(aggregate_patches());
+    }
+
+    size_t resets = 0;
+    for (const auto &patch : patches) {
+      resets += patch.resets;
+    }
+    std::cout << "Ran with " << resets << " resets\n";
+
+    return (results);
+  }
+
+  /*!
+   * \brief Run a counterfactual simulation of a population split into patches
+   * @param event_probabilities An array with one element for each event containing the probability
+   * of that event.
+   *
+   * The other parameters are as for the version taking a probability_schedule.
+   */
+  template <typename states_t, typename any_event_type, typename any_event,
+            typename random_engine_t = std::default_random_engine>
+  auto run_metapopulation_simulation(
+      auto all_event_types, const std::vector<sir_state<states_t>> &patch_initial_conditions,
+      const std::array<double, std::variant_size_v<any_event_type>> event_probabilities,
+      const migration_matrix &migration,
+      const std::vector<filtration_tuple<states_t, any_event, random_engine_t>> &filters,
+      const epidemic_time_t epidemic_duration = 365, size_t simulation_seed = 2,
+      size_t number_of_threads = 0) {
+    return (run_metapopulation_simulation<states_t, any_event_type, any_event, random_engine_t>(
+        all_event_types, patch_initial_conditions,
+        probability_schedule<std::variant_size_v<any_event_type>>(
+            [event_probabilities](epidemic_time_t) { return (event_probabilities); }),
+        migration, filters, epidemic_duration, simulation_seed, number_of_threads));
+  }
+  //! @}
+
+}  // namespace cfepi
+
+#endif
@@ -1,7 +1,18 @@
+#include <cfepi/random.h>
 #include <cfepi/sample_view.h>
 #include <cfepi/sir.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <limits>
+#include <span>
+#include <thread>
 #include <utility>
+#include <vector>
 
 #ifndef __MODELING_H_
 #  define __MODELING_H_
@@ -26,28 +37,155 @@ namespace cfepi {
           { F(s, r) };
         };
 
+  /*!
+   * \class person_set
+   * \brief A set of people, as a bitmap for membership and a list for iteration.
+   *
+   * Inserting and clearing cost time proportional to the people in the set, not the population.
+   */
+  class person_set {
+  private:
+    std::vector<std::uint64_t> bitmap_{};
+    std::vector<person_t> people_{};
+
+  public:
+    //! \brief Add a person, if they are not already in the set
+    void insert(const person_t person) {
+      if (person / 64 >= std::size(bitmap_)) {
+        bitmap_.resize(person / 64 + 1);
+      }
+      const std::uint64_t bit = std::uint64_t{1} << (person % 64);
+      if (!(bitmap_[person / 64] & bit)) {
+        bitmap_[person / 64] |= bit;
+        people_.push_back(person);
+      }
+    }
+    void clear() {
+      for (auto person : people_) {
+        bitmap_[person / 64] = 0;
+      }
+      people_.clear();
+    }
+    size_t size() const { return (std::size(people_)); }
+    bool empty() const { return (std::empty(people_)); }
+    auto begin() const { return (std::begin(people_)); }
+    auto end() const { return (std::end(people_)); }
+  };
+
+  /*!
+   * \class event_conflicts
+   * \brief The changes accepted in one world during a reset, keeping one event for each person.
+   *
+   * When several accepted events change the same person (say they are infected and vaccinated in
+   * the same step), applying all of them puts the person in several potential states of one
+   * world. Here each change carries a key, and only the change with the smallest key is applied
+   * to each person. A bitmap of the people touched so far detects conflicts as changes are
+   * recorded, so changes are only sorted when there is a conflict, and clearing it costs one bit
+   * per change rather than one per person. The result does not depend on the order changes are
+   * recorded in. Covers the people from first_person on, growing as needed.
+   */
+  template <typename states_t> class event_conflicts {
+  public:
+    struct change {
+      person_t person;
+      //! \brief Smaller keys win, see competing_risk_key
+      double key;
+      size_t type_index;
+      std::bitset<std::size(states_t{})> entered;
+      std::bitset<std::size(states_t{})> left;
+    };
+
+  private:
+    person_t first_person_;
+    std::vector<std::uint64_t> touched_;
+    std::vector<change> changes_{};
+    size_t conflicts_ = 0;
+
+  public:
+    explicit event_conflicts(const person_t first_person = 0, const person_t number_of_people = 0)
+        : first_person_(first_person), touched_((number_of_people + 63) / 64) {}
+
+    //! \brief Record a change, noting a conflict if its person already has one
+    void record(const change &this_change) {
+      const person_t offset = this_change.person - first_person_;
+      if (offset / 64 >= std::size(touched_)) {
+        touched_.resize(offset / 64 + 1);
+      }
+      const std::uint64_t bit = std::uint64_t{1} << (offset % 64);
+      conflicts_ += (touched_[offset / 64] & bit) ? 1 : 0;
+      touched_[offset / 64] |= bit;
+      changes_.push_back(this_change);
+    }
+
+    //! \brief Record the change event makes to each person it moves
+    void record(const auto &event_types, const auto &event, const double key) {
+      const auto &type = event_types[event.type_index];
+      for (auto person_index : std::ranges::views::iota(0UL, type.size)) {
+        if (type.postconditions[person_index]) {
+          change this_change{event.affected_people[person_index], key, event.type_index, {},
+                             type.preconditions[person_index]};
+          this_change.entered.set(static_cast<size_t>(type.postconditions[person_index].value()));
+          record(this_change);
+        }
+      }
+    }
+
+    //! \brief Changes recorded for a person who already had one, since the last apply
+    size_t conflicts() const { return (conflicts_); }
+
+    /*!
+     * \brief Apply the winning change for each touched person to the pending changes of a world,
+     * then clear.
+     * @param on_apply Called with each change applied.
+     * @return The number of changes discarded.
+     */
+    size_t apply(sir_state<states_t> &states_entered, sir_state<states_t> &states_remained,
+                 const auto &on_apply) {
+      const size_t rc = conflicts_;
+      if (conflicts_ > 0) {
+        // Ties on the key are broken by the change itself, so the winner is a function of the
+        // set of recorded changes
+        std::ranges::sort(changes_, {}, [](const change &x) {
+          return (std::make_tuple(x.person, x.key, x.type_index, x.entered.to_ullong(),
+                                  x.left.to_ullong()));
+        });
+        const auto duplicates = std::ranges::unique(
+            changes_, [](const change &x, const change &y) { return (x.person == y.person); });
+        changes_.erase(std::begin(duplicates), std::end(duplicates));
+      }
+      for (const auto &this_change : changes_) {
+        states_entered.potential_states[this_change.person] |= this_change.entered;
+        states_remained.potential_states[this_change.person] &= ~this_change.left;
+        on_apply(this_change);
+        const person_t offset = this_change.person - first_person_;
+        touched_[offset / 64] &= ~(std::uint64_t{1} << (offset % 64));
+      }
+      changes_.clear();
+      conflicts_ = 0;
+      return (rc);
+    }
+    size_t apply(sir_state<states_t> &states_entered, sir_state<states_t> &states_remained) {
+      return (apply(states_entered, states_remained, [](const change &) {}));
+    }
+  };
+
   /*!
    * \class filtration_setup
    * \brief Data structure for storing a single world's worth of data.
    *
    * Includes the current state of the system, pending changes to that state, and filter functions
-   * needed to update that state.
+   * needed to update that state. The filter functions are passed the simulation's random number
+   * engine, of type random_engine_t.
    */
-  template <typename states_t, typename any_event> struct filtration_setup {
-    /*
+  template <typename states_t, typename any_event,
+            typename random_engine_t = std::default_random_engine>
+  struct filtration_setup {
     using event_filter_fun_type = std::function<bool(const any_event &, const sir_state<states_t> &,
-                                                     std::default_random_engine &)>;
+                                                     random_engine_t &)>;
     using state_filter_fun_type
-        = std::function<bool(const filtration_setup<states_t, any_event> &,
-                             const sir_state<states_t> &, std::default_random_engine &)>;
-    using state_modify_fun_type
-        = std::function<void(sir_state<states_t> &, std::default_random_engine &)>;
-    */
-    using event_filter_fun_type = typename (*bool)(const any_event &, const sir_state<states_t> &,
-					  std::default_random_engine &);
-    using state_filter_fun_type = typename (*bool)(const filtration_setup<states_t, any_event> &,
-					  const sir_state<states_t> &, std::default_random_engine &);
-    using state_modify_fun_type = typename (*void)(sir_state<states_t> &, std::default_random_engine &);
+        = std::function<bool(const filtration_setup<states_t, any_event, random_engine_t> &,
+                             const sir_state<states_t> &, random_engine_t &)>;
+    using state_modify_fun_type = std::function<void(sir_state<states_t> &, random_engine_t &)>;
     using filtration_tuple
         = std::tuple<event_filter_fun_type, state_filter_fun_type, state_modify_fun_type>;
 
@@ -63,8 +201,18 @@ namespace cfepi {
     //! determine if the current state is valid. Returns true if state is ok, and false if this time
     //! step should be re-done.
     state_filter_fun_type state_filter_;
-    //! \brief A filter to modify the state used to apply certain kinds of interventions.
+    //! \brief A filter to modify the state used to apply certain kinds of interventions. May be
+    //! empty, for no modification.
     state_modify_fun_type state_modifier_;
+    //! \brief Changes waiting for conflict resolution, when it is enabled (see run_simulation)
+    event_conflicts<states_t> conflicts{};
+    //! \brief aggregate_state(current_state), kept up to date by single_time_run and apply
+    aggregated_sir_state<states_t> current_counts;
+    //! \brief The people whose pending changes have been touched since reset. Whatever changes
+    //! states_entered or states_remained should add the people it changes.
+    person_set touched_people{};
+    //! \brief For each event type, the people it has moved since reset, see count_change
+    std::vector<size_t> event_counts{};
     //! \brief Construct from an initial state and a filter. This is the standard constructor
     filtration_setup(const sir_state<states_t> &initial_state,
                      const event_filter_fun_type &event_filter,
@@ -75,7 +223,8 @@ namespace cfepi {
           states_remained(initial_state),
           event_filter_(event_filter),
           state_filter_(state_filter),
-          state_modifier_(state_modifier) {
+          state_modifier_(state_modifier),
+          current_counts(aggregate_state(initial_state)) {
       states_entered.reset();
     };
     filtration_setup(const sir_state<states_t> &initial_state, const filtration_tuple &filters)
@@ -84,90 +233,594 @@ namespace cfepi {
           states_remained(initial_state),
           event_filter_(std::get<0>(filters)),
           state_filter_(std::get<1>(filters)),
-          state_modifier_(std::get<2>(filters)) {
+          state_modifier_(std::get<2>(filters)),
+          current_counts(aggregate_state(initial_state)) {
       states_entered.reset();
     };
+    /*!
+     * \brief aggregate_state(states_entered), from the touched people only
+     *
+     * Everyone else has entered no states, so this takes time proportional to the number of
+     * people changed since reset. Use this rather than aggregate_state in state filters, which
+     * are called on every reset. If nobody is touched, states_entered may have been changed
+     * without count_change, so every person is counted instead.
+     */
+    aggregated_sir_state<states_t> entered_counts() const {
+      if (std::empty(touched_people)) {
+        return (aggregate_state(states_entered));
+      }
+      aggregated_sir_state<states_t> rc{};
+      rc.time = states_entered.time;
+      rc.potential_state_counts[0] = states_entered.size() - std::size(touched_people);
+      for (auto person : touched_people) {
+        rc.potential_state_counts[states_entered.potential_states[person].to_ulong()] += 1;
+      }
+      return (rc);
+    }
+    /*!
+     * \brief aggregate_state(next_state), where next_state differs from current_state only for
+     * the touched people, in time proportional to their number
+     */
+    aggregated_sir_state<states_t> next_counts(const sir_state<states_t> &next_state) const {
+      auto rc = current_counts;
+      rc.time = next_state.time;
+      for (auto person : touched_people) {
+        rc.potential_state_counts[current_state.potential_states[person].to_ulong()] -= 1;
+        rc.potential_state_counts[next_state.potential_states[person].to_ulong()] += 1;
+      }
+      return (rc);
+    }
+    //! \brief Note a change to person's pending states made by an event of type type_index
+    void count_change(const person_t person, const size_t type_index) {
+      touched_people.insert(person);
+      if (type_index >= std::size(event_counts)) {
+        event_counts.resize(type_index + 1);
+      }
+      ++event_counts[type_index];
+    }
     //! \brief Apply pending changes to current state, then clear them
     void apply() {
-      current_state = states_entered || states_remained;
-      states_entered.reset();
-      states_remained = current_state;
+      auto next_state = states_entered || states_remained;
+      current_counts = next_counts(next_state);
+      current_counts.event_counts = event_counts;
+      current_state = std::move(next_state);
+      reset();
     };
     //! \brief Clear pending changes
     void reset() {
       states_entered.reset();
       states_remained = current_state;
+      touched_people.clear();
+      std::ranges::fill(event_counts, 0);
     };
+    /*!
+     * \brief Replace the current state, updating current_counts, and clear pending changes
+     * @param number_of_event_types The length of current_counts.event_counts.
+     */
+    void advance(const sir_state<states_t> &next_state, const size_t number_of_event_types) {
+      // A state modifier can change anyone, so only states it did not touch are incremental
+      current_counts = state_modifier_ ? aggregate_state(next_state) : next_counts(next_state);
+      current_counts.event_counts = event_counts;
+      current_counts.event_counts.resize(number_of_event_types);
+      current_state = next_state;
+      reset();
+    }
   };
 
+  /*!
+   * \class random_stream_address
+   * \brief Identifies one piece of work within a time step of run_simulation.
+   *
+   * With a counter based engine (see probability::counter_based_random_number_engine) each piece
+   * of work draws from its own stream, addressed by (seed, time, reset, event type, world, event),
+   * so results do not depend on the order in which the work is done. Sampling events is shared by
+   * every world and uses world all_worlds. The state modifier and state filter of a world use
+   * event type one past the last event type. With any other engine, the shared engine is reseeded
+   * from seed for each event type, and the rest of the address is unused.
+   */
+  struct random_stream_address {
+    //! \brief The world used for work shared by all worlds
+    static constexpr size_t all_worlds = std::numeric_limits<std::uint32_t>::max();
+    size_t seed = 0;
+    epidemic_time_t time = 0;
+    size_t reset = 0;
+    size_t event_type = 0;
+    size_t world = all_worlds;
+
+    //! \brief The stream for this address, and the event'th substream
+    template <probability::counter_based_random_number_engine random_engine_t>
+    random_engine_t stream(size_t event = 0) const {
+      return (random_engine_t::stream(
+          seed,
+          {static_cast<std::uint32_t>(time), static_cast<std::uint32_t>(reset),
+           static_cast<std::uint32_t>(event_type), static_cast<std::uint32_t>(world)},
+          event));
+    }
+  };
+
+  /*!
+   * \brief The key event claims the people it changes with, under a competing risks rule
+   *
+   * Each event gets an exponential waiting time with the hazard of its probability, drawn from a
+   * hash of the address and the event, and the event which would have happened first wins. So
+   * when events of several types compete for a person, each wins in proportion to its hazard,
+   * and the winner depends only on the events, not on the order or thread they were sampled on.
+   */
+  double competing_risk_key(const random_stream_address &address, const auto &event,
+                            const double probability) {
+    std::uint64_t hash = address.seed;
+    const auto mix = [&hash](std::uint64_t value) {
+      hash += value + 0x9e3779b97f4a7c15ULL;
+      hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+      hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+      hash ^= hash >> 31;
+    };
+    mix(static_cast<std::uint64_t>(address.time));
+    mix(address.reset);
+    mix(event.type_index);
+    for (auto person : event.affected_people) {
+      mix(person);
+    }
+    // A uniform on (0, 1] from the top 53 bits
+    const double uniform = static_cast<double>((hash >> 11) + 1) * 0x1.0p-53;
+    const double hazard = -std::log1p(-std::min(probability, 1 - 0x1.0p-53));
+    return (hazard > 0 ? -std::log(uniform) / hazard : std::numeric_limits<double>::infinity());
+  }
+
 }  // namespace cfepi
 
 namespace cfepi {
 
+  namespace detail {
+    //! \brief Run task(0) to task(number_of_tasks - 1) on number_of_threads threads, in any order
+    inline void run_on_threads(const size_t number_of_threads, const size_t number_of_tasks,
+                               const auto &task) {
+      std::atomic<size_t> next_task = 0;
+      std::vector<std::exception_ptr> errors(number_of_threads);
+      const auto work = [&task, &next_task, &errors, number_of_tasks](size_t worker) {
+        try {
+          for (size_t this_task = next_task++; this_task < number_of_tasks;
+               this_task = next_task++) {
+            task(this_task, worker);
+          }
+        } catch (...) {
+          errors[worker] = std::current_exception();
+        }
+      };
+      {
+        std::vector<std::jthread> workers{};
+        for (auto worker : std::ranges::views::iota(1UL, number_of_threads)) {
+          workers.emplace_back(work, worker);
+        }
+        work(0UL);
+      }
+      for (const auto &error : errors) {
+        if (error) {
+          std::rethrow_exception(error);
+        }
+      }
+    }
+
+    /*!
+     * \brief The number of chunks (see probability::sample_view::chunks) candidate events are
+     * sampled in
+     *
+     * Only depends on the number of candidates, so the sampled events do not depend on how many
+     * threads draw the chunks. Chunks of 2^18 candidates keep the bitmap of count first sampling
+     * in cache.
+     */
+    constexpr size_t number_of_sample_chunks(const size_t number_of_candidates) {
+      return (std::clamp<size_t>(number_of_candidates >> 18, 1UL, 256UL));
+    }
+  }  // namespace detail
+
+  /*!
+   * \brief Sample the events of one event type and filter them in every world
+   *
+   * Calls accept(world, event) for each sampled event which passes the event filter and the
+   * preconditions of that world. Only reads setups_by_filter, so event types can be sampled
+   * concurrently as long as each has its own random_source_1.
+   * @param number_of_threads Threads to draw the chunks of a uniform sample on, with a counter
+   * based engine. The events are the same for any number.
+   */
   template <typename states_t, typename any_event_type, typename any_event>
-  auto single_event_type_run(const auto &all_event_types, auto &setups_by_filter,
-                             auto &random_source_1, const auto &current_state,
-                             const auto &event_probabilities, const auto event_index,
-                             const size_t seed) {
-    random_source_1.seed(seed);
+  void sample_event_type(const auto &all_event_types, const auto &event_types,
+                         const auto &setups_by_filter, auto &random_source_1,
+                         const auto &current_state, const auto &event_probabilities,
+                         const auto event_index, random_stream_address address, auto &&accept,
+                         const size_t number_of_threads = 1) {
+    using random_engine_t = std::remove_cvref_t<decltype(random_source_1)>;
+    address.event_type = event_index;
+    if constexpr (probability::counter_based_random_number_engine<random_engine_t>) {
+      random_source_1 = address.template stream<random_engine_t>();
+    } else {
+      random_source_1.seed(address.seed);
+    }
     // This could be constructed once per time and accessed as a tuple
     auto event_range_generator
         = single_type_event_generator<std::variant_alternative_t<event_index, any_event_type>>(
-            std::get<event_index>(all_event_types), current_state);
+            std::get<event_index>(all_event_types), current_state, event_index);
 
     static_assert(std::ranges::input_range<decltype(event_range_generator.cartesian_range())>);
     if constexpr (!std::ranges::input_range<decltype(event_range_generator.cartesian_range())>) {
       throw "This shouldn't happen";
     }
 
-    auto all_sampled_events_view
-        = event_range_generator.event_range()
-          | probability::views::sample(event_probabilities[event_index], random_source_1);
-    auto setup_index_range = std::ranges::views::iota(0UL, setups_by_filter.size());
-    auto sampled_events_by_setup_view
-        = std::ranges::views::cartesian_product(setup_index_range, all_sampled_events_view);
-
-    auto filtered_events_by_setup_view = std::ranges::views::filter(
-        sampled_events_by_setup_view, [setups_by_filter = std::as_const(setups_by_filter),
-                                       &random_source_1, &event_index](const auto &x) {
-          const auto &filter = setups_by_filter[std::get<0>(x)].event_filter_;
-          const auto &state = setups_by_filter[std::get<0>(x)].current_state;
-          std::in_place_index_t<event_index> variant_index{};
-          const any_event event(variant_index, std::get<1>(x));
-          return (filter(event, state, random_source_1));
-        });
+    // Event types with heterogeneous rates (weighted_event_type) are sampled by thinning, event
+    // types on a contact network (network_event_type) along the edges of the network, stratified
+    // event types (stratified_event_type) block by block, and all others at a uniform
+    // probability. A uniform sample is drawn from bulk geometric skips (positions), or with a
+    // counter based engine count first (count_first_positions) in independent chunks of the
+    // candidates, which threads can share and which are allocated once at their exact size.
+    // Either way the events are sampled once and reused by every world.
+    const std::vector<any_event> sampled_events = [&]() {
+      const auto &this_event_type = std::get<event_index>(all_event_types);
+      if constexpr (requires { this_event_type.network; }) {
+        return (this_event_type.template sample_events<any_event>(
+            current_state, std::get<1>(event_range_generator.vectors), event_index,
+            event_probabilities[event_index], random_source_1));
+      } else if constexpr (requires { this_event_type.mixing; }) {
+        return (this_event_type.template sample_events<any_event>(
+            current_state, std::get<0>(event_range_generator.vectors),
+            std::get<1>(event_range_generator.vectors), event_index,
+            event_probabilities[event_index], random_source_1));
+      } else if constexpr (requires { this_event_type.weights; }) {
+        return (event_range_generator.template weighted_event_sample<any_event>(
+            this_event_type.weights, event_probabilities[event_index], random_source_1));
+      } else {
+        auto candidates = event_range_generator.template event_range<any_event>();
+        // The chunks point into the sample, so it has to outlive them
+        const auto sample
+            = candidates
+              | probability::views::sample(event_probabilities[event_index], random_source_1);
+        if constexpr (!probability::counter_based_random_number_engine<random_engine_t>) {
+          const auto positions = sample.positions();
+          std::vector<any_event> rc(std::size(positions));
+          for (auto index : std::ranges::views::iota(0UL, std::size(positions))) {
+            rc[index] = candidates[positions[index]];
+          }
+          return (rc);
+        } else {
+          const auto chunks
+              = sample.chunks(detail::number_of_sample_chunks(std::ranges::size(candidates)));
+          std::vector<std::vector<size_t>> positions(std::size(chunks));
+          detail::run_on_threads(number_of_threads, std::size(chunks),
+                                 [&chunks, &positions](size_t chunk, size_t) {
+                                   positions[chunk] = chunks[chunk].count_first_positions();
+                                 });
+          std::vector<size_t> offsets(std::size(chunks) + 1, 0UL);
+          for (auto chunk : std::ranges::views::iota(0UL, std::size(chunks))) {
+            offsets[chunk + 1] = offsets[chunk] + std::size(positions[chunk]);
+          }
+          std::vector<any_event> rc(offsets.back());
+          detail::run_on_threads(
+              number_of_threads, std::size(chunks),
+              [&chunks, &positions, &offsets, &rc](size_t chunk, size_t) {
+                const auto &chunk_candidates = chunks[chunk].base();
+                for (auto index : std::ranges::views::iota(0UL, std::size(positions[chunk]))) {
+                  rc[offsets[chunk] + index] = chunk_candidates[positions[chunk][index]];
+                }
+              });
+          return (rc);
+        }
+      }
+    }();
 
-    for (const auto x : sampled_events_by_setup_view) {
-      auto &setup = setups_by_filter[std::get<0>(x)];
-      if (any_state_check_preconditions<any_event_type, states_t>{setup.current_state}(
-              std::get<1>(x))) {
-        any_event_apply_entered_states{setup.states_entered}(std::get<1>(x));
-        any_event_apply_left_states{setup.states_remained}(std::get<1>(x));
+    // Preconditions known at compile time are checked by static_event_application, and others
+    // by a precondition_batch over all the events for each world
+    using this_event_type_t = std::variant_alternative_t<event_index, any_event_type>;
+    const precondition_batch batch{event_types[event_index],
+                                   std::span<const any_event>(sampled_events)};
+    std::vector<std::uint8_t> valid{};
+    for (auto world : std::ranges::views::iota(0UL, setups_by_filter.size())) {
+      const auto &setup = setups_by_filter[world];
+      if constexpr (!constexpr_event_type<this_event_type_t>) {
+        batch.check(setup.current_state, valid);
+      }
+      address.world = world;
+      for (auto index : std::ranges::views::iota(0UL, std::size(sampled_events))) {
+        const auto &event = sampled_events[index];
+        if constexpr (probability::counter_based_random_number_engine<random_engine_t>) {
+          auto event_random_source = address.template stream<random_engine_t>(index);
+          if (!setup.event_filter_(event, setup.current_state, event_random_source)) {
+            continue;
+          }
+        } else if (!setup.event_filter_(event, setup.current_state, random_source_1)) {
+          continue;
+        }
+        bool allowed = false;
+        if constexpr (constexpr_event_type<this_event_type_t>) {
+          allowed = static_event_application<this_event_type_t>::check(setup.current_state, event);
+        } else {
+          allowed = (valid[index] != 0);
+        }
+        if (allowed) {
+          accept(world, event);
+        }
+      }
+    }
+  }
+
+  //! \brief Apply an event which passed its filter and preconditions to the pending changes
+  void apply_accepted_event(auto &setup, const auto &event_types, const auto &event) {
+    any_event_apply_entered_states{setup.states_entered, event_types}(event);
+    any_event_apply_left_states{setup.states_remained, event_types}(event);
+    const auto &type = event_types[event.type_index];
+    for (auto person_index : std::ranges::views::iota(0UL, type.size)) {
+      if (type.postconditions[person_index]) {
+        setup.count_change(event.affected_people[person_index], event.type_index);
+      }
+    }
+  }
+
+  /*!
+   * \class concurrent_state_changes
+   * \brief Buffers for applying events to the pending changes of worlds from many threads.
+   *
+   * Bits of a std::bitset cannot be set from several threads at once, so each thread records
+   * the bits an event sets in states_entered and clears in states_remained into its own buffers
+   * instead. The buffers of a thread are split by ranges of people, so merge can apply them on
+   * as many threads as there are ranges without two threads touching the same person. Setting
+   * and clearing bits commutes, so the result is the same as applying the events serially. With
+   * conflict resolution each range resolves its own people with an event_conflicts, so the
+   * winners are those of serial resolution.
+   */
+  template <typename states_t> class concurrent_state_changes {
+  private:
+    struct change {
+      size_t world;
+      typename event_conflicts<states_t>::change person_change;
+    };
+    size_t number_of_ranges_;
+    person_t people_per_range_;
+    //! \brief buffers_[thread][range]
+    std::vector<std::vector<std::vector<change>>> buffers_;
+
+  public:
+    concurrent_state_changes(const person_t population_size, const size_t number_of_threads,
+                             const size_t number_of_ranges)
+        : number_of_ranges_(std::max(1UL, number_of_ranges)),
+          people_per_range_(std::max(1UL, (population_size + number_of_ranges_ - 1)
+                                              / number_of_ranges_)),
+          buffers_(number_of_threads, std::vector<std::vector<change>>(number_of_ranges_)) {}
+
+    /*!
+     * \brief Record an event which passed its filter and preconditions, from thread
+     * @param key The key of the event, used if merge resolves conflicts (see event_conflicts).
+     */
+    void record(const size_t thread, const size_t world, const auto &event_types,
+                const auto &event, const double key = 0) {
+      const auto &type = event_types[event.type_index];
+      for (auto person_index : std::ranges::views::iota(0UL, type.size)) {
+        if (type.postconditions[person_index]) {
+          const person_t person = event.affected_people[person_index];
+          change this_change{world,
+                             {person, key, event.type_index, {}, type.preconditions[person_index]}};
+          this_change.person_change.entered.set(
+              static_cast<size_t>(type.postconditions[person_index].value()));
+          buffers_[thread][std::min(number_of_ranges_ - 1, person / people_per_range_)].push_back(
+              this_change);
+        }
+      }
+    }
+
+    //! \brief Apply and clear every recorded change, with one thread per range of people
+    void merge(auto &setups_by_filter, const bool resolve_conflicts = false) {
+      // applied[range][world], counted in each world once merging is done
+      using person_change = typename event_conflicts<states_t>::change;
+      std::vector<std::vector<std::vector<person_change>>> applied(
+          number_of_ranges_, std::vector<std::vector<person_change>>(std::size(setups_by_filter)));
+      const auto merge_range = [this, &setups_by_filter, &applied,
+                                resolve_conflicts](size_t range) {
+        const auto on_apply = [&applied, range](size_t world) {
+          return ([&applied, range, world](const person_change &this_change) {
+            applied[range][world].push_back(this_change);
+          });
+        };
+        std::vector<event_conflicts<states_t>> conflicts_by_world{};
+        if (resolve_conflicts) {
+          conflicts_by_world.assign(std::size(setups_by_filter),
+                                    event_conflicts<states_t>{range * people_per_range_,
+                                                              people_per_range_});
+        }
+        for (auto &thread_buffers : buffers_) {
+          for (const auto &this_change : thread_buffers[range]) {
+            if (resolve_conflicts) {
+              conflicts_by_world[this_change.world].record(this_change.person_change);
+              continue;
+            }
+            auto &setup = setups_by_filter[this_change.world];
+            const auto &person_change = this_change.person_change;
+            setup.states_entered.potential_states[person_change.person] |= person_change.entered;
+            setup.states_remained.potential_states[person_change.person] &= ~person_change.left;
+            on_apply(this_change.world)(person_change);
+          }
+          thread_buffers[range].clear();
+        }
+        for (auto world : std::ranges::views::iota(0UL, std::size(conflicts_by_world))) {
+          auto &setup = setups_by_filter[world];
+          conflicts_by_world[world].apply(setup.states_entered, setup.states_remained,
+                                          on_apply(world));
+        }
+      };
+      {
+        std::vector<std::jthread> workers{};
+        for (auto range : std::ranges::views::iota(1UL, number_of_ranges_)) {
+          workers.emplace_back(merge_range, range);
+        }
+        merge_range(0UL);
+      }
+      for (const auto &range_applied : applied) {
+        for (auto world : std::ranges::views::iota(0UL, std::size(range_applied))) {
+          for (const auto &this_change : range_applied[world]) {
+            setups_by_filter[world].count_change(this_change.person, this_change.type_index);
+          }
+        }
       }
     }
   };
 
+  template <typename states_t, typename any_event_type, typename any_event>
+  auto single_event_type_run(const auto &all_event_types, const auto &event_types,
+                             auto &setups_by_filter, auto &random_source_1,
+                             const auto &current_state, const auto &event_probabilities,
+                             const auto event_index, random_stream_address address,
+                             const bool resolve_conflicts = false) {
+    using this_event_type_t = std::variant_alternative_t<event_index, any_event_type>;
+    const double probability = event_probabilities[event_index];
+    sample_event_type<states_t, any_event_type, any_event>(
+        all_event_types, event_types, std::as_const(setups_by_filter), random_source_1,
+        current_state, event_probabilities, event_index, address,
+        [&setups_by_filter, &event_types, &address, probability, resolve_conflicts,
+         event_type_tag = std::type_identity<this_event_type_t>{}](size_t world,
+                                                                   const auto &event) {
+          using event_type_t = typename decltype(event_type_tag)::type;
+          auto &setup = setups_by_filter[world];
+          if (resolve_conflicts) {
+            setup.conflicts.record(event_types, event,
+                                   competing_risk_key(address, event, probability));
+          } else if constexpr (constexpr_event_type<event_type_t>) {
+            using application = static_event_application<event_type_t>;
+            application::apply(setup.states_entered, setup.states_remained, event);
+            for (auto slot : std::ranges::views::iota(0UL, application::event_size)) {
+              if (application::changes[slot]) {
+                setup.count_change(event.affected_people[slot], event.type_index);
+              }
+            }
+          } else {
+            apply_accepted_event(setup, event_types, event);
+          }
+        });
+  };
+
+  /*!
+   * \brief Sample every event type of one reset concurrently, then merge their effects
+   *
+   * Event types are handed out to up to number_of_threads threads one at a time, each sampled
+   * with its own copy of the engine. Threads left over when there are more threads than event
+   * types draw the chunks of each uniform sample (see sample_event_type). Each thread records the
+   * events it accepts in concurrent_state_changes, which are then merged on number_of_threads
+   * threads, each owning a range of people. With a
+   * counter based engine the results are those of the sequential run. With any other engine the
+   * seed of every event type is drawn before sampling starts, so the results do not depend on
+   * number_of_threads, but differ from the sequential run, which draws each seed after the
+   * previous event type.
+   */
+  template <typename states_t, typename any_event_type, typename any_event>
+  void parallel_event_types_run(auto &setups_by_filter, const auto &current_state,
+                                const auto &all_event_types, const auto &event_types, auto t,
+                                const size_t reset, auto &random_source_1,
+                                const auto &event_probabilities, auto &simulation_seed,
+                                const size_t number_of_threads,
+                                const bool resolve_conflicts = false) {
+    using random_engine_t = std::remove_cvref_t<decltype(random_source_1)>;
+    constexpr size_t number_of_event_types = std::variant_size_v<any_event_type>;
+
+    std::array<size_t, number_of_event_types> seeds{};
+    for (auto &seed : seeds) {
+      if constexpr (!probability::counter_based_random_number_engine<random_engine_t>) {
+        simulation_seed = random_source_1();
+      }
+      seed = simulation_seed;
+    }
+
+    const size_t number_of_type_threads = std::min(number_of_threads, number_of_event_types);
+    const size_t number_of_sample_threads
+        = std::max(1UL, number_of_threads / number_of_type_threads);
+    concurrent_state_changes<states_t> changes{current_state.size(), number_of_type_threads,
+                                               number_of_threads};
+    std::array<std::function<void(size_t)>, number_of_event_types> tasks{};
+    cfor::constexpr_for<0, number_of_event_types, 1>([&](const auto event_index) {
+      tasks[event_index] = [&, event_index](size_t worker) {
+        auto task_random_source = random_source_1;
+        sample_event_type<states_t, any_event_type, any_event>(
+            all_event_types, event_types, std::as_const(setups_by_filter), task_random_source,
+            current_state, event_probabilities, event_index,
+            random_stream_address{seeds[event_index], t, reset},
+            [&, worker, probability = event_probabilities[event_index],
+             address = random_stream_address{seeds[event_index], t, reset}](size_t world,
+                                                                            const auto &event) {
+              changes.record(worker, world, event_types, event,
+                             resolve_conflicts ? competing_risk_key(address, event, probability)
+                                               : 0.0);
+            },
+            number_of_sample_threads);
+      };
+    });
+
+    detail::run_on_threads(number_of_type_threads, number_of_event_types,
+                           [&tasks](size_t task, size_t worker) { tasks[task](worker); });
+
+    changes.merge(setups_by_filter, resolve_conflicts);
+  }
+
   template <typename states_t, typename any_event_type, typename any_event>
   auto single_reset_run(auto &setups_by_filter, const auto &current_state,
-                        const auto &all_event_types, auto t, auto &random_source_1,
-                        const auto &event_probabilities, auto &simulation_seed) {
+                        const auto &all_event_types, const auto &event_types, auto t,
+                        const size_t reset, auto &random_source_1, const auto &event_probabilities,
+                        auto &simulation_seed, const size_t number_of_threads = 1,
+                        const bool resolve_conflicts = false) {
+    using random_engine_t = std::remove_cvref_t<decltype(random_source_1)>;
     const auto seeded_single_event_type_run
-        = [&all_event_types, &setups_by_filter, &random_source_1, &current_state,
-           &event_probabilities, &simulation_seed](const auto event_index) {
-            simulation_seed = random_source_1();
-            // ++simulation_seed;
+        = [&all_event_types, &event_types, &setups_by_filter, &random_source_1, &current_state,
+           &event_probabilities, &simulation_seed, t, reset,
+           resolve_conflicts](const auto event_index) {
+            if constexpr (!probability::counter_based_random_number_engine<random_engine_t>) {
+              simulation_seed = random_source_1();
+            }
             single_event_type_run<states_t, any_event_type, any_event>(
-                all_event_types, setups_by_filter, random_source_1, current_state,
-                event_probabilities, event_index, simulation_seed);
+                all_event_types, event_types, setups_by_filter, random_source_1, current_state,
+                event_probabilities, event_index, random_stream_address{simulation_seed, t, reset},
+                resolve_conflicts);
           };
 
-    cfor::constexpr_for<0, std::variant_size_v<any_event_type>, 1>(seeded_single_event_type_run);
+    if (number_of_threads > 1) {
+      parallel_event_types_run<states_t, any_event_type, any_event>(
+          setups_by_filter, current_state, all_event_types, event_types, t, reset,
+          random_source_1, event_probabilities, simulation_seed, number_of_threads,
+          resolve_conflicts);
+    } else {
+      cfor::constexpr_for<0, std::variant_size_v<any_event_type>, 1>(
+          seeded_single_event_type_run);
+      if (resolve_conflicts) {
+        for (auto &setup : setups_by_filter) {
+          setup.conflicts.apply(setup.states_entered, setup.states_remained,
+                                [&setup](const auto &change) {
+                                  setup.count_change(change.person, change.type_index);
+                                });
+        }
+      }
+    }
+
+    if constexpr (probability::counter_based_random_number_engine<random_engine_t>) {
+      std::vector<sir_state<states_t>> states_next{};
+      bool all_states_allowed = true;
+      for (auto world : std::ranges::views::iota(0UL, setups_by_filter.size())) {
+        auto &setup = setups_by_filter[world];
+        const random_stream_address address{simulation_seed, t, reset,
+                                            std::variant_size_v<any_event_type>, world};
+        auto modifier_random_source = address.template stream<random_engine_t>(0);
+        auto filter_random_source = address.template stream<random_engine_t>(1);
+        auto next_state{setup.states_entered || setup.states_remained};
+        next_state.time = t;
+        if (setup.state_modifier_) {
+          setup.state_modifier_(next_state, modifier_random_source);
+        }
+        all_states_allowed
+            = setup.state_filter_(setup, next_state, filter_random_source) && all_states_allowed;
+        states_next.push_back(next_state);
+      }
+      return (all_states_allowed ? std::optional<decltype(states_next)>{states_next}
+                                 : std::nullopt);
+    }
 
     // Factor out into function
     const auto update_lambda = [t, &random_source_1](auto &x) {
       auto rc{x.states_entered || x.states_remained};
       rc.time = t;
-      x.state_modifier_(rc, random_source_1);
+      if (x.state_modifier_) {
+        x.state_modifier_(rc, random_source_1);
+      }
       return (rc);
     };
 
@@ -180,8 +833,7 @@ namespace cfepi {
     bool all_states_allowed = std::transform_reduce(
         std::begin(setups_by_filter), std::end(setups_by_filter), std::begin(states_next), true,
         [](bool x, bool y) { return (x && y); },
-        [t, &random_source_1](filtration_setup<states_t, any_event> &setup,
-                              sir_state<states_t> new_state) {
+        [t, &random_source_1](auto &setup, sir_state<states_t> new_state) {
           return setup.state_filter_(setup, new_state, random_source_1);
         });
 
@@ -189,9 +841,10 @@ namespace cfepi {
   }
 
   template <typename states_t, typename any_event_type, typename any_event>
-  auto single_time_run(auto &setups_by_filter, auto &all_event_types, auto &t,
-                       auto &random_source_1, auto &event_probabilities, auto &simulation_seed,
-                       auto &resets) {
+  auto single_time_run(auto &setups_by_filter, auto &all_event_types, const auto &event_types,
+                       auto &t, auto &random_source_1, auto &event_probabilities,
+                       auto &simulation_seed, auto &resets, const size_t number_of_threads = 1,
+                       const bool resolve_conflicts = false) {
     // std::cout << "t is " << t << "\n";
 
     // setups_by_filter should be garaunteed non-empty
@@ -204,13 +857,16 @@ namespace cfepi {
 
     std::optional<std::vector<cfepi::sir_state<states_t>>> run_results;
 
+    size_t reset = 0;
     do {
       for (auto &x : setups_by_filter) {
         x.reset();
       }
       run_results = single_reset_run<states_t, any_event_type, any_event>(
-          setups_by_filter, current_state, all_event_types, t, random_source_1, event_probabilities,
-          simulation_seed);
+          setups_by_filter, current_state, all_event_types, event_types, t, reset,
+          random_source_1, event_probabilities, simulation_seed, number_of_threads,
+          resolve_conflicts);
+      ++reset;
       ++resets;
     } while (!run_results.has_value());
     --resets;
@@ -218,29 +874,57 @@ namespace cfepi {
     const auto states_new = (*run_results);
 
     for (auto i : std::ranges::views::iota(0UL, std::size(states_new))) {
-      setups_by_filter[i].current_state = states_new[i];
-      setups_by_filter[i].reset();
+      setups_by_filter[i].advance(states_new[i], std::variant_size_v<any_event_type>);
     }
 
     std::vector<aggregated_sir_state<states_t>> return_value{};
     auto range_to_construct_vector_from = std::ranges::views::transform(
-        setups_by_filter, [](const auto &x) { return (aggregate_state(x.current_state)); });
+        setups_by_filter, [](const auto &x) { return (x.current_counts); });
     std::ranges::copy(std::begin(range_to_construct_vector_from),
                       std::end(range_to_construct_vector_from), std::back_inserter(return_value));
     return (return_value);
   }
 
-  template <typename states_t, typename any_event> using filtration_tuple
-      = filtration_setup<states_t, any_event>::filtration_tuple;
+  template <typename states_t, typename any_event,
+            typename random_engine_t = std::default_random_engine>
+  using filtration_tuple = filtration_setup<states_t, any_event, random_engine_t>::filtration_tuple;
+
+  //! \brief Event probabilities as a function of the time step
+  template <size_t number_of_event_types> using probability_schedule
+      = std::function<std::array<double, number_of_event_types>(epidemic_time_t)>;
+
+  /*!
+   * \brief A schedule which is piecewise constant in time
+   *
+   * @param pieces Pairs of a start time and the event probabilities from that time until the next
+   * start time, in increasing order of start time. The first probabilities are also used before
+   * the first start time.
+   */
+  template <size_t number_of_event_types>
+  probability_schedule<number_of_event_types> piecewise_constant_schedule(
+      std::vector<std::pair<epidemic_time_t, std::array<double, number_of_event_types>>> pieces) {
+    if (std::empty(pieces)) {
+      throw "A piecewise constant schedule needs at least one piece";
+    }
+    if (!std::ranges::is_sorted(pieces, {}, [](const auto &x) { return (x.first); })) {
+      throw "Pieces of a piecewise constant schedule should be in increasing order of time";
+    }
+    return ([pieces = std::move(pieces)](epidemic_time_t t) {
+      auto after = std::ranges::upper_bound(pieces, t, {}, [](const auto &x) { return (x.first); });
+      return ((after == std::begin(pieces)) ? after->second : std::prev(after)->second);
+    });
+  }
 
   //! \defgroup Model_Construction Model Construction
   //! @{
   /*!
-   * \brief Run a counterfactual simulation
+   * \brief Run a counterfactual simulation with event probabilities that change over time
    * Run a counterfactual simulation with a different filter for each world.
    * @param initial_conditions An sir_state to use as the state of the population at time 0.
-   * @param event_probabilities An array with one element for each event containing the probability
-   * of that event.
+   * @param event_probabilities A schedule giving, for each time step, an array with one element
+   * for each event containing the probability of that event during that step (see
+   * piecewise_constant_schedule). The sampler uses these directly, so lowering a probability
+   * lowers the sampling work rather than filtering out events after they are sampled.
    * @param filters A vector of filters containing one filter for each scenario.  A filter is a
    * function which takes events and a random number generator and returns true if that event should
    * be kept or false if that event should be discarded.
@@ -248,40 +932,81 @@ namespace cfepi {
    * the last useful day will not dramatically impact runtime)
    * @param simulation_seed Random seed.  Different values will provide different simulations, the
    * same values will provide the same simulations
+   * @tparam random_engine_t The random number engine used for sampling and passed to the filters.
+   * Must satisfy probability::uniform_random_number_engine and have seed(); e.g.
+   * probability::xoshiro256starstar from cfepi/random.h. With a counter based engine such as
+   * probability::philox4x32_engine every piece of work has its own stream (see
+   * random_stream_address), so results do not depend on the order it is done in.
+   * @param number_of_threads Threads to sample event types on within each step (see
+   * parallel_event_types_run). Event filters are then called concurrently, so must be thread
+   * safe. 1 samples them one after another.
+   * @param resolve_conflicts If true, when several events of a step change the same person in a
+   * world only one of them is applied, chosen by competing risks (see event_conflicts and
+   * competing_risk_key), so a person never enters more than one state in a step. If false every
+   * event is applied, and the person enters every state.
+   * @param on_step If given, called with each step's states as soon as they are computed (e.g. to
+   * write them with results_writer), in the order they appear in the results.
    * @return A vector of aggregated states, one for each time step.
    */
-  template <typename states_t, typename any_event_type, typename any_event> auto run_simulation(
+  template <typename states_t, typename any_event_type, typename any_event,
+            typename random_engine_t = std::default_random_engine>
+  auto run_simulation(
       auto all_event_types, const sir_state<states_t> &initial_conditions,
-      const std::array<double, std::variant_size_v<any_event_type>> event_probabilities,
-      const std::vector<filtration_tuple<states_t, any_event>> &filters,
-      const epidemic_time_t epidemic_duration = 365, size_t simulation_seed = 2) {
+      const probability_schedule<std::variant_size_v<any_event_type>> &event_probabilities,
+      const std::vector<filtration_tuple<states_t, any_event, random_engine_t>> &filters,
+      const epidemic_time_t epidemic_duration = 365, size_t simulation_seed = 2,
+      const size_t number_of_threads = 1, const bool resolve_conflicts = false,
+      const std::function<void(const std::vector<aggregated_sir_state<states_t>> &)> &on_step
+      = {}) {
     if (std::begin(filters) == std::end(filters)) {
       throw "There should be at least one setup\n";
     }
     size_t resets = 0;
 
-    std::default_random_engine random_source_1{simulation_seed};
+    random_engine_t random_source_1{simulation_seed};
+
+    const event_type_table<states_t, any_event_type> event_types{all_event_types};
+    // Contact matrices of stratified event types are validated once here rather than every step
+    cfor::constexpr_for<0, std::variant_size_v<any_event_type>, 1>([&](const auto event_index) {
+      const auto &this_event_type = std::get<event_index>(all_event_types);
+      if constexpr (requires { this_event_type.mixing; }) {
+        if (this_event_type.mixing) {
+          this_event_type.mixing->validate(initial_conditions.size());
+        }
+      }
+    });
 
-    std::vector<filtration_setup<states_t, any_event>> setups_by_filter{};
+    std::vector<filtration_setup<states_t, any_event, random_engine_t>> setups_by_filter{};
     for (auto filter : filters) {
-      setups_by_filter.push_back(filtration_setup<states_t, any_event>(initial_conditions, filter));
+      setups_by_filter.push_back(
+          filtration_setup<states_t, any_event, random_engine_t>(initial_conditions, filter));
     }
 
     std::vector<aggregated_sir_state<states_t>> first_result{};
-    for (auto setup : setups_by_filter) {
-      first_result.push_back(aggregate_state(setup.current_state));
+    for (const auto &setup : setups_by_filter) {
+      first_result.push_back(setup.current_counts);
+      first_result.back().event_counts.assign(std::variant_size_v<any_event_type>, 0);
     }
 
     std::vector<std::vector<aggregated_sir_state<states_t>>> results{first_result};
     results.reserve(static_cast<size_t>(epidemic_duration + 1));
 
     results.push_back(first_result);
+    for (const auto &step : results) {
+      if (on_step) {
+        on_step(step);
+      }
+    }
 
     for (epidemic_time_t t = 0UL; t < epidemic_duration; ++t) {
       std::cout << "Time " << t << "\n";
+      auto event_probabilities_now = event_probabilities(t);
       auto result = single_time_run<states_t, any_event_type, any_event>(
-          setups_by_filter, all_event_types, t, random_source_1, event_probabilities,
-          simulation_seed, resets);
+          setups_by_filter, all_event_types, event_types, t, random_source_1,
+          event_probabilities_now, simulation_seed, resets, number_of_threads, resolve_conflicts);
+      if (on_step) {
+        on_step(result);
+      }
       results.push_back(result);
     }
 
@@ -289,6 +1014,32 @@ namespace cfepi {
 
     return (results);
   }
+
+  /*!
+   * \brief Run a counterfactual simulation
+   * Run a counterfactual simulation with a different filter for each world.
+   * @param event_probabilities An array with one element for each event containing the probability
+   * of that event.
+   *
+   * The other parameters are as for the version taking a probability_schedule.
+   */
+  template <typename states_t, typename any_event_type, typename any_event,
+            typename random_engine_t = std::default_random_engine>
+  auto run_simulation(
+      auto all_event_types, const sir_state<states_t> &initial_conditions,
+      const std::array<double, std::variant_size_v<any_event_type>> event_probabilities,
+      const std::vector<filtration_tuple<states_t, any_event, random_engine_t>> &filters,
+      const epidemic_time_t epidemic_duration = 365, size_t simulation_seed = 2,
+      const size_t number_of_threads = 1, const bool resolve_conflicts = false,
+      const std::function<void(const std::vector<aggregated_sir_state<states_t>> &)> &on_step
+      = {}) {
+    return (run_simulation<states_t, any_event_type, any_event, random_engine_t>(
+        all_event_types, initial_conditions,
+        probability_schedule<std::variant_size_v<any_event_type>>(
+            [event_probabilities](epidemic_time_t) { return (event_probabilities); }),
+        filters, epidemic_duration, simulation_seed, number_of_threads, resolve_conflicts,
+        on_step));
+  }
   //@}
 
 }  // namespace cfepi
@@ -0,0 +1,228 @@
+#include <cfepi/mapped_file.h>
+#include <cfepi/random.h>
+#include <cfepi/sir.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <span>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifndef __NETWORK_H_
+#  define __NETWORK_H_
+
+namespace cfepi {
+
+  /*!
+   * \class contact_network
+   * \brief A directed contact graph in compressed sparse row form.
+   *
+   * The neighbours of person p are neighbours()[offsets()[p]] up to neighbours()[offsets()[p+1]].
+   * The arrays are either owned or memory mapped from a file written by write(), so graphs with
+   * millions of people are loaded without parsing or copying. The file is a magic string, the
+   * number of people and of edges, the offsets (64 bit) and the neighbours (32 bit).
+   */
+  class contact_network {
+  public:
+    using offset_t = std::uint64_t;
+    using neighbour_t = std::uint32_t;
+
+  private:
+    static constexpr char magic[8] = {'C', 'F', 'E', 'P', 'I', 'C', 'S', 'R'};
+    static constexpr size_t header_size = sizeof(magic) + 2 * sizeof(std::uint64_t);
+
+    std::vector<offset_t> owned_offsets_;
+    std::vector<neighbour_t> owned_neighbours_;
+    //! \brief Keeps a memory mapped file alive for as long as the spans point into it
+    std::shared_ptr<const void> mapping_;
+    std::span<const offset_t> offsets_;
+    std::span<const neighbour_t> neighbours_;
+
+    void validate() const {
+      if (std::empty(offsets_) || (offsets_.front() != 0)
+          || (offsets_.back() != std::size(neighbours_))
+          || !std::ranges::is_sorted(offsets_)) {
+        throw "Contact network offsets are not a valid compressed sparse row index";
+      }
+      if (std::ranges::any_of(neighbours_, [this](neighbour_t x) { return (x >= size()); })) {
+        throw "Contact network has a neighbour outside the population";
+      }
+    }
+
+    contact_network() = default;
+
+  public:
+    //! \brief Construct from owned offsets (one more than the number of people) and neighbours
+    contact_network(std::vector<offset_t> offsets, std::vector<neighbour_t> neighbours)
+        : owned_offsets_(std::move(offsets)),
+          owned_neighbours_(std::move(neighbours)),
+          offsets_(owned_offsets_),
+          neighbours_(owned_neighbours_) {
+      validate();
+    }
+    contact_network(const contact_network &) = delete;
+    contact_network &operator=(const contact_network &) = delete;
+    contact_network(contact_network &&) = default;
+    contact_network &operator=(contact_network &&) = default;
+
+    //! \brief Build from a list of edges; undirected edges are stored in both directions
+    static contact_network from_edges(const person_t number_of_people,
+                                      const std::vector<std::pair<person_t, person_t>> &edges,
+                                      const bool directed = false) {
+      if (number_of_people > std::numeric_limits<neighbour_t>::max()) {
+        throw "Contact network is too large for 32 bit neighbour indices";
+      }
+      std::vector<offset_t> offsets(number_of_people + 1, 0UL);
+      const auto count_edge = [&offsets, number_of_people](person_t from, person_t to) {
+        if ((from >= number_of_people) || (to >= number_of_people)) {
+          throw "Contact network edge refers to a person outside the population";
+        }
+        ++offsets[from + 1];
+      };
+      for (const auto &[from, to] : edges) {
+        count_edge(from, to);
+        if (!directed) {
+          count_edge(to, from);
+        }
+      }
+      std::partial_sum(std::begin(offsets), std::end(offsets), std::begin(offsets));
+      std::vector<neighbour_t> neighbours(offsets.back());
+      auto next_slot = offsets;
+      for (const auto &[from, to] : edges) {
+        neighbours[next_slot[from]++] = static_cast<neighbour_t>(to);
+        if (!directed) {
+          neighbours[next_slot[to]++] = static_cast<neighbour_t>(from);
+        }
+      }
+      return (contact_network(std::move(offsets), std::move(neighbours)));
+    }
+
+    //! \brief Load a file written by write(), memory mapping it where the platform allows
+    static contact_network map_file(const std::string &path) {
+      contact_network rc{};
+      const mapped_file file{path};
+      const size_t file_size = std::size(file.bytes());
+      if (file_size < header_size) {
+        throw "Contact network file is too short";
+      }
+      const auto *bytes = file.bytes().data();
+      rc.mapping_ = file.mapping();
+      if (std::memcmp(bytes, magic, sizeof(magic)) != 0) {
+        throw "Not a contact network file";
+      }
+      std::uint64_t number_of_people = 0;
+      std::uint64_t number_of_edges = 0;
+      std::memcpy(&number_of_people, bytes + sizeof(magic), sizeof(number_of_people));
+      std::memcpy(&number_of_edges, bytes + sizeof(magic) + sizeof(number_of_people),
+                  sizeof(number_of_edges));
+      if (file_size
+          != header_size + (number_of_people + 1) * sizeof(offset_t)
+                 + number_of_edges * sizeof(neighbour_t)) {
+        throw "Contact network file has the wrong size";
+      }
+      rc.offsets_ = std::span(reinterpret_cast<const offset_t *>(bytes + header_size),
+                              number_of_people + 1);
+      rc.neighbours_ = std::span(
+          reinterpret_cast<const neighbour_t *>(bytes + header_size
+                                                + (number_of_people + 1) * sizeof(offset_t)),
+          number_of_edges);
+      rc.validate();
+      return (rc);
+    }
+
+    //! \brief Write in the format read by map_file
+    void write(const std::string &path) const {
+      std::ofstream file(path, std::ios::binary);
+      if (!file) {
+        throw "Could not open contact network file for writing";
+      }
+      const std::uint64_t number_of_people = size();
+      const std::uint64_t number_of_edges = std::size(neighbours_);
+      file.write(magic, sizeof(magic));
+      file.write(reinterpret_cast<const char *>(&number_of_people), sizeof(number_of_people));
+      file.write(reinterpret_cast<const char *>(&number_of_edges), sizeof(number_of_edges));
+      file.write(reinterpret_cast<const char *>(offsets_.data()),
+                 static_cast<std::streamsize>(offsets_.size_bytes()));
+      file.write(reinterpret_cast<const char *>(neighbours_.data()),
+                 static_cast<std::streamsize>(neighbours_.size_bytes()));
+      if (!file) {
+        throw "Could not write contact network file";
+      }
+    }
+
+    //! \brief Number of people
+    size_t size() const { return (std::size(offsets_) - 1); }
+    //! \brief Number of directed edges
+    size_t number_of_edges() const { return (std::size(neighbours_)); }
+    std::span<const offset_t> offsets() const { return (offsets_); }
+    //! \brief The people person can infect
+    std::span<const neighbour_t> neighbours(person_t person) const {
+      return (neighbours_.subspan(offsets_[person], offsets_[person + 1] - offsets_[person]));
+    }
+  };
+
+  /*!
+   * \class network_event_type
+   * \brief An interaction event type which only happens along the edges of a contact network.
+   *
+   * event_type_t is an interaction event type: slot 0 is the person whose state changes and
+   * slot 1 the person they interact with. Instead of the cartesian product of all candidates, the
+   * candidate events are (neighbour, person) for each person satisfying the slot 1 precondition
+   * and each of their neighbours in the network, and the probability applies per edge. Set
+   * network before running.
+   */
+  template <typename event_type_t> struct network_event_type : public event_type_t {
+    static_assert(event_type_t::size() == 2, "Network events need exactly two people");
+    std::shared_ptr<const contact_network> network = {};
+
+    /*!
+     * \brief Sample the events of this type given the candidates for slot 1
+     *
+     * Geometric skips run over the concatenated neighbourhoods of the sources, so the cost is
+     * the number of sources plus the number of sampled edges. Sampled edges whose neighbour does
+     * not satisfy the slot 0 precondition are dropped.
+     */
+    template <typename event_t, typename Gen>
+    std::vector<event_t> sample_events(
+        const sir_state<typename event_type_t::state_type> &current_state,
+        const std::vector<size_t> &sources, const size_t event_index, const double probability,
+        Gen &gen) const {
+      if (!network) {
+        throw "network_event_type needs a contact network";
+      }
+      if (network->size() < current_state.size()) {
+        throw "The contact network is smaller than the population";
+      }
+      std::vector<event_t> rc{};
+      const probability::geometric_skip_distribution dist(probability);
+      // Edges left to skip before the next sampled one, carried across neighbourhoods
+      size_t skip = dist(gen);
+      for (auto source : sources) {
+        const auto neighbourhood = network->neighbours(source);
+        size_t position = skip;
+        for (; position < std::size(neighbourhood); position += dist(gen) + 1) {
+          const person_t target = neighbourhood[position];
+          if ((this->preconditions[0] & current_state.potential_states[target]).any()) {
+            event_t event{};
+            event.type_index = event_index;
+            event.affected_people[0] = target;
+            event.affected_people[1] = source;
+            rc.push_back(event);
+          }
+        }
+        skip = position - std::size(neighbourhood);
+      }
+      return (rc);
+    }
+  };
+
+}  // namespace cfepi
+
+#endif
@@ -0,0 +1,200 @@
+#include <cfepi/mapped_file.h>
+#include <cfepi/sir.h>
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <span>
+#include <string>
+#include <vector>
+
+#ifndef __OUTPUT_H_
+#  define __OUTPUT_H_
+
+namespace cfepi {
+
+  /*!
+   * \brief One block of simulation results, as columns of equal length
+   *
+   * Row i is the count of people in the potential states mask[i] (a bitset over the compartments)
+   * at time[i], in world (filter) world[i] of replicate replicate[i]. Potential states nobody is
+   * in are left out.
+   */
+  struct results_columns {
+    std::span<const std::uint32_t> replicate;
+    std::span<const std::uint32_t> world;
+    std::span<const std::int64_t> time;
+    std::span<const std::uint64_t> mask;
+    std::span<const std::uint64_t> count;
+    //! \brief Number of rows
+    size_t size() const { return (std::size(count)); }
+  };
+
+  namespace detail {
+    constexpr char results_magic[8] = {'C', 'F', 'E', 'P', 'I', 'R', 'E', 'S'};
+    constexpr std::uint32_t results_version = 1;
+    constexpr size_t results_header_size = sizeof(results_magic) + 2 * sizeof(std::uint32_t);
+
+    //! \brief Bytes taken by a column of rows values of type T, padded to a multiple of 8
+    template <typename T> constexpr size_t results_column_size(size_t rows) {
+      return ((rows * sizeof(T) + 7) / 8 * 8);
+    }
+  }  // namespace detail
+
+  /*!
+   * \class results_writer
+   * \brief Writes simulation results to a columnar binary file as the steps complete
+   *
+   * The file is a header (the magic string CFEPIRES, a 32 bit version and the 32 bit number of
+   * compartments) followed by one block per write_step. A block is its 64 bit number of rows, then
+   * the replicate (32 bit), world (32 bit), time (64 bit), mask (64 bit) and count (64 bit)
+   * columns, each padded to a multiple of 8 bytes. Everything is in the byte order of the machine
+   * that wrote it. Each block is flushed when it is written, so a long run can be read, or
+   * resumed, while it is still going; read the file with results_reader.
+   */
+  template <typename states_t> class results_writer {
+  private:
+    std::ofstream file_;
+    std::vector<std::uint32_t> replicate_;
+    std::vector<std::uint32_t> world_;
+    std::vector<std::int64_t> time_;
+    std::vector<std::uint64_t> mask_;
+    std::vector<std::uint64_t> count_;
+
+    template <typename T> void write_column(const std::vector<T> &column) {
+      constexpr char padding[8] = {};
+      const auto bytes = std::size(column) * sizeof(T);
+      file_.write(reinterpret_cast<const char *>(column.data()),
+                  static_cast<std::streamsize>(bytes));
+      file_.write(padding,
+                  static_cast<std::streamsize>(detail::results_column_size<T>(std::size(column))
+                                               - bytes));
+    }
+
+  public:
+    explicit results_writer(const std::string &path) : file_(path, std::ios::binary) {
+      if (!file_) {
+        throw "Could not open results file for writing";
+      }
+      const std::uint32_t version = detail::results_version;
+      const std::uint32_t number_of_compartments = std::size(states_t{});
+      file_.write(detail::results_magic, sizeof(detail::results_magic));
+      file_.write(reinterpret_cast<const char *>(&version), sizeof(version));
+      file_.write(reinterpret_cast<const char *>(&number_of_compartments),
+                  sizeof(number_of_compartments));
+      if (!file_.flush()) {
+        throw "Could not write results file";
+      }
+    }
+
+    //! \brief Write one block holding the states of every world at one step (as produced by
+    //! run_simulation or single_time_run)
+    void write_step(size_t replicate, const std::vector<aggregated_sir_state<states_t>> &step) {
+      replicate_.clear();
+      world_.clear();
+      time_.clear();
+      mask_.clear();
+      count_.clear();
+      for (size_t world = 0; world < std::size(step); ++world) {
+        for_each_potential_state(step[world].potential_state_counts,
+                                 [&](size_t mask, size_t count) {
+                                   replicate_.push_back(static_cast<std::uint32_t>(replicate));
+                                   world_.push_back(static_cast<std::uint32_t>(world));
+                                   time_.push_back(step[world].time);
+                                   mask_.push_back(mask);
+                                   count_.push_back(count);
+                                 });
+      }
+      const std::uint64_t rows = std::size(count_);
+      file_.write(reinterpret_cast<const char *>(&rows), sizeof(rows));
+      write_column(replicate_);
+      write_column(world_);
+      write_column(time_);
+      write_column(mask_);
+      write_column(count_);
+      if (!file_.flush()) {
+        throw "Could not write results file";
+      }
+    }
+
+    //! \brief Write every step of a finished run
+    void write_results(size_t replicate,
+                       const std::vector<std::vector<aggregated_sir_state<states_t>>> &results) {
+      for (const auto &step : results) {
+        write_step(replicate, step);
+      }
+    }
+  };
+
+  /*!
+   * \class results_reader
+   * \brief Reads a file written by results_writer, memory mapping it so the columns are not copied
+   */
+  class results_reader {
+  private:
+    mapped_file file_;
+    size_t number_of_compartments_ = 0;
+    std::vector<results_columns> blocks_{};
+
+  public:
+    explicit results_reader(const std::string &path) : file_(path) {
+      const auto bytes = file_.bytes();
+      if ((std::size(bytes) < detail::results_header_size)
+          || (std::memcmp(bytes.data(), detail::results_magic, sizeof(detail::results_magic))
+              != 0)) {
+        throw "Not a results file";
+      }
+      std::uint32_t version = 0;
+      std::uint32_t number_of_compartments = 0;
+      std::memcpy(&version, bytes.data() + sizeof(detail::results_magic), sizeof(version));
+      std::memcpy(&number_of_compartments,
+                  bytes.data() + sizeof(detail::results_magic) + sizeof(version),
+                  sizeof(number_of_compartments));
+      if (version != detail::results_version) {
+        throw "Unsupported results file version";
+      }
+      number_of_compartments_ = number_of_compartments;
+
+      size_t offset = detail::results_header_size;
+      while (offset < std::size(bytes)) {
+        std::uint64_t rows = 0;
+        if (offset + sizeof(rows) > std::size(bytes)) {
+          throw "Results file ends inside a block";
+        }
+        std::memcpy(&rows, bytes.data() + offset, sizeof(rows));
+        offset += sizeof(rows);
+        const auto column = [&]<typename T>(std::span<const T> &rc) {
+          const auto size = detail::results_column_size<T>(rows);
+          if (offset + size > std::size(bytes)) {
+            throw "Results file ends inside a block";
+          }
+          rc = std::span(reinterpret_cast<const T *>(bytes.data() + offset), rows);
+          offset += size;
+        };
+        results_columns block{};
+        column(block.replicate);
+        column(block.world);
+        column(block.time);
+        column(block.mask);
+        column(block.count);
+        blocks_.push_back(block);
+      }
+    }
+
+    //! \brief Number of compartments of the model, which is the number of bits used by the masks
+    size_t number_of_compartments() const { return (number_of_compartments_); }
+    //! \brief The blocks in the order they were written; valid while this reader exists
+    const std::vector<results_columns> &blocks() const { return (blocks_); }
+    //! \brief Total number of rows
+    size_t size() const {
+      size_t rc = 0;
+      for (const auto &block : blocks_) {
+        rc += block.size();
+      }
+      return (rc);
+    }
+  };
+
+}  // namespace cfepi
+
+#endif
@@ -0,0 +1,376 @@
+#include <cfepi/modeling.h>
+#include <cfepi/random.h>
+#include <cfepi/sample_view.h>
+#include <cfepi/sir.h>
+#include <cfepi/transport.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <random>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#ifndef __PARTITION_H_
+#  define __PARTITION_H_
+
+namespace cfepi {
+
+  namespace detail {
+    //! \brief Sum of a value over every process, as an exclusive prefix sum by rank plus the total
+    template <partition_transport transport_t>
+    std::vector<std::vector<size_t>> gather_offsets(transport_t &transport,
+                                                    const std::vector<size_t> &values) {
+      transport_message message{};
+      for (auto value : values) {
+        append_bytes(message, static_cast<std::uint64_t>(value));
+      }
+      const auto received = all_gather(transport, message);
+      std::vector<std::vector<size_t>> rc(std::size(values),
+                                          std::vector<size_t>(transport.size() + 1, 0UL));
+      for (auto rank : std::ranges::views::iota(0UL, transport.size())) {
+        size_t offset = 0;
+        for (auto index : std::ranges::views::iota(0UL, std::size(values))) {
+          rc[index][rank + 1]
+              = rc[index][rank]
+                + static_cast<size_t>(read_bytes<std::uint64_t>(received[rank], offset));
+        }
+      }
+      return (rc);
+    }
+
+    //! \brief Whether an event type samples its candidates from a network, mixing matrix or
+    //! weights (see single_type_event_generator) rather than from its preconditions alone
+    template <typename event_type_t> constexpr bool is_structured_event_type
+        = requires(const event_type_t &x) { x.network; }
+          || requires(const event_type_t &x) { x.mixing; }
+          || requires(const event_type_t &x) { x.weights; };
+
+    template <typename any_event_type, size_t... event_index>
+    constexpr bool has_structured_event_type(std::index_sequence<event_index...>) {
+      return ((is_structured_event_type<std::variant_alternative_t<event_index, any_event_type>>
+               || ...));
+    }
+  }  // namespace detail
+
+  //! \defgroup Partitioned_Simulation Partitioned Simulation
+  //! @{
+  /*!
+   * \brief Run a counterfactual simulation with the population partitioned across processes
+   *
+   * Every process calls this with its own part of the population, and gets the results for the
+   * whole population. Each time step is the step of run_simulation done on partitions:
+   * - Each process finds its candidates for every event type and the processes exchange how many
+   * people satisfy the first precondition of each interaction event type.
+   * - Transition events are sampled locally. Interaction events are sampled by the process
+   * owning the second person (e.g. the infector), from the product of its local candidates and
+   * every process's candidates for the first person, so each candidate pair is sampled with the
+   * event probability as in run_simulation.
+   * - Events for people on other processes are sent to them in one batch, with the state of the
+   * second person in every world, and each process applies the events for its own people.
+   * - Each process applies its state modifiers and state filters to its own people, and the step
+   * is redone everywhere unless every state filter on every process passes.
+   *
+   * Event types may have one or two people, and an interaction may only change the first person.
+   * Event types with network, mixing or weights members are not supported yet. Event
+   * filters see the first person's local index and the second person's index in the whole
+   * population, and state filters and modifiers see only the local people.
+   *
+   * The step is not single_time_run, since an interaction is only checked once the exchange has
+   * brought its first person's process the second person's state. So it does not have:
+   * - Conflict resolution between competing events (event_conflicts).
+   * - Compile time event application (static_event_application); every event is checked against
+   * the event_type_table.
+   * - Counter based streams (random_stream_address). Each process draws from one engine seeded
+   * from simulation_seed and its rank, so results depend on the number of processes.
+   * - Threads within a process.
+   *
+   * Scaling: only the sampled events are sent, not the states of the people, but a process sends
+   * every sampled interaction whose first person it does not own, which is most of them once there
+   * are a few processes, with the second person's state in every world. Every step also waits on
+   * collective exchanges of the candidate counts, the events, the state filters and the results.
+   * So the time per step grows with the number of processes even at a fixed number of people per
+   * process.
+   *
+   * @param transport The connection between the processes, see partition_transport.
+   * @param local_initial_conditions The state at time 0 of the people owned by this process. The
+   * people of the whole population are those of rank 0, then rank 1, and so on.
+   *
+   * The other parameters are as for run_simulation, and should be the same on every process.
+   * @return A vector of aggregated states of the whole population, one for each time step, as
+   * for run_simulation. Every process gets the same results.
+   */
+  template <typename states_t, typename any_event_type, typename any_event,
+            typename random_engine_t = std::default_random_engine,
+            partition_transport transport_t>
+  auto run_partitioned_simulation(
+      transport_t &transport, auto all_event_types,
+      const sir_state<states_t> &local_initial_conditions,
+      const probability_schedule<std::variant_size_v<any_event_type>> &event_probabilities,
+      const std::vector<filtration_tuple<states_t, any_event, random_engine_t>> &filters,
+      const epidemic_time_t epidemic_duration = 365, size_t simulation_seed = 2) {
+    constexpr size_t number_of_event_types = std::variant_size_v<any_event_type>;
+    using person_state = std::bitset<std::size(states_t{})>;
+    static_assert(!detail::has_structured_event_type<any_event_type>(
+                      std::make_index_sequence<number_of_event_types>{}),
+                  "Partitioned runs do not support network, mixing or weighted event types");
+    if (std::begin(filters) == std::end(filters)) {
+      throw "There should be at least one setup\n";
+    }
+    const event_type_table<states_t, any_event_type> event_types{all_event_types};
+    for (auto event_index : std::ranges::views::iota(0UL, number_of_event_types)) {
+      const auto &type = event_types[event_index];
+      if ((type.size == 0) || (type.size > 2)) {
+        throw "Partitioned runs support event types with one or two people";
+      }
+      if ((type.size == 2) && type.postconditions[1]) {
+        throw "Partitioned runs support interactions which only change the first person";
+      }
+    }
+    const size_t rank = transport.rank();
+    const bool is_first_rank = (rank == 0);
+
+    probability::xoshiro256starstar seeder{simulation_seed};
+    seeder.discard(rank);
+    random_engine_t random_source_1{static_cast<size_t>(seeder())};
+
+    std::vector<filtration_setup<states_t, any_event, random_engine_t>> setups_by_filter{};
+    for (auto filter : filters) {
+      setups_by_filter.push_back(
+          filtration_setup<states_t, any_event, random_engine_t>(local_initial_conditions, filter));
+    }
+    const size_t number_of_worlds = std::size(setups_by_filter);
+    const size_t person_offset
+        = detail::gather_offsets(transport, {local_initial_conditions.size()})[0][rank];
+
+    // Each world is sent as its event counts, its number of nonzero counts, then a mask and count
+    // for each. Called before the setups are reset, so each step carries the event counts of its
+    // events.
+    const auto aggregate_all = [&transport, &setups_by_filter]() {
+      transport_message message{};
+      for (const auto &setup : setups_by_filter) {
+        for (auto event_index :
+             std::ranges::views::iota(0UL, std::variant_size_v<any_event_type>)) {
+          detail::append_bytes(message,
+                               static_cast<std::uint64_t>(
+                                   event_index < std::size(setup.event_counts)
+                                       ? setup.event_counts[event_index]
+                                       : 0UL));
+        }
+        const auto counts = aggregate_state_to_array(setup.current_state);
+        std::uint64_t number_of_counts = 0;
+        for_each_potential_state(counts, [&number_of_counts](size_t, size_t) {
+          ++number_of_counts;
+        });
+        detail::append_bytes(message, number_of_counts);
+        for_each_potential_state(counts, [&message](size_t mask, size_t count) {
+          detail::append_bytes(message, static_cast<std::uint64_t>(mask));
+          detail::append_bytes(message, static_cast<std::uint64_t>(count));
+        });
+      }
+      std::vector<aggregated_sir_state<states_t>> rc{};
+      for (const auto &setup : setups_by_filter) {
+        rc.push_back(aggregated_sir_state<states_t>{{}, setup.current_state.time});
+        rc.back().event_counts.assign(std::variant_size_v<any_event_type>, 0UL);
+      }
+      for (const auto &received : all_gather(transport, message)) {
+        size_t offset = 0;
+        for (auto &world : rc) {
+          for (auto &event_count : world.event_counts) {
+            event_count
+                += static_cast<size_t>(detail::read_bytes<std::uint64_t>(received, offset));
+          }
+          const auto number_of_counts = detail::read_bytes<std::uint64_t>(received, offset);
+          for (std::uint64_t entry = 0; entry < number_of_counts; ++entry) {
+            const auto mask = detail::read_bytes<std::uint64_t>(received, offset);
+            world.potential_state_counts[static_cast<size_t>(mask)]
+                += static_cast<size_t>(detail::read_bytes<std::uint64_t>(received, offset));
+          }
+        }
+      }
+      return (rc);
+    };
+
+    // Apply an event to the first person, who is local, in one world
+    const auto apply_if_allowed = [&event_types, &random_source_1](
+                                      auto &setup, const any_event &event,
+                                      const person_state &second_person_state) {
+      const auto &type = event_types[event.type_index];
+      const auto person = event.affected_people[0];
+      if (!(type.preconditions[0] & setup.current_state.potential_states[person]).any()
+          || ((type.size == 2) && !(type.preconditions[1] & second_person_state).any())
+          || !setup.event_filter_(event, setup.current_state, random_source_1)) {
+        return;
+      }
+      if (type.postconditions[0]) {
+        setup.states_entered.potential_states[person][type.postconditions[0].value()] = true;
+        setup.states_remained.potential_states[person] &= ~type.preconditions[0];
+        setup.count_change(person, event.type_index);
+      }
+    };
+
+    std::vector<std::vector<aggregated_sir_state<states_t>>> results{aggregate_all()};
+    results.reserve(static_cast<size_t>(epidemic_duration + 1));
+    results.push_back(results.front());
+    size_t resets = 0;
+
+    for (epidemic_time_t t = 0UL; t < epidemic_duration; ++t) {
+      if (is_first_rank) {
+        std::cout << "Time " << t << "\n";
+      }
+      const auto event_probabilities_now = event_probabilities(t);
+
+      auto current_state = setups_by_filter.front().current_state;
+      for (const auto &setup : setups_by_filter | std::ranges::views::drop(1)) {
+        current_state = current_state || setup.current_state;
+      }
+      std::array<std::array<std::vector<size_t>, 2>, number_of_event_types> candidates{};
+      std::vector<size_t> first_person_counts(number_of_event_types, 0UL);
+      for (auto event_index : std::ranges::views::iota(0UL, number_of_event_types)) {
+        const auto &type = event_types[event_index];
+        for (auto slot : std::ranges::views::iota(0UL, type.size)) {
+          for (auto person : std::ranges::views::iota(0UL, current_state.size())) {
+            if ((type.preconditions[slot] & current_state.potential_states[person]).any()) {
+              candidates[event_index][slot].push_back(person);
+            }
+          }
+        }
+        first_person_counts[event_index] = std::size(candidates[event_index][0]);
+      }
+      const auto first_person_offsets = detail::gather_offsets(transport, first_person_counts);
+
+      std::vector<sir_state<states_t>> states_next{};
+      bool all_states_allowed = false;
+      do {
+        for (auto &setup : setups_by_filter) {
+          setup.reset();
+        }
+        std::vector<transport_message> outgoing(transport.size());
+        for (auto event_index : std::ranges::views::iota(0UL, number_of_event_types)) {
+          const auto &type = event_types[event_index];
+          const double probability = event_probabilities_now[event_index];
+          any_event event{};
+          event.time = t;
+          event.type_index = event_index;
+          if (type.size == 1) {
+            for (auto person : candidates[event_index][0]
+                                   | probability::views::sample(probability, random_source_1)) {
+              event.affected_people[0] = person;
+              for (auto &setup : setups_by_filter) {
+                apply_if_allowed(setup, event, person_state{});
+              }
+            }
+            continue;
+          }
+          const auto &offsets = first_person_offsets[event_index];
+          const auto &second_people = candidates[event_index][1];
+          const size_t all_first_people = offsets.back();
+          for (auto position :
+               std::ranges::views::iota(0UL, std::size(second_people) * all_first_people)
+                   | probability::views::sample(probability, random_source_1)) {
+            const auto second_person = second_people[position / all_first_people];
+            const size_t first_person_index = position % all_first_people;
+            const size_t owner = static_cast<size_t>(
+                std::ranges::upper_bound(offsets, first_person_index) - std::begin(offsets) - 1);
+            const size_t owner_index = first_person_index - offsets[owner];
+            if (owner == rank) {
+              event.affected_people[0] = candidates[event_index][0][owner_index];
+              event.affected_people[1] = person_offset + second_person;
+              for (auto &setup : setups_by_filter) {
+                apply_if_allowed(setup, event,
+                                 setup.current_state.potential_states[second_person]);
+              }
+            } else {
+              auto &message = outgoing[owner];
+              detail::append_bytes(message, static_cast<std::uint64_t>(event_index));
+              detail::append_bytes(message, static_cast<std::uint64_t>(owner_index));
+              detail::append_bytes(message,
+                                   static_cast<std::uint64_t>(person_offset + second_person));
+              for (const auto &setup : setups_by_filter) {
+                const auto &second_person_state
+                    = setup.current_state.potential_states[second_person];
+                detail::append_bytes(message,
+                                     static_cast<std::uint64_t>(second_person_state.to_ulong()));
+              }
+            }
+          }
+        }
+
+        for (const auto &message : transport.exchange(std::move(outgoing))) {
+          size_t offset = 0;
+          while (offset < std::size(message)) {
+            any_event event{};
+            event.time = t;
+            event.type_index
+                = static_cast<size_t>(detail::read_bytes<std::uint64_t>(message, offset));
+            const auto owner_index
+                = static_cast<size_t>(detail::read_bytes<std::uint64_t>(message, offset));
+            event.affected_people[0] = candidates[event.type_index][0][owner_index];
+            event.affected_people[1]
+                = static_cast<person_t>(detail::read_bytes<std::uint64_t>(message, offset));
+            for (auto world : std::ranges::views::iota(0UL, number_of_worlds)) {
+              const person_state second_person_state{
+                  detail::read_bytes<std::uint64_t>(message, offset)};
+              apply_if_allowed(setups_by_filter[world], event, second_person_state);
+            }
+          }
+        }
+
+        states_next.clear();
+        bool local_states_allowed = true;
+        for (auto &setup : setups_by_filter) {
+          auto next_state{setup.states_entered || setup.states_remained};
+          next_state.time = t;
+          if (setup.state_modifier_) {
+            setup.state_modifier_(next_state, random_source_1);
+          }
+          local_states_allowed
+              = setup.state_filter_(setup, next_state, random_source_1) && local_states_allowed;
+          states_next.push_back(std::move(next_state));
+        }
+        all_states_allowed = all_of(transport, local_states_allowed);
+        resets += all_states_allowed ? 0 : 1;
+      } while (!all_states_allowed);
+
+      for (auto world : std::ranges::views::iota(0UL, number_of_worlds)) {
+        setups_by_filter[world].current_state = std::move(states_next[world]);
+      }
+      results.push_back(aggregate_all());
+      for (auto &setup : setups_by_filter) {
+        setup.reset();
+      }
+    }
+
+    if (is_first_rank) {
+      std::cout << "Ran with " << resets << " resets\n";
+    }
+    return (results);
+  }
+
+  /*!
+   * \brief Run a counterfactual simulation with the population partitioned across processes
+   * @param event_probabilities An array with one element for each event containing the probability
+   * of that event.
+   *
+   * The other parameters are as for the version taking a probability_schedule.
+   */
+  template <typename states_t, typename any_event_type, typename any_event,
+            typename random_engine_t = std::default_random_engine,
+            partition_transport transport_t>
+  auto run_partitioned_simulation(
+      transport_t &transport, auto all_event_types,
+      const sir_state<states_t> &local_initial_conditions,
+      const std::array<double, std::variant_size_v<any_event_type>> event_probabilities,
+      const std::vector<filtration_tuple<states_t, any_event, random_engine_t>> &filters,
+      const epidemic_time_t epidemic_duration = 365, size_t simulation_seed = 2) {
+    return (run_partitioned_simulation<states_t, any_event_type, any_event, random_engine_t>(
+        transport, all_event_types, local_initial_conditions,
+        probability_schedule<std::variant_size_v<any_event_type>>(
+            [event_probabilities](epidemic_time_t) { return (event_probabilities); }),
+        filters, epidemic_duration, simulation_seed));
+  }
+  //! @}
+
+}  // namespace cfepi
+
+#endif
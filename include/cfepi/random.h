@@ -0,0 +1,459 @@
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <concepts>
+#include <cstdint>
+#include <limits>
+#include <random>
+#include <span>
+
+#ifndef PROBABILITY_RANDOM_HPP
+#  define PROBABILITY_RANDOM_HPP
+
+namespace probability {
+  // Replace me with the real concept when available
+  //! @defgroup uniform_random_number_engine Uniform Random Number Engine
+  //! @ingroup generalconcepts
+  //! @{
+  template <typename E>
+  concept uniform_random_number_engine
+      = std::uniform_random_bit_generator<E>
+        && requires(E e, typename E::result_type s, E &&v, const E x, const E y) {
+             { E() };
+             { E(s) };
+             { E(x) };
+             { E(e) };
+             { x == y } -> std::same_as<bool>;
+             { x != y } -> std::same_as<bool>;
+           };
+  //!@}
+
+}  // namespace probability
+
+namespace probability {
+
+  /*!
+   * \class xoshiro256starstar
+   * \brief The xoshiro256** generator of Blackman and Vigna.
+   *
+   * A drop in replacement for std::default_random_engine (it satisfies
+   * uniform_random_number_engine and has seed()) that produces 64 random bits per call from four
+   * words of state, instead of 31 bits per multiply-modulo for minstd. Seeds are expanded with
+   * splitmix64, so nearby seeds give unrelated streams.
+   */
+  class xoshiro256starstar {
+  private:
+    std::array<std::uint64_t, 4> state_{};
+
+  public:
+    using result_type = std::uint64_t;
+    static constexpr result_type default_seed = 1U;
+    static constexpr result_type min() { return (std::numeric_limits<result_type>::min()); }
+    static constexpr result_type max() { return (std::numeric_limits<result_type>::max()); }
+
+    //! \brief Default constructor, seeded with default_seed
+    xoshiro256starstar() noexcept { seed(default_seed); }
+    //! \brief Constructor from a seed
+    explicit xoshiro256starstar(result_type seed_value) noexcept { seed(seed_value); }
+
+    //! \brief Reset the state from a seed
+    void seed(result_type seed_value = default_seed) noexcept {
+      for (auto &word : state_) {
+        seed_value += 0x9e3779b97f4a7c15ULL;
+        result_type z = seed_value;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        word = z ^ (z >> 31);
+      }
+    }
+
+    result_type operator()() noexcept {
+      const result_type rc = std::rotl(state_[1] * 5, 7) * 9;
+      const result_type shifted = state_[1] << 17;
+      state_[2] ^= state_[0];
+      state_[3] ^= state_[1];
+      state_[1] ^= state_[2];
+      state_[0] ^= state_[3];
+      state_[2] ^= shifted;
+      state_[3] = std::rotl(state_[3], 45);
+      return (rc);
+    }
+
+    //! \brief Fill a buffer with raw draws, keeping the state in registers for the whole loop
+    void generate(std::span<result_type> out) noexcept {
+      auto local_state = state_;
+      for (auto &x : out) {
+        x = std::rotl(local_state[1] * 5, 7) * 9;
+        const result_type shifted = local_state[1] << 17;
+        local_state[2] ^= local_state[0];
+        local_state[3] ^= local_state[1];
+        local_state[1] ^= local_state[2];
+        local_state[0] ^= local_state[3];
+        local_state[2] ^= shifted;
+        local_state[3] = std::rotl(local_state[3], 45);
+      }
+      state_ = local_state;
+    }
+
+    void discard(unsigned long long z) noexcept {
+      for (; z > 0; --z) {
+        (*this)();
+      }
+    }
+
+    bool operator==(const xoshiro256starstar &other) const = default;
+  };
+
+  /*!
+   * \class philox4x32_engine
+   * \brief A counter based engine using the Philox4x32-10 bijection of Salmon et al. (2011).
+   *
+   * Each block of output is a pure function of a 64 bit key and a 128 bit counter, so any draw
+   * can be computed without the draws before it. Seeding sets the key; the low half of the counter
+   * counts blocks and the high half selects a substream. stream() builds an engine for an
+   * address, so independent pieces of work can each have their own stream and be run in any
+   * order or on any thread with identical results.
+   */
+  class philox4x32_engine {
+  public:
+    using result_type = std::uint64_t;
+    using key_type = std::array<std::uint32_t, 2>;
+    using counter_type = std::array<std::uint32_t, 4>;
+
+  private:
+    key_type key_{};
+    counter_type counter_{};
+    std::array<result_type, 2> results_{};
+    size_t position_ = 2;
+
+    static constexpr std::uint32_t low_word(std::uint64_t x) {
+      return (static_cast<std::uint32_t>(x));
+    }
+    static constexpr std::uint32_t high_word(std::uint64_t x) {
+      return (static_cast<std::uint32_t>(x >> 32));
+    }
+    static constexpr std::uint64_t join_words(std::uint32_t low, std::uint32_t high) {
+      return ((static_cast<std::uint64_t>(high) << 32) | low);
+    }
+    void advance_counter(std::uint64_t number_of_blocks) {
+      const auto blocks = join_words(counter_[0], counter_[1]) + number_of_blocks;
+      counter_[0] = low_word(blocks);
+      counter_[1] = high_word(blocks);
+    }
+
+  public:
+    static constexpr result_type default_seed = 1U;
+    static constexpr result_type min() { return (std::numeric_limits<result_type>::min()); }
+    static constexpr result_type max() { return (std::numeric_limits<result_type>::max()); }
+
+    //! \brief Default constructor, seeded with default_seed
+    philox4x32_engine() noexcept { seed(default_seed); }
+    //! \brief Constructor from a seed
+    explicit philox4x32_engine(result_type seed_value) noexcept { seed(seed_value); }
+
+    //! \brief Use the seed as the key, and restart from the first block of substream 0
+    void seed(result_type seed_value = default_seed) noexcept {
+      key_ = {low_word(seed_value), high_word(seed_value)};
+      counter_ = {};
+      position_ = 2;
+    }
+
+    //! \brief The Philox4x32-10 bijection of counter under key
+    static constexpr counter_type block(key_type key, counter_type counter) {
+      for (size_t round = 0; round < 10; ++round) {
+        const auto product_0 = static_cast<std::uint64_t>(0xD2511F53U) * counter[0];
+        const auto product_1 = static_cast<std::uint64_t>(0xCD9E8D57U) * counter[2];
+        counter = {high_word(product_1) ^ counter[1] ^ key[0], low_word(product_1),
+                   high_word(product_0) ^ counter[3] ^ key[1], low_word(product_0)};
+        key[0] += 0x9E3779B9U;
+        key[1] += 0xBB67AE85U;
+      }
+      return (counter);
+    }
+
+    /*!
+     * \brief The engine for the stream at an address
+     *
+     * The key is derived from the seed and four coordinates by one application of block, and the
+     * substream is the high half of the counter. Distinct addresses give independent streams.
+     */
+    static philox4x32_engine stream(result_type seed_value, const counter_type &coordinates,
+                                    result_type substream = 0) {
+      philox4x32_engine rc{};
+      const auto derived = block({low_word(seed_value), high_word(seed_value)}, coordinates);
+      rc.key_ = {derived[0], derived[1]};
+      rc.counter_ = {0U, 0U, low_word(substream), high_word(substream)};
+      return (rc);
+    }
+
+    result_type operator()() noexcept {
+      if (position_ == 2) {
+        const auto this_block = block(key_, counter_);
+        results_ = {join_words(this_block[0], this_block[1]),
+                    join_words(this_block[2], this_block[3])};
+        advance_counter(1);
+        position_ = 0;
+      }
+      return (results_[position_++]);
+    }
+
+    //! \brief Fill a buffer with raw draws
+    void generate(std::span<result_type> out) noexcept {
+      for (auto &x : out) {
+        x = (*this)();
+      }
+    }
+
+    //! \brief Skip z draws in constant time
+    void discard(unsigned long long z) noexcept {
+      for (; (z > 0) && (position_ < 2); --z) {
+        ++position_;
+      }
+      advance_counter(z / 2);
+      if (z % 2 == 1) {
+        (*this)();
+      }
+    }
+
+    bool operator==(const philox4x32_engine &other) const = default;
+  };
+
+  template <typename Gen>
+  concept counter_based_random_number_engine
+      = uniform_random_number_engine<Gen>
+        && requires(typename Gen::result_type seed_value,
+                    std::array<std::uint32_t, 4> coordinates) {
+             { Gen::stream(seed_value, coordinates, seed_value) } -> std::same_as<Gen>;
+           };
+
+  template <typename Gen>
+  concept bulk_random_number_engine
+      = uniform_random_number_engine<Gen>
+        && requires(Gen gen, std::span<typename Gen::result_type> out) {
+             { gen.generate(out) };
+           };
+
+  namespace detail {
+    //! \brief Whether each draw of Gen is 64 uniformly random bits
+    template <typename Gen> constexpr bool has_full_64_bit_range
+        = (Gen::min() == 0) && (Gen::max() == std::numeric_limits<std::uint64_t>::max());
+
+    //! \brief Map the top 53 bits of a draw to a double in [0, 1)
+    constexpr double bits_to_canonical(std::uint64_t bits) {
+      return (static_cast<double>(bits >> 11) * 0x1.0p-53);
+    }
+
+    //! \brief A uniform double in [0, 1), from one draw for 64 bit engines
+    template <uniform_random_number_engine Gen> double canonical(Gen &gen) {
+      if constexpr (has_full_64_bit_range<Gen>) {
+        return (bits_to_canonical(gen()));
+      } else {
+        return (std::generate_canonical<double, std::numeric_limits<double>::digits>(gen));
+      }
+    }
+  }  // namespace detail
+
+  /*!
+   * \class geometric_skip_distribution
+   * \brief The number of failures before the first success of independent Bernoulli(p) trials.
+   *
+   * Drawn by inversion from a single uniform, so fill_geometric gives exactly the same skips in
+   * bulk as calling this one at a time on the same engine. Used by sample_view.
+   */
+  class geometric_skip_distribution {
+  private:
+    double probability_ = 1.0;
+    double inverse_log_failure_ = 0.0;
+
+  public:
+    using result_type = size_t;
+    //! \brief The skip used when p is 0: further than any range can go
+    static constexpr result_type never
+        = static_cast<result_type>(std::numeric_limits<std::ptrdiff_t>::max() / 2);
+
+    geometric_skip_distribution() = default;
+    explicit geometric_skip_distribution(double probability)
+        : probability_(probability), inverse_log_failure_(1.0 / std::log1p(-probability)) {}
+
+    //! \brief The success probability
+    double p() const { return (probability_); }
+
+    //! \brief The skip for a uniform in [0, 1)
+    result_type from_uniform(double uniform) const {
+      if (probability_ >= 1.0) {
+        return (0UL);
+      }
+      if (probability_ <= 0.0) {
+        return (never);
+      }
+      // 1 - uniform is in (0, 1], so the logarithm is finite
+      const double skip = std::floor(std::log1p(-uniform) * inverse_log_failure_);
+      return (static_cast<result_type>(std::min(skip, static_cast<double>(never))));
+    }
+
+    template <uniform_random_number_engine Gen> result_type operator()(Gen &gen) const {
+      return (from_uniform(detail::canonical(gen)));
+    }
+  };
+
+  /*!
+   * \class hypergeometric_distribution
+   * \brief The number of marked items among draws taken without replacement from a population.
+   *
+   * Drawn by inversion from a single uniform, summing the probabilities outwards from the mode
+   * (each from the last by the ratio of consecutive terms), so a draw takes time proportional to
+   * the standard deviation rather than the number of draws. Used to split people between
+   * compartments without ever taking more from a compartment than it has.
+   */
+  class hypergeometric_distribution {
+  private:
+    size_t population_ = 0;
+    size_t marked_ = 0;
+    size_t draws_ = 0;
+
+  public:
+    using result_type = size_t;
+
+    //! \brief draws items from population items of which marked are marked
+    hypergeometric_distribution(size_t population, size_t marked, size_t draws)
+        : population_(population), marked_(marked), draws_(draws) {
+      if ((marked > population) || (draws > population)) {
+        throw "A hypergeometric distribution cannot draw or mark more than its population";
+      }
+    }
+
+    //! \brief The smallest possible result
+    result_type min() const {
+      return ((draws_ + marked_ > population_) ? draws_ + marked_ - population_ : 0UL);
+    }
+    //! \brief The largest possible result
+    result_type max() const { return (std::min(draws_, marked_)); }
+
+    //! \brief The result for a uniform in [0, 1)
+    result_type from_uniform(double uniform) const {
+      const size_t lowest = min();
+      const size_t highest = max();
+      if (lowest == highest) {
+        return (lowest);
+      }
+      const auto log_choose = [](double n, double k) {
+        return (std::lgamma(n + 1) - std::lgamma(k + 1) - std::lgamma(n - k + 1));
+      };
+      const double population = static_cast<double>(population_);
+      const double marked = static_cast<double>(marked_);
+      const double draws = static_cast<double>(draws_);
+      const size_t mode = std::clamp(
+          static_cast<size_t>((draws + 1) * (marked + 1) / (population + 2)), lowest, highest);
+      const auto probability_of = [&](size_t k) {
+        const double x = static_cast<double>(k);
+        return (std::exp(log_choose(marked, x) + log_choose(population - marked, draws - x)
+                         - log_choose(population, draws)));
+      };
+      // Ratios of the probability of k + 1 to that of k, and of k - 1 to that of k
+      const auto up_ratio = [&](size_t k) {
+        const double x = static_cast<double>(k);
+        return ((marked - x) * (draws - x) / ((x + 1) * (population - marked - draws + x + 1)));
+      };
+      const auto down_ratio = [&](size_t k) {
+        const double x = static_cast<double>(k);
+        return (x * (population - marked - draws + x) / ((marked - x + 1) * (draws - x + 1)));
+      };
+
+      double cumulative = probability_of(mode);
+      if (uniform < cumulative) {
+        return (mode);
+      }
+      size_t below = mode;
+      size_t above = mode;
+      double below_probability = cumulative;
+      double above_probability = cumulative;
+      while ((below > lowest) || (above < highest)) {
+        if (below > lowest) {
+          below_probability *= down_ratio(below);
+          --below;
+          cumulative += below_probability;
+          if (uniform < cumulative) {
+            return (below);
+          }
+        }
+        if (above < highest) {
+          above_probability *= up_ratio(above);
+          ++above;
+          cumulative += above_probability;
+          if (uniform < cumulative) {
+            return (above);
+          }
+        }
+      }
+      // Only reached through rounding, when uniform is within rounding error of 1
+      return (mode);
+    }
+
+    template <uniform_random_number_engine Gen> result_type operator()(Gen &gen) const {
+      return (from_uniform(detail::canonical(gen)));
+    }
+  };
+
+  namespace detail {
+    //! \brief Number of draws converted at a time by the bulk functions
+    constexpr size_t bulk_block_size = 64;
+  }  // namespace detail
+
+  /*!
+   * \brief Fill a buffer with uniform doubles in [0, 1)
+   *
+   * For 64 bit engines the raw bits are generated a block at a time and then converted in a
+   * separate loop with no dependencies between iterations, which the compiler can vectorize.
+   * Either way the values are the same as calling detail::canonical once per element.
+   */
+  template <uniform_random_number_engine Gen> void fill_uniform(Gen &gen, std::span<double> out) {
+    if constexpr (detail::has_full_64_bit_range<Gen>) {
+      std::array<std::uint64_t, detail::bulk_block_size> bits{};
+      for (size_t offset = 0; offset < out.size(); offset += detail::bulk_block_size) {
+        const auto this_block = std::span(bits).first(
+            std::min(detail::bulk_block_size, out.size() - offset));
+        if constexpr (bulk_random_number_engine<Gen>) {
+          gen.generate(this_block);
+        } else {
+          for (auto &x : this_block) {
+            x = gen();
+          }
+        }
+        for (size_t i = 0; i < this_block.size(); ++i) {
+          out[offset + i] = detail::bits_to_canonical(this_block[i]);
+        }
+      }
+    } else {
+      for (auto &x : out) {
+        x = detail::canonical(gen);
+      }
+    }
+  }
+
+  /*!
+   * \brief Fill a buffer with geometric skips from geometric_skip_distribution(probability)
+   *
+   * Uniforms are drawn a block at a time first, so the logarithms are independent of each other.
+   */
+  template <uniform_random_number_engine Gen>
+  void fill_geometric(Gen &gen, std::span<size_t> out, double probability) {
+    const geometric_skip_distribution dist(probability);
+    if ((probability >= 1.0) || (probability <= 0.0)) {
+      std::fill(std::begin(out), std::end(out), dist.from_uniform(0.0));
+      return;
+    }
+    std::array<double, detail::bulk_block_size> uniforms{};
+    for (size_t offset = 0; offset < out.size(); offset += detail::bulk_block_size) {
+      const auto this_block
+          = std::span(uniforms).first(std::min(detail::bulk_block_size, out.size() - offset));
+      fill_uniform(gen, this_block);
+      for (size_t i = 0; i < this_block.size(); ++i) {
+        out[offset + i] = dist.from_uniform(this_block[i]);
+      }
+    }
+  }
+
+}  // namespace probability
+
+#endif
@@ -1,31 +1,19 @@
+#include <cfepi/random.h>
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
 #include <concepts>
+#include <cstdint>
 #include <iterator>
 #include <random>
 #include <ranges>
+#include <span>
+#include <vector>
 
 #ifndef PROBABILITY_SAMPLE_VIEW_HPP
 #  define PROBABILITY_SAMPLE_VIEW_HPP
 
-namespace probability {
-  // Replace me with the real concept when available
-  //! @defgroup uniform_random_number_engine Uniform Random Number Engine
-  //! @ingroup generalconcepts
-  //! @{
-  template <typename E>
-  concept uniform_random_number_engine
-      = std::uniform_random_bit_generator<E>
-        && requires(E e, typename E::result_type s, E &&v, const E x, const E y) {
-             { E() };
-             { E(s) };
-             { E(x) };
-             { E(e) };
-             { x == y } -> std::same_as<bool>;
-             { x != y } -> std::same_as<bool>;
-           };
-  //!@}
-
-}  // namespace probability
-
 namespace probability {
 
   /*!
@@ -42,7 +30,12 @@ namespace probability {
    * Reference:
    * Same as R
    *
-   * Sized: Never.
+   * Sized: Never. For sized R, expected_size() gives the expected number of elements.
+   *
+   * Random access: If R is random access and sized, positions() gives the offsets of the sampled
+   * elements from a buffer of skips drawn in bulk, and chunks() splits the view into independent
+   * sample_views over consecutive pieces of R which can be consumed in parallel.
+   * count_first_positions() samples by drawing the number of elements first, see there.
    *
    * Common: No.
    *
@@ -59,7 +52,7 @@ namespace probability {
   private:
     R base_;
     Gen gen_;
-    std::geometric_distribution<> dist_;
+    geometric_skip_distribution dist_;
 
     template <bool Const> struct iterator {
       template <class T> using constify = std::conditional_t<Const, const T, T>;
@@ -71,21 +64,21 @@ namespace probability {
       std::ranges::iterator_t<Base> current_{};
       std::ranges::sentinel_t<Base> end_{};
       Gen gen_{};
-      std::geometric_distribution<> dist_;
+      geometric_skip_distribution dist_;
 
       iterator() = default;
       constexpr iterator(std::ranges::iterator_t<Base> begin, Base *base, Gen gen,
-                         std::geometric_distribution<> dist)
+                         geometric_skip_distribution dist)
           : current_(std::move(begin)), end_(std::ranges::end(*base)), gen_(gen), dist_(dist) {
-        std::ranges::advance(current_, dist_(gen_), end_);
+        std::ranges::advance(current_, static_cast<difference_type>(dist_(gen_)), end_);
       }
       iterator &operator++() {
-        std::ranges::advance(current_, dist_(gen_) + 1, end_);
+        std::ranges::advance(current_, static_cast<difference_type>(dist_(gen_)) + 1, end_);
         return (*this);
       }
       iterator operator++(int) {
         const iterator rc{*this};
-        std::ranges::advance(current_, dist_(gen_) + 1, end_);
+        ++(*this);
         return (rc);
       }
 
@@ -121,6 +114,178 @@ namespace probability {
     //! \brief Constructor from a random number generator and a probability of keeping each event
     sample_view(const R &base, double probability, Gen gen)
         : base_(std::move(base)), gen_(gen), dist_(probability) {}
+
+    //! \brief The range being sampled
+    const R &base() const { return (base_); }
+
+    //! \brief The expected number of sampled elements, rounded up, for reserving space
+    size_t expected_size() const
+      requires std::ranges::sized_range<const R>
+    {
+      return (static_cast<size_t>(
+          std::ceil(dist_.p() * static_cast<double>(std::ranges::size(base_)))));
+    }
+
+    /*!
+     * \brief The offsets into R of the sampled elements, in increasing order
+     *
+     * The same elements as iterating the view, with the skips drawn into a buffer by
+     * fill_geometric rather than one at a time.
+     */
+    std::vector<size_t> positions() const
+      requires std::ranges::random_access_range<const R> && std::ranges::sized_range<const R>
+    {
+      const auto base_size = static_cast<size_t>(std::ranges::size(base_));
+      std::vector<size_t> rc{};
+      rc.reserve(expected_size());
+      std::vector<size_t> skips(std::clamp(expected_size() + 1, 1UL, 1024UL));
+      auto gen{gen_};
+      size_t position = 0;
+      while (true) {
+        fill_geometric(gen, skips, dist_.p());
+        for (auto skip : skips) {
+          if (skip >= base_size - position) {
+            return (rc);
+          }
+          position += skip;
+          rc.push_back(position);
+          ++position;
+        }
+      }
+    }
+
+    /*!
+     * \brief Split into number_of_chunks sample_views over consecutive pieces of R
+     *
+     * Each chunk has its own generator, seeded from successive draws of a copy of this view's
+     * generator, so the chunks are independent of each other and of the order they are consumed
+     * in. Since elements are kept independently, the chunks together are a sample of R with the
+     * same distribution as the whole view (though not the same elements).
+     */
+    auto chunks(size_t number_of_chunks) const
+      requires std::ranges::random_access_range<const R> && std::ranges::sized_range<const R>
+    {
+      using chunk_type = sample_view<std::ranges::subrange<std::ranges::iterator_t<const R>>, Gen>;
+      using difference_type = std::ranges::range_difference_t<const R>;
+      const auto first = std::ranges::begin(base_);
+      auto generators = chunk_generators(number_of_chunks);
+      std::vector<chunk_type> rc{};
+      rc.reserve(number_of_chunks);
+      for (size_t chunk = 0; chunk < number_of_chunks; ++chunk) {
+        rc.emplace_back(
+            std::ranges::subrange(
+                first + static_cast<difference_type>(chunk_offset(chunk, number_of_chunks)),
+                first + static_cast<difference_type>(chunk_offset(chunk + 1, number_of_chunks))),
+            dist_.p(), generators[chunk]);
+      }
+      return (rc);
+    }
+
+    /*!
+     * \brief Count first sampling: the number of elements each chunk will sample
+     *
+     * Chunk i (the same pieces as chunks()) keeps Binomial(size of chunk i, p) elements, so the
+     * sum is the exact size of count_first_positions(number_of_chunks), known before any position
+     * is drawn.
+     */
+    std::vector<size_t> chunk_counts(size_t number_of_chunks) const
+      requires std::ranges::random_access_range<const R> && std::ranges::sized_range<const R>
+    {
+      auto generators = chunk_generators(number_of_chunks);
+      std::vector<size_t> rc(number_of_chunks);
+      for (size_t chunk = 0; chunk < number_of_chunks; ++chunk) {
+        rc[chunk] = draw_chunk_count(chunk, number_of_chunks, generators[chunk]);
+      }
+      return (rc);
+    }
+
+    /*!
+     * \brief Count first sampling: the offsets into R of the sampled elements, in increasing order
+     *
+     * Instead of walking geometric skips, each chunk first draws how many elements it keeps
+     * (chunk_counts) and then which ones, uniformly without replacement (Floyd's algorithm). The
+     * number of draws is bounded by the counts, the output is allocated once at its exact size,
+     * and each chunk writes only its own slice of it with its own generator, so the chunks can be
+     * filled in any order or concurrently. The result has the same distribution as positions().
+     */
+    std::vector<size_t> count_first_positions(size_t number_of_chunks = 1) const
+      requires std::ranges::random_access_range<const R> && std::ranges::sized_range<const R>
+    {
+      auto generators = chunk_generators(number_of_chunks);
+      std::vector<size_t> slice_offsets(number_of_chunks + 1, 0UL);
+      for (size_t chunk = 0; chunk < number_of_chunks; ++chunk) {
+        slice_offsets[chunk + 1] = slice_offsets[chunk]
+                                   + draw_chunk_count(chunk, number_of_chunks, generators[chunk]);
+      }
+      std::vector<size_t> rc(slice_offsets.back());
+      for (size_t chunk = 0; chunk < number_of_chunks; ++chunk) {
+        const auto slice = std::span(rc).subspan(slice_offsets[chunk],
+                                                 slice_offsets[chunk + 1] - slice_offsets[chunk]);
+        if (slice.empty()) {
+          continue;
+        }
+        const size_t chunk_begin = chunk_offset(chunk, number_of_chunks);
+        const size_t chunk_size = chunk_offset(chunk + 1, number_of_chunks) - chunk_begin;
+        // A bitmap of the chunk is cheaper than hashing once at least one in 1024 is chosen, and
+        // reading it back gives the positions already sorted
+        if (slice.size() * 1024 >= chunk_size) {
+          std::vector<std::uint64_t> chosen((chunk_size + 63) / 64, 0UL);
+          for (size_t upper = chunk_size - slice.size(); upper < chunk_size; ++upper) {
+            std::uniform_int_distribution<size_t> position_dist(0UL, upper);
+            const size_t position = position_dist(generators[chunk]);
+            const std::uint64_t bit = std::uint64_t{1} << (position % 64);
+            if ((chosen[position / 64] & bit) != 0) {
+              chosen[upper / 64] |= std::uint64_t{1} << (upper % 64);
+            } else {
+              chosen[position / 64] |= bit;
+            }
+          }
+          auto next = std::begin(slice);
+          for (size_t word = 0; word < std::size(chosen); ++word) {
+            for (auto bits = chosen[word]; bits != 0; bits &= bits - 1) {
+              *next++ = chunk_begin + word * 64 + static_cast<size_t>(std::countr_zero(bits));
+            }
+          }
+          continue;
+        }
+        // Otherwise draw with replacement and redraw the duplicates, which are rare when the
+        // sample is sparse. Every subset of the right size is still equally likely.
+        std::uniform_int_distribution<size_t> position_dist(chunk_begin,
+                                                            chunk_begin + chunk_size - 1);
+        for (size_t filled = 0; filled < slice.size();) {
+          for (auto &position : slice.subspan(filled)) {
+            position = position_dist(generators[chunk]);
+          }
+          std::ranges::sort(slice);
+          filled = static_cast<size_t>(std::ranges::unique(slice).begin() - std::begin(slice));
+        }
+      }
+      return (rc);
+    }
+
+  private:
+    //! \brief Offset into R of the start of chunk (chunk == number_of_chunks gives the size)
+    size_t chunk_offset(size_t chunk, size_t number_of_chunks) const {
+      return (static_cast<size_t>(std::ranges::size(base_)) * chunk / number_of_chunks);
+    }
+
+    //! \brief One generator per chunk, seeded from successive draws of a copy of gen_
+    std::vector<Gen> chunk_generators(size_t number_of_chunks) const {
+      auto seed_source{gen_};
+      std::vector<Gen> rc{};
+      rc.reserve(number_of_chunks);
+      for (size_t chunk = 0; chunk < number_of_chunks; ++chunk) {
+        rc.push_back(Gen{seed_source()});
+      }
+      return (rc);
+    }
+
+    size_t draw_chunk_count(size_t chunk, size_t number_of_chunks, Gen &chunk_gen) const {
+      std::binomial_distribution<size_t> count_dist(
+          chunk_offset(chunk + 1, number_of_chunks) - chunk_offset(chunk, number_of_chunks),
+          std::clamp(dist_.p(), 0.0, 1.0));
+      return (count_dist(chunk_gen));
+    }
   };
 
   template <class V, class Gen> sample_view(V &&, double, Gen)
@@ -1,14 +1,22 @@
+#include <cfepi/sample_view.h>
+
 #include <chrono>    // std::chrono::seconds
 #include <iostream>  // std::cout, std::endl
 #include <ranges>
 #include <thread>  // std::this_thread::sleep_for
 // this_thread::yield example
+#include <algorithm>
+#include <array>
+#include <bit>
 #include <atomic>  // std::atomic
 #include <bitset>
+#include <cmath>
 #include <concepts>
+#include <cstdint>
 #include <functional>
 #include <mutex>
 #include <numeric>
+#include <optional>
 #include <queue>
 #include <span>
 #include <typeinfo>
@@ -125,6 +133,81 @@ namespace cfepi {
     }
   };
 
+  /*!
+   * \class sparse_state_counts
+   * \brief Counts of people in each potential state, storing only the potential states seen.
+   *
+   * A drop in replacement for the std::array of counts in aggregated_sir_state: indexing with a
+   * mask reads its count (zero if it was never stored), and indexing a non-const object stores
+   * the mask if needed. Entries are kept sorted by mask, so lookups are binary searches.
+   * Iteration visits the stored counts only, which may include zeros.
+   */
+  template <size_t number_of_masks> class sparse_state_counts {
+  private:
+    std::vector<std::pair<size_t, size_t>> entries_{};
+
+    auto find(size_t mask) const {
+      return (std::ranges::lower_bound(entries_, mask, {},
+                                       [](const auto &entry) { return (entry.first); }));
+    }
+
+  public:
+    size_t operator[](size_t mask) const {
+      const auto entry = find(mask);
+      return (((entry != std::end(entries_)) && (entry->first == mask)) ? entry->second : 0UL);
+    }
+    size_t &operator[](size_t mask) {
+      auto entry = std::ranges::lower_bound(entries_, mask, {},
+                                            [](const auto &entry) { return (entry.first); });
+      if ((entry == std::end(entries_)) || (entry->first != mask)) {
+        entry = entries_.insert(entry, {mask, 0UL});
+      }
+      return (entry->second);
+    }
+    //! \brief The number of masks that could be indexed, as for the dense array
+    static constexpr size_t size() { return (number_of_masks); }
+    //! \brief The stored (mask, count) pairs, in increasing order of mask
+    const std::vector<std::pair<size_t, size_t>> &entries() const { return (entries_); }
+    auto begin() const { return (std::ranges::begin(std::views::values(entries_))); }
+    auto end() const { return (std::ranges::end(std::views::values(entries_))); }
+    //! \brief Equal if every mask has the same count, whether or not zero counts are stored
+    bool operator==(const sparse_state_counts &other) const {
+      const auto nonzero = std::views::filter([](const auto &entry) { return (entry.second > 0); });
+      return (std::ranges::equal(entries_ | nonzero, other.entries_ | nonzero));
+    }
+  };
+
+  namespace detail {
+    //! \brief Models with more compartments than this aggregate into sparse_state_counts
+    constexpr size_t max_dense_compartments = 8;
+  }  // namespace detail
+
+  //! \brief The counts of an aggregated_sir_state: a std::array with an element for each
+  //! potential state for models with up to detail::max_dense_compartments compartments, and a
+  //! sparse_state_counts above that
+  template <typename states_t> using potential_state_counts_t = std::conditional_t<
+      (std::size(states_t{}) <= detail::max_dense_compartments),
+      std::array<size_t, detail::int_pow(2, std::size(states_t{})) + 1>,
+      sparse_state_counts<detail::int_pow(2, std::size(states_t{})) + 1>>;
+
+  //! \brief Call f(mask, count) for each potential state with a nonzero count
+  template <size_t number_of_masks>
+  void for_each_potential_state(const std::array<size_t, number_of_masks> &counts, auto &&f) {
+    for (size_t mask = 0; mask < number_of_masks; ++mask) {
+      if (counts[mask] > 0) {
+        f(mask, counts[mask]);
+      }
+    }
+  }
+  template <size_t number_of_masks>
+  void for_each_potential_state(const sparse_state_counts<number_of_masks> &counts, auto &&f) {
+    for (const auto &[mask, count] : counts.entries()) {
+      if (count > 0) {
+        f(mask, count);
+      }
+    }
+  }
+
   //! \brief Class for keeping track of the current state of a compartmental model (without
   //! potential states).
   //!
@@ -133,14 +216,21 @@ namespace cfepi {
   template <typename states_t> struct aggregated_sir_state {
     //! \brief The main part of the class. For each element of the powerset of states_t, stores
     //! counts of people in that potential states
-    std::array<size_t, detail::int_pow(2, std::size(states_t{})) + 1> potential_state_counts;
+    potential_state_counts_t<states_t> potential_state_counts;
     //! \brief Time that this state represents
     epidemic_time_t time = -1;
+    //! \brief For each event type, the number of people it moved during the step ending in this
+    //! state (the flow, or incidence, of that event type). This counts people moved rather than
+    //! events applied: an interaction moving one of its two people counts once. A person moved by
+    //! two events in one step is counted twice, unless conflicts are resolved (see
+    //! run_simulation). Zero for the initial conditions of run_simulation,
+    //! run_hybrid_simulation and run_partitioned_simulation, and empty for states they did not
+    //! produce.
+    std::vector<size_t> event_counts{};
     //! \brief Default constructor with size 0
     aggregated_sir_state() = default;
     //! \brief Default constructor by component
-    aggregated_sir_state(const std::array<size_t, detail::int_pow(2, std::size(states_t{})) + 1>
-                             &_potential_state_counts,
+    aggregated_sir_state(const potential_state_counts_t<states_t> &_potential_state_counts,
                          epidemic_time_t _time)
         : potential_state_counts(_potential_state_counts), time(_time){};
     //! \brief Conversion constructor from states with potential states
@@ -149,11 +239,7 @@ namespace cfepi {
         : potential_state_counts(aggregate_state_to_array(sir_state)), time(sir_state.time){};
     //! \brief basically only for testing
     bool operator==(const aggregated_sir_state<states_t> &other) const {
-      return (std::transform_reduce(
-          std::begin(potential_state_counts), std::end(potential_state_counts),
-          std::begin(other.potential_state_counts), true,
-          [](const auto &x, const auto &y) { return (x || y); },
-          [](const auto &x, const auto &y) { return (x == y); }));
+      return (potential_state_counts == other.potential_state_counts);
     };
   };
 
@@ -166,15 +252,10 @@ namespace cfepi {
    * returns false
    */
   template <typename states_t> bool is_simple(const aggregated_sir_state<states_t> &state) {
-    size_t pow_idx = 1;
     bool rc = true;
-    for (auto idx : std::views::iota(1UL, detail::int_pow(2, std::size(states_t{})) + 1)) {
-      if (idx != pow_idx) {
-        rc = rc && state.potential_state_counts[idx] == 0;
-      } else {
-        pow_idx *= 2;
-      }
-    }
+    for_each_potential_state(state.potential_state_counts, [&rc](size_t mask, size_t) {
+      rc = rc && (std::popcount(mask) <= 1);
+    });
     return (rc);
   }
 
@@ -222,15 +303,27 @@ namespace cfepi {
              { std::size(e) } -> std::unsigned_integral;
            };
 
-  template <typename event_type>
-    requires is_event_type_like<event_type>
-  struct sir_event {
+  /*!
+   * \brief Compact record of a single sampled event.
+   *
+   * Only the data that differs between two events of the same type is stored. The preconditions
+   * and postconditions are looked up by type_index in an event_type_table, so a record is just the
+   * affected people, the time, and an index. Slots of affected_people past the size of the event
+   * type are unused.
+   */
+  template <size_t event_size> struct compact_sir_event {
     epidemic_time_t time = -1;
-    std::array<person_t, event_type::size()> affected_people = {};
-    const event_type type;
-    sir_event(const event_type &_type) : type(_type) {}
+    std::array<person_t, event_size> affected_people = {};
+    size_t type_index = 0;
+    //! \brief Index of the event type, so filters can keep using event.index()
+    constexpr size_t index() const { return (type_index); }
+    constexpr auto static inline size() { return (event_size); };
   };
 
+  template <typename event_type>
+    requires is_event_type_like<event_type>
+  using sir_event = compact_sir_event<event_type::size()>;
+
   template <typename states_t> struct interaction_event_type : public sir_event_type<states_t, 2> {
     using sir_event_type<states_t, 2>::preconditions;
     using sir_event_type<states_t, 2>::postconditions;
@@ -256,13 +349,87 @@ namespace cfepi {
             std::array<std::optional<typename states_t::state>, 1>{result_state}) {}
   };
 
+  /*!
+   * \class event_weights
+   * \brief Heterogeneous rates for the candidate events of one event type.
+   *
+   * The probability of a candidate event is the event type's probability, times
+   * person_weights[slot][person] for every slot that has weights (indexed by person, empty means
+   * every person has weight 1), times pair_weight(affected_people) if it is set. pair_weight must
+   * return values in [0, max_pair_weight]. Probabilities above 1 are capped at 1.
+   */
+  template <size_t event_size> struct event_weights {
+    std::array<std::vector<double>, event_size> person_weights = {};
+    std::function<double(const std::array<person_t, event_size> &)> pair_weight = {};
+    double max_pair_weight = 1.0;
+  };
+
+  /*!
+   * \class weighted_event_type
+   * \brief An event type whose candidate events have heterogeneous probabilities.
+   *
+   * Use in place of event_type_t in the variant of event types; run_simulation samples it with
+   * single_type_event_generator::weighted_event_sample instead of a uniform probability.
+   */
+  template <typename event_type_t> struct weighted_event_type : public event_type_t {
+    event_weights<event_type_t::size()> weights = {};
+  };
+
   /*******************************************************************************
    * Helper functions for any_sir_event variant type                             *
    *******************************************************************************/
 
   template <typename any_event_type, size_t event_index> struct event_size_by_event_index {
     constexpr static const size_t value
-        = std::size(std::variant_alternative_t<event_index, any_event_type>{});
+        = std::variant_alternative_t<event_index, any_event_type>::size();
+  };
+
+  template <typename any_event_type,
+            typename = std::make_index_sequence<std::variant_size_v<any_event_type>>>
+  struct max_event_size;
+
+  template <typename any_event_type, size_t... event_index>
+  struct max_event_size<any_event_type, std::index_sequence<event_index...>> {
+    constexpr static const size_t value
+        = std::max({0UL, event_size_by_event_index<any_event_type, event_index>::value...});
+  };
+
+  //! \brief Preconditions and postconditions of one event type, padded to a common size
+  template <typename states_t, size_t event_size> struct event_type_info {
+    std::array<std::bitset<std::size(states_t{})>, event_size> preconditions = {};
+    std::array<std::optional<typename states_t::state>, event_size> postconditions = {};
+    size_t size = 0;
+  };
+
+  /*!
+   * \class event_type_table
+   * \brief Shared lookup table from event type index to event type metadata.
+   *
+   * Built once per simulation from the tuple of event types, so that sampled events only need to
+   * carry a type_index (see compact_sir_event).
+   */
+  template <typename states_t, typename any_event_type> struct event_type_table {
+    constexpr static const size_t max_size = max_event_size<any_event_type>::value;
+    std::array<event_type_info<states_t, max_size>, std::variant_size_v<any_event_type>> entries;
+
+    const event_type_info<states_t, max_size> &operator[](size_t type_index) const {
+      return (entries[type_index]);
+    }
+
+    explicit event_type_table(const auto &all_event_types) {
+      [this, &all_event_types]<size_t... event_index>(std::index_sequence<event_index...>) {
+        (..., fill_entry(entries[event_index], std::get<event_index>(all_event_types)));
+      }(std::make_index_sequence<std::variant_size_v<any_event_type>>{});
+    }
+
+  private:
+    static void fill_entry(event_type_info<states_t, max_size> &entry, const auto &event_type) {
+      entry.size = std::size(event_type);
+      std::copy(std::begin(event_type.preconditions), std::end(event_type.preconditions),
+                std::begin(entry.preconditions));
+      std::copy(std::begin(event_type.postconditions), std::end(event_type.postconditions),
+                std::begin(entry.postconditions));
+    }
   };
 
   struct any_sir_event_print {
@@ -282,41 +449,178 @@ namespace cfepi {
     }
   };
 
-  template <typename states_t> struct any_sir_event_get_affected_person {
+  struct any_sir_event_get_affected_person {
     size_t index;
-    template <typename event_type> person_t operator()(const sir_event<event_type> &x) const {
-      return x.affected_people[index];
-    }
+    person_t operator()(const auto &x) const { return x.affected_people[index]; }
   };
 
-  template <typename any_event, typename states_t> struct any_state_check_preconditions {
+  template <typename any_event_type, typename states_t> struct any_state_check_preconditions {
     const sir_state<states_t> &this_sir_state;
-    bool operator()(const auto x) const {
+    const event_type_table<states_t, any_event_type> &event_types;
+    bool operator()(const auto &x) const {
+      const auto &type = event_types[x.type_index];
       auto rc = true;
-      size_t event_size = x.affected_people.size();
-      for (person_t i = 0; i < event_size; ++i) {
-        auto tmp = false;
-        // Make an iterator for states_t maybe
-        for (size_t compartment = 0; compartment < std::size(states_t{}); ++compartment) {
-          auto lhs = x.type.preconditions[i][compartment];
-          auto rhs = this_sir_state.potential_states[x.affected_people[i]][compartment];
-          tmp = tmp || (lhs && rhs);
+      for (person_t i = 0; i < type.size; ++i) {
+        rc = rc
+             && (type.preconditions[i] & this_sir_state.potential_states[x.affected_people[i]])
+                    .any();
+      }
+      return (rc);
+    }
+  };
+
+  /*!
+   * \class precondition_batch
+   * \brief The preconditions of a batch of events of one type, checked one world at a time
+   *
+   * any_state_check_preconditions is called once per event and world, and looks the event type up
+   * and loops over its slots each time. The batch takes the precondition masks of the type once,
+   * and check runs one branch free pass over the events per world, so the loads of different
+   * events are independent of each other.
+   */
+  template <typename states_t, size_t max_size, typename event_t> class precondition_batch {
+  private:
+    static_assert(std::size(states_t{}) <= 64, "Batched checks pack potential states into a word");
+    size_t number_of_slots_ = 0;
+    std::array<std::uint64_t, max_size> precondition_words_{};
+    std::span<const event_t> events_;
+
+  public:
+    //! \brief Check events, which should all be of type and outlive the batch
+    precondition_batch(const event_type_info<states_t, max_size> &type,
+                       std::span<const event_t> events)
+        : number_of_slots_(type.size), events_(events) {
+      for (auto slot : std::ranges::views::iota(0UL, number_of_slots_)) {
+        precondition_words_[slot] = type.preconditions[slot].to_ullong();
+      }
+    }
+
+    //! \brief Set valid to one entry per event, 1 if it satisfies its preconditions in state
+    void check(const sir_state<states_t> &state, std::vector<std::uint8_t> &valid) const {
+      valid.resize(std::size(events_));
+      const auto *potential_states = state.potential_states.data();
+      for (size_t index = 0; index < std::size(events_); ++index) {
+        bool this_valid = true;
+        for (size_t slot = 0; slot < max_size; ++slot) {
+          this_valid &= (slot >= number_of_slots_)
+                        || ((potential_states[events_[index].affected_people[slot]].to_ullong()
+                             & precondition_words_[slot])
+                            != 0);
         }
-        rc = rc && tmp;
+        valid[index] = this_valid;
+      }
+    }
+  };
+
+  //! \brief Event types whose preconditions and postconditions are known at compile time
+  template <typename T>
+  concept constexpr_event_type
+      = is_event_type_like<T>
+        && requires { typename std::integral_constant<bool, (static_cast<void>(T{}), true)>; };
+
+  /*!
+   * \class static_event_application
+   * \brief Precondition checks and application for one event type, specialized at compile time.
+   *
+   * The generic visitors look the event type up in event_type_table and loop over its slots and
+   * optional postconditions at run time. Here the masks are constants and the slots are
+   * unrolled, so checking is one mask-and per person and applying is one mask-or into
+   * states_entered and one mask-and into states_remained per changed person. Used by
+   * single_event_type_run for every event type satisfying constexpr_event_type.
+   */
+  template <typename event_type_t>
+    requires constexpr_event_type<event_type_t>
+  struct static_event_application {
+    using states_t = typename event_type_t::state_type;
+    using mask_t = std::bitset<std::size(states_t{})>;
+    static constexpr size_t event_size = event_type_t::size();
+
+  private:
+    static constexpr event_type_t type{};
+
+    // Built bit by bit, as bitset operators are not constexpr before C++23
+    static constexpr std::uint64_t precondition_word(size_t slot) {
+      std::uint64_t rc = 0;
+      for (size_t compartment = 0; compartment < std::size(states_t{}); ++compartment) {
+        rc |= type.preconditions[slot][compartment] ? (std::uint64_t{1} << compartment) : 0;
+      }
+      return (rc);
+    }
+    template <size_t... slot>
+    static constexpr std::array<mask_t, event_size> preconditions(std::index_sequence<slot...>) {
+      return {mask_t{precondition_word(slot)}...};
+    }
+    static constexpr std::uint64_t postcondition_word(size_t slot) {
+      return (type.postconditions[slot]
+                  ? std::uint64_t{1} << static_cast<size_t>(type.postconditions[slot].value())
+                  : 0);
+    }
+    template <size_t... slot>
+    static constexpr std::array<mask_t, event_size> entered(std::index_sequence<slot...>) {
+      return {mask_t{postcondition_word(slot)}...};
+    }
+    template <size_t... slot>
+    static constexpr std::array<mask_t, event_size> remained(std::index_sequence<slot...>) {
+      return {mask_t{type.postconditions[slot] ? ~precondition_word(slot) : ~std::uint64_t{0}}...};
+    }
+
+  public:
+    static constexpr std::array<mask_t, event_size> precondition_masks
+        = preconditions(std::make_index_sequence<event_size>{});
+    //! \brief ORed into states_entered for each person
+    static constexpr std::array<mask_t, event_size> entered_masks
+        = entered(std::make_index_sequence<event_size>{});
+    //! \brief ANDed into states_remained for each person
+    static constexpr std::array<mask_t, event_size> remained_masks
+        = remained(std::make_index_sequence<event_size>{});
+    static constexpr std::array<bool, event_size> changes = [] {
+      std::array<bool, event_size> rc{};
+      for (size_t slot = 0; slot < event_size; ++slot) {
+        rc[slot] = type.postconditions[slot].has_value();
       }
       return (rc);
+    }();
+
+    //! \brief True if event satisfies the preconditions in state
+    static bool check(const sir_state<states_t> &state, const auto &event) {
+      return ([&]<size_t... slot>(std::index_sequence<slot...>) {
+        return ((... && (precondition_masks[slot]
+                         & state.potential_states[event.affected_people[slot]])
+                            .any()));
+      }(std::make_index_sequence<event_size>{}));
+    }
+
+    //! \brief Apply event to the pending changes of a world
+    static void apply(sir_state<states_t> &states_entered, sir_state<states_t> &states_remained,
+                      const auto &event) {
+      states_entered.time = event.time;
+      states_remained.time = event.time;
+      [&]<size_t... slot>(std::index_sequence<slot...>) {
+        (..., apply_slot<slot>(states_entered, states_remained, event));
+      }(std::make_index_sequence<event_size>{});
+    }
+
+  private:
+    template <size_t slot>
+    static void apply_slot(sir_state<states_t> &states_entered,
+                           sir_state<states_t> &states_remained, const auto &event) {
+      if constexpr (changes[slot]) {
+        const auto person = event.affected_people[slot];
+        states_entered.potential_states[person] |= entered_masks[slot];
+        states_remained.potential_states[person] &= remained_masks[slot];
+      }
     }
   };
 
-  template <typename states_t> struct any_event_apply_entered_states {
+  template <typename states_t, typename any_event_type> struct any_event_apply_entered_states {
     sir_state<states_t> &this_sir_state;
+    const event_type_table<states_t, any_event_type> &event_types;
     void operator()(const auto &x) const {
+      const auto &type = event_types[x.type_index];
       this_sir_state.time = x.time;
-      size_t event_size = x.affected_people.size();
 
-      for (auto person_index :
-           std::ranges::views::iota(0UL) | std::ranges::views::take(event_size)) {
-        auto to_state = x.type.postconditions[person_index];
+      for (auto person_index : std::ranges::views::iota(0UL, type.size)) {
+        auto to_state = type.postconditions[person_index];
         if (to_state) {
           auto affected_person = x.affected_people[person_index];
           this_sir_state.potential_states[affected_person][to_state.value()] = true;
@@ -325,20 +629,17 @@ namespace cfepi {
     }
   };
 
-  template <typename states_t> struct any_event_apply_left_states {
+  template <typename states_t, typename any_event_type> struct any_event_apply_left_states {
     sir_state<states_t> &this_sir_state;
+    const event_type_table<states_t, any_event_type> &event_types;
     void operator()(const auto &x) const {
+      const auto &type = event_types[x.type_index];
       this_sir_state.time = x.time;
-      size_t event_size = x.affected_people.size();
 
-      for (auto person_index : std::ranges::views::iota(0UL, event_size)) {
-        auto to_state = x.type.postconditions[person_index];
-        if (to_state) {
-          for (auto state_index : std::ranges::views::iota(0UL, std::size(states_t{}))) {
-            this_sir_state.potential_states[x.affected_people[person_index]][state_index]
-                = this_sir_state.potential_states[x.affected_people[person_index]][state_index]
-                  && !x.type.preconditions[person_index][state_index];
-          }
+      for (auto person_index : std::ranges::views::iota(0UL, type.size)) {
+        if (type.postconditions[person_index]) {
+          this_sir_state.potential_states[x.affected_people[person_index]]
+              &= ~type.preconditions[person_index];
         }
       }
     }
@@ -372,9 +673,10 @@ namespace cfepi {
     return return_value;
   }
 
-  template <typename event_type_t> const auto transform_array_to_sir_event_l
-      = [](const event_type_t &event_type, const auto &x) {
-          sir_event<event_type_t> rc{event_type};
+  template <typename event_t> const auto transform_array_to_sir_event_l
+      = [](const size_t type_index, const auto &x) {
+          event_t rc{};
+          rc.type_index = type_index;
           std::apply([&rc](const auto... y) { rc.affected_people = {y...}; }, x);
           return (rc);
         };
@@ -396,10 +698,8 @@ namespace cfepi {
   */
 
   template <typename states_t>
-  std::array<size_t, detail::int_pow(2, std::size(states_t{})) + 1> aggregate_state_to_array(
-      const sir_state<states_t> &state) {
-    std::array<size_t, detail::int_pow(2, std::size(states_t{})) + 1> rc;
-    std::fill(std::begin(rc), std::end(rc), 0);
+  potential_state_counts_t<states_t> aggregate_state_to_array(const sir_state<states_t> &state) {
+    potential_state_counts_t<states_t> rc{};
     for (auto possible_states : state.potential_states) {
       rc[possible_states.to_ulong()] += 1;
     }
@@ -432,18 +732,17 @@ namespace cfepi {
   void print(const aggregated_sir_state<states_t> &aggregates, const std::string &prefix = "") {
     std::cout << prefix << "Possible states at time ";
     std::cout << aggregates.time << "\n";
-    for (size_t subset = 0; subset <= detail::int_pow(2, std::size(states_t{})); ++subset) {
-      if (aggregates.potential_state_counts[subset] > 0) {
-        std::cout << prefix;
-        for (size_t compartment = 0; compartment < std::size(states_t{}); ++compartment) {
-          if ((subset % detail::int_pow(2, compartment + 1) / detail::int_pow(2, compartment))
-              == 1) {
-            std::cout << compartment << " ";
-          }
+    for_each_potential_state(aggregates.potential_state_counts, [&prefix](size_t subset,
+                                                                          size_t count) {
+      std::cout << prefix;
+      for (size_t compartment = 0; compartment < std::size(states_t{}); ++compartment) {
+        if ((subset % detail::int_pow(2, compartment + 1) / detail::int_pow(2, compartment))
+            == 1) {
+          std::cout << compartment << " ";
         }
-        std::cout << " : " << aggregates.potential_state_counts[subset] << std::endl;
       }
-    }
+      std::cout << " : " << count << std::endl;
+    });
   }
 
   const auto apply_lambda = [](const auto &...x) {
@@ -456,10 +755,10 @@ namespace cfepi {
             typename = std::make_index_sequence<std::variant_size_v<any_event_type>>>
   struct any_event;
 
+  //! \brief A single record type able to hold a sampled event of any of the event types
   template <typename any_event_type, size_t... event_index>
   struct any_event<any_event_type, std::index_sequence<event_index...>> {
-    typedef std::variant<sir_event<std::variant_alternative_t<event_index, any_event_type>>...>
-        type;
+    typedef compact_sir_event<max_event_size<any_event_type>::value> type;
   };
 
   template <typename any_event_type,
@@ -476,6 +775,7 @@ namespace cfepi {
   template <typename event_type_t, size_t... precondition_index>
   struct single_type_event_generator<event_type_t, std::index_sequence<precondition_index...>> {
     event_type_t event_type;
+    size_t event_index;
     std::tuple<detail::repeat<std::vector<size_t>, precondition_index>...> vectors;
 
     // Making this const causes everything to fail
@@ -484,18 +784,114 @@ namespace cfepi {
       // return (std::apply(apply_lambda, vectors));
     }
 
-    auto event_range() {
-      const auto local_event_type = event_type;
-      const auto the_lambda = [local_event_type](const auto &x) {
-        return (transform_array_to_sir_event_l<event_type_t>(local_event_type, x));
-        // return(sir_event<event_type_t>{});
+    //! \brief The candidate events as records of type event_t, tagged with event_index
+    template <typename event_t = sir_event<event_type_t>> auto event_range() {
+      const auto local_event_index = event_index;
+      const auto the_lambda = [local_event_index](const auto &x) {
+        return (transform_array_to_sir_event_l<event_t>(local_event_index, x));
       };
       return (std::ranges::transform_view(cartesian_range(), the_lambda));
     }
 
+    /*!
+     * \brief Sample the candidate events with heterogeneous probabilities given by weights
+     *
+     * The candidates for each slot are grouped into classes whose weights are within a factor of
+     * two of each other. For each combination of classes, the cartesian product is sampled with
+     * sample_view at the largest probability in the combination, and each sampled event is kept
+     * with the ratio of its own probability to that bound (thinning). Every candidate is kept
+     * with exactly its own probability, while the number of draws is at most 2^size() (times
+     * max_pair_weight over the mean pair weight) per event kept, plus a constant per combination.
+     */
+    template <typename event_t = sir_event<event_type_t>, typename Gen>
+    std::vector<event_t> weighted_event_sample(const event_weights<event_type_t::size()> &weights,
+                                               const double probability, Gen &gen) const {
+      constexpr size_t event_size = event_type_t::size();
+      static constexpr size_t max_number_of_classes = 64;
+      std::array<std::vector<std::vector<size_t>>, event_size> classes{};
+      std::array<std::vector<double>, event_size> class_bounds{};
+
+      const auto split_into_classes = [&weights, &classes, &class_bounds](
+                                          const size_t slot,
+                                          const std::vector<size_t> &candidates) {
+        const auto &slot_weights = weights.person_weights[slot];
+        if (std::empty(slot_weights)) {
+          classes[slot].push_back(candidates);
+          class_bounds[slot].push_back(1.0);
+          return;
+        }
+        double largest_weight = 0;
+        for (auto person : candidates) {
+          largest_weight = std::max(largest_weight, slot_weights[person]);
+        }
+        if (largest_weight <= 0) {
+          return;
+        }
+        std::vector<std::vector<size_t>> slot_classes(max_number_of_classes);
+        for (auto person : candidates) {
+          if (slot_weights[person] > 0) {
+            const auto this_class = std::min(
+                max_number_of_classes - 1,
+                static_cast<size_t>(std::floor(std::log2(largest_weight / slot_weights[person]))));
+            slot_classes[this_class].push_back(person);
+          }
+        }
+        for (auto this_class : std::ranges::views::iota(0UL, max_number_of_classes)) {
+          if (!std::empty(slot_classes[this_class])) {
+            classes[slot].push_back(std::move(slot_classes[this_class]));
+            class_bounds[slot].push_back(std::ldexp(largest_weight, -static_cast<int>(this_class)));
+          }
+        }
+      };
+      (..., split_into_classes(precondition_index, std::get<precondition_index>(vectors)));
+
+      std::vector<event_t> rc{};
+      size_t number_of_combinations = 1;
+      for (const auto &slot_classes : classes) {
+        number_of_combinations *= std::size(slot_classes);
+      }
+      std::uniform_real_distribution<double> thinning_dist(0.0, 1.0);
+      for (size_t combination = 0; combination < number_of_combinations; ++combination) {
+        std::array<size_t, event_size> class_index{};
+        size_t remainder = combination;
+        double bound = probability * (weights.pair_weight ? weights.max_pair_weight : 1.0);
+        for (auto slot : std::ranges::views::iota(0UL, event_size)) {
+          class_index[slot] = remainder % std::size(classes[slot]);
+          remainder /= std::size(classes[slot]);
+          bound *= class_bounds[slot][class_index[slot]];
+        }
+        bound = std::min(bound, 1.0);
+        if (bound <= 0) {
+          continue;
+        }
+        auto sampled = std::ranges::views::cartesian_product(
+                           classes[precondition_index][class_index[precondition_index]]...)
+                       | probability::views::sample(bound, Gen{gen()});
+        for (const auto &x : sampled) {
+          const std::array<person_t, event_size> affected_people{
+              std::get<precondition_index>(x)...};
+          double this_probability = probability;
+          for (auto slot : std::ranges::views::iota(0UL, event_size)) {
+            if (!std::empty(weights.person_weights[slot])) {
+              this_probability *= weights.person_weights[slot][affected_people[slot]];
+            }
+          }
+          if (weights.pair_weight) {
+            this_probability *= weights.pair_weight(affected_people);
+          }
+          if (thinning_dist(gen) * bound < std::min(this_probability, 1.0)) {
+            rc.push_back(transform_array_to_sir_event_l<event_t>(event_index, x));
+          }
+        }
+      }
+      return (rc);
+    }
+
     explicit single_type_event_generator(
-        event_type_t event_type_, const sir_state<typename event_type_t::state_type> &current_state)
+        event_type_t event_type_, const sir_state<typename event_type_t::state_type> &current_state,
+        const size_t event_index_ = 0)
         : event_type(event_type_),
+          event_index(event_index_),
           vectors(
               std::make_tuple(get_precondition_satisfying_indices<typename event_type_t::state_type,
                                                                   precondition_index>(
@@ -0,0 +1,140 @@
+#include <cfepi/random.h>
+#include <cfepi/sir.h>
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#ifndef __STRATA_H_
+#  define __STRATA_H_
+
+namespace cfepi {
+
+  /*!
+   * \class contact_matrix
+   * \brief Strata (for example age groups or regions) and the relative contact rate between each
+   * pair of strata.
+   *
+   * Keeping strata out of the states enum keeps the powerset in aggregated_sir_state and the
+   * number of event types small. rates is row major: rates[a * number_of_strata + b] scales the
+   * probability of an interaction between a person of stratum a in slot 0 and a person of
+   * stratum b in slot 1.
+   */
+  struct contact_matrix {
+    //! \brief The stratum of each person
+    std::vector<size_t> stratum = {};
+    size_t number_of_strata = 1;
+    std::vector<double> rates = {1.0};
+
+    double operator()(size_t slot_0_stratum, size_t slot_1_stratum) const {
+      return (rates[slot_0_stratum * number_of_strata + slot_1_stratum]);
+    }
+
+    //! \brief Throw unless the matrix and strata have the sizes needed for a population
+    void check_size(const person_t population_size) const {
+      if (std::size(rates) != number_of_strata * number_of_strata) {
+        throw "Contact matrix should have one rate for each pair of strata";
+      }
+      if (std::size(stratum) < population_size) {
+        throw "Contact matrix should have a stratum for each person";
+      }
+    }
+
+    /*!
+     * \brief Throw unless the matrix and strata are consistent with a population
+     *
+     * This looks at every person, so run_simulation calls it once per run and sampling only calls
+     * check_size.
+     */
+    void validate(const person_t population_size) const {
+      check_size(population_size);
+      if (std::ranges::any_of(stratum, [this](size_t x) { return (x >= number_of_strata); })) {
+        throw "Contact matrix has a person in a stratum that does not exist";
+      }
+    }
+
+    //! \brief Bucket people by stratum, keeping their order within each bucket
+    std::vector<std::vector<size_t>> bucket(const std::vector<size_t> &people) const {
+      std::vector<std::vector<size_t>> rc(number_of_strata);
+      for (auto person : people) {
+        rc[stratum[person]].push_back(person);
+      }
+      return (rc);
+    }
+  };
+
+  /*!
+   * \class stratified_event_type
+   * \brief An interaction event type whose probability depends on the strata of the two people.
+   *
+   * Use in place of event_type_t in the variant of event types, and set mixing before running.
+   * run_simulation buckets the candidates of each slot by stratum and samples each block of the
+   * cartesian product at the event probability times the contact rate of the block, so the cost
+   * is the number of candidates and blocks plus the number of sampled events.
+   */
+  template <typename event_type_t> struct stratified_event_type : public event_type_t {
+    static_assert(event_type_t::size() == 2, "Stratified events need exactly two people");
+    std::shared_ptr<const contact_matrix> mixing = {};
+
+    template <typename event_t, typename Gen>
+    std::vector<event_t> sample_events(
+        const sir_state<typename event_type_t::state_type> &current_state,
+        const std::vector<size_t> &slot_0_candidates, const std::vector<size_t> &slot_1_candidates,
+        const size_t event_index, const double probability, Gen &gen) const {
+      if (!mixing) {
+        throw "stratified_event_type needs a contact matrix";
+      }
+      mixing->check_size(current_state.size());
+      const auto slot_0_blocks = mixing->bucket(slot_0_candidates);
+      const auto slot_1_blocks = mixing->bucket(slot_1_candidates);
+
+      std::vector<event_t> rc{};
+      for (auto slot_0_stratum : std::ranges::views::iota(0UL, mixing->number_of_strata)) {
+        const auto &slot_0_people = slot_0_blocks[slot_0_stratum];
+        for (auto slot_1_stratum : std::ranges::views::iota(0UL, mixing->number_of_strata)) {
+          const auto &slot_1_people = slot_1_blocks[slot_1_stratum];
+          const size_t block_size = std::size(slot_0_people) * std::size(slot_1_people);
+          const double block_probability
+              = std::min(1.0, probability * (*mixing)(slot_0_stratum, slot_1_stratum));
+          if ((block_size == 0) || (block_probability <= 0)) {
+            continue;
+          }
+          // Geometric skips over the block, decoded as in the cartesian product
+          const probability::geometric_skip_distribution dist(block_probability);
+          for (size_t position = dist(gen); position < block_size; position += dist(gen) + 1) {
+            event_t event{};
+            event.type_index = event_index;
+            event.affected_people[0] = slot_0_people[position / std::size(slot_1_people)];
+            event.affected_people[1] = slot_1_people[position % std::size(slot_1_people)];
+            rc.push_back(event);
+          }
+        }
+      }
+      return (rc);
+    }
+  };
+
+  /*!
+   * \brief Aggregate a state separately for each stratum
+   *
+   * @return One aggregated state per stratum, indexed by stratum.
+   */
+  template <typename states_t>
+  std::vector<aggregated_sir_state<states_t>> aggregate_by_stratum(
+      const sir_state<states_t> &state, const contact_matrix &mixing) {
+    mixing.validate(state.size());
+    std::vector<aggregated_sir_state<states_t>> rc(mixing.number_of_strata);
+    for (auto &stratum_state : rc) {
+      stratum_state.potential_state_counts = {};
+      stratum_state.time = state.time;
+    }
+    for (auto person : std::ranges::views::iota(0UL, state.size())) {
+      ++rc[mixing.stratum[person]]
+            .potential_state_counts[state.potential_states[person].to_ulong()];
+    }
+    return (rc);
+  }
+
+}  // namespace cfepi
+
+#endif
@@ -0,0 +1,249 @@
+#include <cfepi/random.h>
+#include <cfepi/sir.h>
+
+#include <cmath>
+#include <limits>
+#include <random>
+
+#ifndef __TAU_LEAPING_H_
+#  define __TAU_LEAPING_H_
+
+namespace cfepi {
+
+  //! \brief Number of people in each compartment of a single world
+  template <typename states_t> using compartment_counts
+      = std::array<size_t, std::size(states_t{})>;
+
+  //! \brief Number of people in each compartment of a simple sir_state
+  template <typename states_t>
+  compartment_counts<states_t> count_compartments(const sir_state<states_t> &state) {
+    const auto aggregates = aggregate_state(state);
+    if (!is_simple(aggregates)) {
+      throw "Count based simulation requires every person to be in exactly one compartment";
+    }
+    compartment_counts<states_t> rc{};
+    for (size_t compartment = 0; compartment < std::size(states_t{}); ++compartment) {
+      rc[compartment] = aggregates.potential_state_counts[1UL << compartment];
+    }
+    return (rc);
+  }
+
+  //! \defgroup Tau_Leaping Tau Leaping
+  //! @{
+  /*!
+   * \brief Run a tau leaping simulation of a single world from compartment counts
+   *
+   * Instead of tracking people, each leap of length tau draws the number of events of each event
+   * type. If an event type moves people out of a single precondition (e.g. recovery, or infection
+   * moving the susceptible person), the count is binomial over the people satisfying that
+   * precondition with the per person hazard given by the other preconditions, which can never
+   * move more people than exist. Otherwise the count is Poisson, capped by the people available.
+   * People leaving a precondition spanning several compartments are split between them as if
+   * drawn at random without replacement, so no compartment gives more people than it has.
+   *
+   * The leap size is chosen each step with the criterion of Cao, Gillespie and Petzold (2006), so
+   * that the expected relative change of every propensity over a leap is at most epsilon. Smaller
+   * epsilon is more accurate and slower. Leaps never cross a reporting time.
+   *
+   * @param all_event_types A tuple of sir_event_types, as passed to run_simulation.
+   * @param initial_counts The number of people in each compartment at time 0.
+   * @param event_rates An array with one element for each event type containing the rate at which
+   * each candidate event happens per unit time.
+   * @param epidemic_duration The number of time steps to report.
+   * @param simulation_seed Random seed.
+   * @param epsilon Bound on the relative change of propensities during a leap.
+   * @return A vector of aggregated states, one for each time 0 through epidemic_duration.
+   */
+  template <typename states_t, typename any_event_type,
+            typename random_engine_t = std::default_random_engine>
+  auto run_tau_leaping_simulation(
+      const auto &all_event_types, const compartment_counts<states_t> &initial_counts,
+      const std::array<double, std::variant_size_v<any_event_type>> &event_rates,
+      const epidemic_time_t epidemic_duration = 365, size_t simulation_seed = 2,
+      const double epsilon = 0.03) {
+    constexpr size_t number_of_event_types = std::variant_size_v<any_event_type>;
+    constexpr size_t number_of_compartments = std::size(states_t{});
+
+    random_engine_t random_source{simulation_seed};
+    const event_type_table<states_t, any_event_type> event_types{all_event_types};
+    auto counts = initial_counts;
+
+    const auto count = [](const auto &these_counts, const auto &mask) {
+      size_t rc = 0;
+      for (size_t compartment = 0; compartment < number_of_compartments; ++compartment) {
+        if (mask[compartment]) {
+          rc += these_counts[compartment];
+        }
+      }
+      return (rc);
+    };
+    // Rate per candidate in slot skip_index (all slots when skip_index is out of range)
+    const auto hazard = [&event_types, &event_rates, &count](const auto &these_counts,
+                                                             size_t event_index,
+                                                             size_t skip_index) {
+      const auto &type = event_types[event_index];
+      double rc = event_rates[event_index];
+      for (auto person_index : std::ranges::views::iota(0UL, type.size)) {
+        if (person_index != skip_index) {
+          rc *= static_cast<double>(count(these_counts, type.preconditions[person_index]));
+        }
+      }
+      return (rc);
+    };
+
+    // Slots whose person changes compartment, and the order of each compartment (g_i in Cao et
+    // al.), both fixed for the whole run
+    std::array<std::vector<size_t>, number_of_event_types> moving_slots{};
+    std::array<double, number_of_compartments> highest_order{};
+    for (auto event_index : std::ranges::views::iota(0UL, number_of_event_types)) {
+      const auto &type = event_types[event_index];
+      for (auto person_index : std::ranges::views::iota(0UL, type.size)) {
+        if (type.postconditions[person_index]) {
+          moving_slots[event_index].push_back(person_index);
+        }
+        for (size_t compartment = 0; compartment < number_of_compartments; ++compartment) {
+          if (type.preconditions[person_index][compartment]) {
+            highest_order[compartment]
+                = std::max(highest_order[compartment], static_cast<double>(type.size));
+          }
+        }
+      }
+    }
+
+    const auto select_leap = [&](const std::array<double, number_of_event_types> &propensities) {
+      std::array<double, number_of_compartments> drift{};
+      std::array<double, number_of_compartments> variance{};
+      for (auto event_index : std::ranges::views::iota(0UL, number_of_event_types)) {
+        const auto &type = event_types[event_index];
+        for (auto person_index : moving_slots[event_index]) {
+          const auto &mask = type.preconditions[person_index];
+          const auto available = static_cast<double>(count(counts, mask));
+          for (size_t compartment = 0; compartment < number_of_compartments; ++compartment) {
+            if (mask[compartment] && (available > 0)) {
+              const double change = static_cast<double>(counts[compartment]) / available;
+              drift[compartment] -= propensities[event_index] * change;
+              variance[compartment] += propensities[event_index] * change * change;
+            }
+          }
+          const auto to_compartment
+              = static_cast<size_t>(type.postconditions[person_index].value());
+          drift[to_compartment] += propensities[event_index];
+          variance[to_compartment] += propensities[event_index];
+        }
+      }
+      double rc = std::numeric_limits<double>::infinity();
+      for (size_t compartment = 0; compartment < number_of_compartments; ++compartment) {
+        if (highest_order[compartment] == 0) {
+          continue;
+        }
+        const double bound = std::max(
+            epsilon * static_cast<double>(counts[compartment]) / highest_order[compartment], 1.0);
+        if (drift[compartment] != 0) {
+          rc = std::min(rc, bound / std::abs(drift[compartment]));
+        }
+        if (variance[compartment] != 0) {
+          rc = std::min(rc, bound * bound / variance[compartment]);
+        }
+      }
+      return (rc);
+    };
+
+    // Move number_to_move people out of the compartments in mask, as if drawn at random without
+    // replacement (a multivariate hypergeometric split, drawn one compartment at a time)
+    const auto remove_people = [&counts, &count, &random_source](const auto &mask,
+                                                                 size_t number_to_move) {
+      size_t remaining = count(counts, mask);
+      for (size_t compartment = 0; compartment < number_of_compartments; ++compartment) {
+        if (!mask[compartment] || (number_to_move == 0)) {
+          continue;
+        }
+        const size_t from_this_compartment = probability::hypergeometric_distribution(
+            remaining, counts[compartment], number_to_move)(random_source);
+        remaining -= counts[compartment];
+        counts[compartment] -= from_this_compartment;
+        number_to_move -= from_this_compartment;
+      }
+    };
+
+    const auto leap = [&](double tau) {
+      const auto start_counts = counts;
+      for (auto event_index : std::ranges::views::iota(0UL, number_of_event_types)) {
+        const auto &type = event_types[event_index];
+        if (std::empty(moving_slots[event_index])) {
+          continue;
+        }
+        size_t number_of_events = 0;
+        if (std::size(moving_slots[event_index]) == 1) {
+          const size_t person_index = moving_slots[event_index][0];
+          const double probability
+              = -std::expm1(-hazard(start_counts, event_index, person_index) * tau);
+          std::binomial_distribution<size_t> dist(
+              count(counts, type.preconditions[person_index]), probability);
+          number_of_events = dist(random_source);
+        } else {
+          const double expected_events = hazard(start_counts, event_index, type.size) * tau;
+          if (expected_events > 0) {
+            std::poisson_distribution<size_t> dist(expected_events);
+            number_of_events = dist(random_source);
+          }
+          for (auto person_index : moving_slots[event_index]) {
+            number_of_events
+                = std::min(number_of_events, count(counts, type.preconditions[person_index]));
+          }
+        }
+        for (auto person_index : moving_slots[event_index]) {
+          remove_people(type.preconditions[person_index], number_of_events);
+          counts[static_cast<size_t>(type.postconditions[person_index].value())]
+              += number_of_events;
+        }
+      }
+    };
+
+    const auto aggregate = [&counts](epidemic_time_t time) {
+      potential_state_counts_t<states_t> potential_state_counts{};
+      for (size_t compartment = 0; compartment < number_of_compartments; ++compartment) {
+        potential_state_counts[1UL << compartment] = counts[compartment];
+      }
+      return (aggregated_sir_state<states_t>{potential_state_counts, time});
+    };
+
+    std::vector<aggregated_sir_state<states_t>> results{aggregate(0)};
+    results.reserve(static_cast<size_t>(epidemic_duration + 1));
+
+    double now = 0;
+    for (epidemic_time_t t = 1; t <= epidemic_duration; ++t) {
+      while (now < static_cast<double>(t)) {
+        std::array<double, number_of_event_types> propensities{};
+        for (auto event_index : std::ranges::views::iota(0UL, number_of_event_types)) {
+          propensities[event_index] = hazard(counts, event_index, event_types[event_index].size);
+        }
+        const double tau = std::min(select_leap(propensities), static_cast<double>(t) - now);
+        leap(tau);
+        now = (tau == static_cast<double>(t) - now) ? static_cast<double>(t) : now + tau;
+      }
+      results.push_back(aggregate(t));
+    }
+    return (results);
+  }
+
+  /*!
+   * \brief Run a tau leaping simulation of a single world from a simple sir_state
+   *
+   * Wrapper around the count based version; see there for details.
+   */
+  template <typename states_t, typename any_event_type,
+            typename random_engine_t = std::default_random_engine>
+  auto run_tau_leaping_simulation(
+      const auto &all_event_types, const sir_state<states_t> &initial_conditions,
+      const std::array<double, std::variant_size_v<any_event_type>> &event_rates,
+      const epidemic_time_t epidemic_duration = 365, size_t simulation_seed = 2,
+      const double epsilon = 0.03) {
+    return (run_tau_leaping_simulation<states_t, any_event_type, random_engine_t>(
+        all_event_types, count_compartments(initial_conditions), event_rates, epidemic_duration,
+        simulation_seed, epsilon));
+  }
+  //! @}
+
+}  // namespace cfepi
+
+#endif
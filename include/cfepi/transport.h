@@ -0,0 +1,338 @@
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <span>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#  include <cerrno>
+#  include <cstdio>
+#  include <poll.h>
+#  include <sys/socket.h>
+#  include <sys/types.h>
+#  include <sys/wait.h>
+#  include <unistd.h>
+#endif
+
+#ifndef __TRANSPORT_H_
+#  define __TRANSPORT_H_
+
+namespace cfepi {
+
+  //! \brief A batch of bytes sent to or received from one process
+  using transport_message = std::vector<std::byte>;
+
+  /*!
+   * \brief Moves batches of bytes between the processes of a partitioned run
+   *
+   * exchange is collective: every process calls it with one message for each rank (including its
+   * own), and receives the message each rank addressed to it, indexed by sender. An MPI
+   * implementation is MPI_Alltoallv.
+   */
+  template <typename T>
+  concept partition_transport
+      = requires(T &transport, const T &const_transport, std::vector<transport_message> outgoing) {
+          { const_transport.rank() } -> std::convertible_to<size_t>;
+          { const_transport.size() } -> std::convertible_to<size_t>;
+          {
+            transport.exchange(std::move(outgoing))
+            } -> std::same_as<std::vector<transport_message>>;
+        };
+
+  namespace detail {
+    //! \brief Append the bytes of a trivially copyable value to a message
+    template <typename T>
+      requires std::is_trivially_copyable_v<T>
+    void append_bytes(transport_message &message, const T &value) {
+      const auto *bytes = reinterpret_cast<const std::byte *>(&value);
+      message.insert(std::end(message), bytes, bytes + sizeof(T));
+    }
+
+    //! \brief Read a trivially copyable value from a message, advancing offset past it
+    template <typename T>
+      requires std::is_trivially_copyable_v<T>
+    T read_bytes(std::span<const std::byte> message, size_t &offset) {
+      if (offset + sizeof(T) > std::size(message)) {
+        throw "Read past the end of a transport message";
+      }
+      T rc;
+      std::memcpy(&rc, message.data() + offset, sizeof(T));
+      offset += sizeof(T);
+      return (rc);
+    }
+  }  // namespace detail
+
+  //! \brief Send the same message to every process, and receive every process's message
+  template <partition_transport transport_t>
+  std::vector<transport_message> all_gather(transport_t &transport,
+                                            const transport_message &message) {
+    return (transport.exchange(std::vector<transport_message>(transport.size(), message)));
+  }
+
+  //! \brief True on every process if value is true on every process
+  template <partition_transport transport_t> bool all_of(transport_t &transport, bool value) {
+    transport_message message{};
+    detail::append_bytes(message, static_cast<std::uint8_t>(value));
+    bool rc = true;
+    for (const auto &received : all_gather(transport, message)) {
+      size_t offset = 0;
+      rc = (detail::read_bytes<std::uint8_t>(received, offset) != 0) && rc;
+    }
+    return (rc);
+  }
+
+  /*!
+   * \class single_process_transport
+   * \brief The transport of a run with one process, which only sends messages to itself.
+   */
+  struct single_process_transport {
+    size_t rank() const { return (0UL); }
+    size_t size() const { return (1UL); }
+    std::vector<transport_message> exchange(std::vector<transport_message> outgoing) {
+      if (std::size(outgoing) != 1) {
+        throw "There should be one outgoing message for each process";
+      }
+      return (outgoing);
+    }
+  };
+
+#  if defined(__unix__) || defined(__APPLE__)
+  /*!
+   * \class local_socket_transport
+   * \brief A transport between processes on one machine, over a full mesh of Unix domain sockets.
+   *
+   * Start a run with local_socket_transport::run, which forks the processes and connects them.
+   * Each message is sent as its size followed by its bytes, and exchange multiplexes all sends
+   * and receives with poll, so large batches cannot deadlock on full socket buffers.
+   */
+  class local_socket_transport {
+  private:
+    size_t rank_ = 0;
+    //! \brief The socket connected to each other rank, and -1 for this rank
+    std::vector<int> peers_ = {};
+
+    void close_all() {
+      for (auto &peer : peers_) {
+        if (peer >= 0) {
+          ::close(peer);
+          peer = -1;
+        }
+      }
+    }
+
+  public:
+    local_socket_transport(size_t rank, std::vector<int> peers)
+        : rank_(rank), peers_(std::move(peers)) {}
+    local_socket_transport(const local_socket_transport &) = delete;
+    local_socket_transport &operator=(const local_socket_transport &) = delete;
+    local_socket_transport(local_socket_transport &&other) noexcept
+        : rank_(other.rank_), peers_(std::exchange(other.peers_, {})) {}
+    local_socket_transport &operator=(local_socket_transport &&other) noexcept {
+      close_all();
+      rank_ = other.rank_;
+      peers_ = std::exchange(other.peers_, {});
+      return (*this);
+    }
+    ~local_socket_transport() { close_all(); }
+
+    size_t rank() const { return (rank_); }
+    size_t size() const { return (std::size(peers_)); }
+
+    std::vector<transport_message> exchange(std::vector<transport_message> outgoing) {
+      if (std::size(outgoing) != size()) {
+        throw "There should be one outgoing message for each process";
+      }
+      struct peer_progress {
+        std::uint64_t send_header = 0;
+        size_t sent = 0;
+        std::uint64_t receive_header = 0;
+        size_t received = 0;
+      };
+      constexpr size_t header_size = sizeof(std::uint64_t);
+      std::vector<peer_progress> progress(size());
+      std::vector<transport_message> incoming(size());
+      incoming[rank_] = std::move(outgoing[rank_]);
+      for (auto peer : std::ranges::views::iota(0UL, size())) {
+        progress[peer].send_header = std::size(outgoing[peer]);
+      }
+      const auto sending = [&](size_t peer) {
+        return ((peer != rank_) && (progress[peer].sent < header_size + std::size(outgoing[peer])));
+      };
+      const auto receiving = [&](size_t peer) {
+        return ((peer != rank_)
+                && ((progress[peer].received < header_size)
+                    || (progress[peer].received < header_size + progress[peer].receive_header)));
+      };
+
+      std::vector<pollfd> polled{};
+      std::vector<size_t> polled_peers{};
+      while (true) {
+        polled.clear();
+        polled_peers.clear();
+        for (auto peer : std::ranges::views::iota(0UL, size())) {
+          const short events = static_cast<short>((sending(peer) ? POLLOUT : 0)
+                                                  | (receiving(peer) ? POLLIN : 0));
+          if (events != 0) {
+            polled.push_back(pollfd{peers_[peer], events, 0});
+            polled_peers.push_back(peer);
+          }
+        }
+        if (std::empty(polled)) {
+          break;
+        }
+        if (::poll(polled.data(), static_cast<nfds_t>(std::size(polled)), -1) < 0) {
+          if (errno == EINTR) {
+            continue;
+          }
+          throw "Polling the transport sockets failed";
+        }
+        for (auto index : std::ranges::views::iota(0UL, std::size(polled))) {
+          const size_t peer = polled_peers[index];
+          auto &this_progress = progress[peer];
+          if ((polled[index].revents & POLLOUT) && sending(peer)) {
+            const bool in_header = this_progress.sent < header_size;
+            const auto *data
+                = in_header ? reinterpret_cast<const std::byte *>(&this_progress.send_header)
+                                  + this_progress.sent
+                            : outgoing[peer].data() + (this_progress.sent - header_size);
+            const size_t length = in_header ? header_size - this_progress.sent
+                                            : header_size + std::size(outgoing[peer])
+                                                  - this_progress.sent;
+#    ifdef MSG_NOSIGNAL
+            constexpr int send_flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+#    else
+            constexpr int send_flags = MSG_DONTWAIT;
+#    endif
+            const auto sent = ::send(peers_[peer], data, length, send_flags);
+            if (sent < 0) {
+              if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+                throw "Sending on a transport socket failed";
+              }
+            } else {
+              this_progress.sent += static_cast<size_t>(sent);
+            }
+          }
+          if ((polled[index].revents & (POLLIN | POLLHUP | POLLERR)) && receiving(peer)) {
+            const bool in_header = this_progress.received < header_size;
+            if (!in_header && (std::size(incoming[peer]) != this_progress.receive_header)) {
+              incoming[peer].resize(this_progress.receive_header);
+            }
+            auto *data = in_header ? reinterpret_cast<std::byte *>(&this_progress.receive_header)
+                                         + this_progress.received
+                                   : incoming[peer].data() + (this_progress.received - header_size);
+            const size_t length = in_header ? header_size - this_progress.received
+                                            : header_size + this_progress.receive_header
+                                                  - this_progress.received;
+            const auto received = ::recv(peers_[peer], data, length, MSG_DONTWAIT);
+            if (received == 0) {
+              throw "A partition process closed its connection";
+            }
+            if (received < 0) {
+              if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+                throw "Receiving on a transport socket failed";
+              }
+            } else {
+              this_progress.received += static_cast<size_t>(received);
+            }
+          }
+        }
+      }
+      return (incoming);
+    }
+
+    /*!
+     * \brief Run body in number_of_processes connected processes
+     *
+     * Rank 0 runs in the calling process and the others in forked children, which exit when body
+     * returns. Throws if body throws in any process.
+     */
+    static void run(size_t number_of_processes,
+                    const std::function<void(local_socket_transport &)> &body) {
+      if (number_of_processes == 0) {
+        throw "A partitioned run needs at least one process";
+      }
+      std::vector<std::vector<int>> peers(number_of_processes,
+                                          std::vector<int>(number_of_processes, -1));
+      for (auto first : std::ranges::views::iota(0UL, number_of_processes)) {
+        for (auto second : std::ranges::views::iota(first + 1, number_of_processes)) {
+          int sockets[2];
+          if (::socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0) {
+            throw "Could not create a transport socket";
+          }
+          peers[first][second] = sockets[0];
+          peers[second][first] = sockets[1];
+        }
+      }
+      const auto close_except = [&peers](size_t rank) {
+        for (auto other : std::ranges::views::iota(0UL, std::size(peers))) {
+          if (other != rank) {
+            for (auto socket : peers[other]) {
+              if (socket >= 0) {
+                ::close(socket);
+              }
+            }
+          }
+        }
+      };
+
+      // Flush so buffered output is not written again by every child
+      std::cout.flush();
+      std::fflush(nullptr);
+      std::vector<pid_t> children{};
+      for (auto rank : std::ranges::views::iota(1UL, number_of_processes)) {
+        const pid_t child = ::fork();
+        if (child < 0) {
+          throw "Could not fork a partition process";
+        }
+        if (child == 0) {
+          close_except(rank);
+          int status = 0;
+          try {
+            local_socket_transport transport{rank, peers[rank]};
+            body(transport);
+            std::cout.flush();
+          } catch (...) {
+            status = 1;
+          }
+          ::_exit(status);
+        }
+        children.push_back(child);
+      }
+
+      close_except(0);
+      std::exception_ptr error{};
+      try {
+        local_socket_transport transport{0, peers[0]};
+        body(transport);
+      } catch (...) {
+        error = std::current_exception();
+      }
+      bool children_succeeded = true;
+      for (auto child : children) {
+        int status = 0;
+        while (::waitpid(child, &status, 0) < 0) {
+          if (errno != EINTR) {
+            throw "Could not wait for a partition process";
+          }
+        }
+        children_succeeded = children_succeeded && WIFEXITED(status) && (WEXITSTATUS(status) == 0);
+      }
+      if (error) {
+        std::rethrow_exception(error);
+      }
+      if (!children_succeeded) {
+        throw "A partition process failed";
+      }
+    }
+  };
+#  endif
+
+}  // namespace cfepi
+
+#endif
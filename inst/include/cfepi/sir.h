@@ -11,6 +11,7 @@
 #include <numeric>
 #include <queue>
 #include <span>
+#include <string>
 #include <typeinfo>
 #include <variant>
 #include <vector>
@@ -522,6 +523,83 @@ namespace cfepi {
     return std::make_tuple(names, columns);
   };
 
+  /*!
+   * \brief Exports the results of several replicates of run_simulation as columns
+   *
+   * Each potential state is exported as an integer code into levels() (an R factor) rather than
+   * as a string per row. The constructor counts the rows and finds the potential states in use;
+   * fill then writes every row once, directly into columns allocated with size() rows (e.g.
+   * Rcpp vectors), without building intermediate data frames.
+   */
+  template <typename states_t> class results_export {
+  public:
+    typedef std::vector<std::vector<std::vector<aggregated_sir_state<states_t>>>> replicates_t;
+
+  private:
+    size_t rows_ = 0;
+    //! \brief For each potential state, its 1 based code, or 0 if nobody is ever in it
+    std::vector<int> codes_;
+    std::vector<std::string> levels_{};
+
+  public:
+    results_export(const replicates_t &replicates, const states_t &states)
+        : codes_(detail::int_pow(2, std::size(states_t{})), 0) {
+      for (const auto &replicate : replicates) {
+        for (const auto &step : replicate) {
+          for (const auto &world : step) {
+            for (size_t subset = 0; subset < std::size(codes_); ++subset) {
+              if (world.potential_state_counts[subset] > 0) {
+                ++rows_;
+                codes_[subset] = 1;
+              }
+            }
+          }
+        }
+      }
+      for (size_t subset = 0; subset < std::size(codes_); ++subset) {
+        if (codes_[subset] > 0) {
+          std::string name = "";
+          for (size_t compartment = 0; compartment < std::size(states_t{}); ++compartment) {
+            if ((subset >> compartment) & 1UL) {
+              name += states[compartment];
+            }
+          }
+          levels_.push_back(name);
+          codes_[subset] = static_cast<int>(std::size(levels_));
+        }
+      }
+    }
+
+    //! \brief Number of rows
+    size_t size() const { return (rows_); }
+    //! \brief The name of each code, which concatenates the compartments of the potential state
+    const std::vector<std::string> &levels() const { return (levels_); }
+
+    //! \brief Write the rows into columns with size() elements each, in the order of replicates
+    //! (0 based replicate and world indices, as in concatenate_dataframes)
+    void fill(const replicates_t &replicates, auto &replicate_column, auto &world_column,
+              auto &time_column, auto &compartment_column, auto &count_column) const {
+      size_t row = 0;
+      for (size_t replicate = 0; replicate < std::size(replicates); ++replicate) {
+        for (const auto &step : replicates[replicate]) {
+          for (size_t world = 0; world < std::size(step); ++world) {
+            const auto &counts = step[world].potential_state_counts;
+            for (size_t subset = 0; subset < std::size(codes_); ++subset) {
+              if (counts[subset] > 0) {
+                replicate_column[row] = static_cast<int>(replicate);
+                world_column[row] = static_cast<int>(world);
+                time_column[row] = static_cast<int>(step[world].time);
+                compartment_column[row] = codes_[subset];
+                count_column[row] = static_cast<double>(counts[subset]);
+                ++row;
+              }
+            }
+          }
+        }
+      }
+    }
+  };
+
   template <typename any_event_type,
             typename = std::make_index_sequence<std::variant_size_v<any_event_type>>>
   struct any_event;
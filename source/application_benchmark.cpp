@@ -0,0 +1,129 @@
+#include <cfepi/modeling.h>
+#include <cfepi/sir.h>
+
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <variant>
+#include <vector>
+
+// Compare checking and applying a mix of recovery and infection events to one world with the
+// generic visitors (any_state_check_preconditions, any_event_apply_entered_states and
+// any_event_apply_left_states) and with static_event_application.
+// Usage: application_benchmark [number_of_events] [population_size] [repetitions]
+
+namespace detail {
+  struct sir_epidemic_states {
+  public:
+    enum state { S, I, R, n_compartments };
+    constexpr static auto size() { return (static_cast<size_t>(n_compartments)); }
+  };
+
+  struct sir_recovery_event_type : public cfepi::transition_event_type<sir_epidemic_states> {
+    constexpr sir_recovery_event_type() noexcept
+        : transition_event_type<sir_epidemic_states>(
+            {std::bitset<std::size(sir_epidemic_states{})>{1 << sir_epidemic_states::I}},
+            sir_epidemic_states::R){};
+  };
+
+  struct sir_infection_event_type : public cfepi::interaction_event_type<sir_epidemic_states> {
+    constexpr sir_infection_event_type() noexcept
+        : interaction_event_type<sir_epidemic_states>(
+            {std::bitset<std::size(sir_epidemic_states{})>{1 << sir_epidemic_states::S}},
+            {std::bitset<std::size(sir_epidemic_states{})>{1 << sir_epidemic_states::I}},
+            sir_epidemic_states::I){};
+  };
+
+  typedef std::variant<sir_recovery_event_type, sir_infection_event_type> any_sir_event_type;
+  typedef cfepi::any_event<any_sir_event_type>::type any_sir_event;
+
+  double nanoseconds_per(std::chrono::steady_clock::time_point start, size_t events) {
+    const auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now()
+                                                                  - start);
+    return (elapsed.count() / static_cast<double>(events));
+  }
+
+  size_t count_states(const cfepi::sir_state<sir_epidemic_states> &state) {
+    size_t rc = 0;
+    for (const auto &potential_states : state.potential_states) {
+      rc += potential_states.count();
+    }
+    return (rc);
+  }
+}  // namespace detail
+
+int main(int argc, char **argv) {
+  const size_t number_of_events = argc > 1 ? std::stoul(argv[1]) : 1000000UL;
+  const cfepi::person_t population_size = argc > 2 ? std::stoul(argv[2]) : 1000000UL;
+  const size_t repetitions = argc > 3 ? std::stoul(argv[3]) : 20UL;
+
+  // A world in which a tenth of the population is infected and a tenth recovered
+  std::default_random_engine rng{2};
+  std::uniform_int_distribution<cfepi::person_t> person(0, population_size - 1);
+  cfepi::sir_state<detail::sir_epidemic_states> state{population_size};
+  std::uniform_int_distribution<size_t> compartment(0, 9);
+  for (auto &potential_states : state.potential_states) {
+    const auto this_compartment = compartment(rng);
+    potential_states.set(this_compartment == 0   ? detail::sir_epidemic_states::I
+                         : this_compartment == 1 ? detail::sir_epidemic_states::R
+                                                 : detail::sir_epidemic_states::S);
+  }
+
+  const cfepi::event_type_table<detail::sir_epidemic_states, detail::any_sir_event_type>
+      event_types{cfepi::all_event_types<detail::any_sir_event_type>{}};
+  std::vector<detail::any_sir_event> events(number_of_events);
+  std::bernoulli_distribution recovery(0.5);
+  for (auto &event : events) {
+    event.type_index = recovery(rng) ? 0 : 1;
+    event.affected_people = {person(rng), person(rng)};
+  }
+
+  auto states_entered = state;
+  auto states_remained = state;
+  size_t generic_applied = 0;
+  auto start = std::chrono::steady_clock::now();
+  const cfepi::any_state_check_preconditions<detail::any_sir_event_type,
+                                             detail::sir_epidemic_states>
+      check{state, event_types};
+  for (size_t repetition = 0; repetition < repetitions; ++repetition) {
+    for (const auto &event : events) {
+      if (check(event)) {
+        cfepi::any_event_apply_entered_states{states_entered, event_types}(event);
+        cfepi::any_event_apply_left_states{states_remained, event_types}(event);
+        ++generic_applied;
+      }
+    }
+  }
+  std::cout << "generic visitors: "
+            << detail::nanoseconds_per(start, repetitions * number_of_events) << "ns per event ("
+            << generic_applied / repetitions << " applied, "
+            << detail::count_states(states_entered) + detail::count_states(states_remained)
+            << " states)\n";
+
+  states_entered = state;
+  states_remained = state;
+  size_t static_applied = 0;
+  start = std::chrono::steady_clock::now();
+  for (size_t repetition = 0; repetition < repetitions; ++repetition) {
+    for (const auto &event : events) {
+      const auto apply = [&]<typename event_type_t>() {
+        using application = cfepi::static_event_application<event_type_t>;
+        if (application::check(state, event)) {
+          application::apply(states_entered, states_remained, event);
+          ++static_applied;
+        }
+      };
+      if (event.type_index == 0) {
+        apply.template operator()<detail::sir_recovery_event_type>();
+      } else {
+        apply.template operator()<detail::sir_infection_event_type>();
+      }
+    }
+  }
+  std::cout << "static application: "
+            << detail::nanoseconds_per(start, repetitions * number_of_events) << "ns per event ("
+            << static_applied / repetitions << " applied, "
+            << detail::count_states(states_entered) + detail::count_states(states_remained)
+            << " states)\n";
+}
@@ -0,0 +1,81 @@
+#include <cfepi/modeling.h>
+#include <cfepi/partition.h>
+#include <cfepi/sir.h>
+#include <cfepi/transport.h>
+
+#include <chrono>
+#include <iostream>
+#include <string>
+
+// Time per step of run_partitioned_simulation over local processes, each owning the same number
+// of people. All processes share this machine, so the times are not those of separate nodes.
+// Usage: partition_benchmark [people_per_process] [epidemic_duration] [largest_process_count]
+
+namespace detail {
+  struct sir_epidemic_states {
+  public:
+    enum state { S, I, R, n_compartments };
+    constexpr static auto size() { return (static_cast<size_t>(n_compartments)); }
+  };
+
+  struct sir_recovery_event_type : public cfepi::transition_event_type<sir_epidemic_states> {
+    constexpr sir_recovery_event_type() noexcept
+        : transition_event_type<sir_epidemic_states>(
+            {std::bitset<std::size(sir_epidemic_states{})>{1 << sir_epidemic_states::I}},
+            sir_epidemic_states::R){};
+  };
+
+  struct sir_infection_event_type : public cfepi::interaction_event_type<sir_epidemic_states> {
+    constexpr sir_infection_event_type() noexcept
+        : interaction_event_type<sir_epidemic_states>(
+            {std::bitset<std::size(sir_epidemic_states{})>{1 << sir_epidemic_states::S}},
+            {std::bitset<std::size(sir_epidemic_states{})>{1 << sir_epidemic_states::I}},
+            sir_epidemic_states::I){};
+  };
+
+  typedef std::variant<sir_recovery_event_type, sir_infection_event_type> any_sir_event_type;
+  typedef cfepi::any_event<any_sir_event_type>::type any_sir_event;
+
+  double seconds_for(size_t number_of_processes, cfepi::person_t people_per_process,
+                     cfepi::epidemic_time_t epidemic_duration) {
+    auto always_true_event
+        = [](const auto &param __attribute__((unused)), const auto &state __attribute__((unused)),
+             std::default_random_engine &rng __attribute__((unused))) { return (true); };
+    auto always_true_state
+        = [](const auto &first_param __attribute__((unused)),
+             const auto &second_param __attribute__((unused)),
+             std::default_random_engine &rng __attribute__((unused))) { return (true); };
+    auto do_nothing = [](auto &param __attribute__((unused)),
+                         std::default_random_engine &rng __attribute__((unused))) { return; };
+    const auto population_size = number_of_processes * people_per_process;
+
+    const auto start = std::chrono::steady_clock::now();
+    cfepi::local_socket_transport::run(number_of_processes, [&](auto &transport) {
+      // The same fraction of every partition starts infected
+      const auto local_initial_conditions = cfepi::default_state<sir_epidemic_states>(
+          sir_epidemic_states::S, sir_epidemic_states::I, people_per_process,
+          people_per_process / 10000 + 1);
+      cfepi::run_partitioned_simulation<sir_epidemic_states, any_sir_event_type, any_sir_event>(
+          transport, cfepi::all_event_types<any_sir_event_type>{}, local_initial_conditions,
+          std::array<double, 2>({.1, .2 / static_cast<double>(population_size)}),
+          {std::make_tuple(always_true_event, always_true_state, do_nothing)},
+          epidemic_duration);
+    });
+    return (std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+  }
+}  // namespace detail
+
+int main(int argc, char **argv) {
+  const cfepi::person_t people_per_process = argc > 1 ? std::stoul(argv[1]) : 1000000UL;
+  const cfepi::epidemic_time_t epidemic_duration = argc > 2 ? std::stol(argv[2]) : 20;
+  const size_t largest_process_count = argc > 3 ? std::stoul(argv[3]) : 8UL;
+
+  for (size_t number_of_processes = 1; number_of_processes <= largest_process_count;
+       number_of_processes *= 2) {
+    const double seconds
+        = detail::seconds_for(number_of_processes, people_per_process, epidemic_duration);
+    std::cerr << number_of_processes << " processes, " << people_per_process
+              << " people each: " << seconds / static_cast<double>(epidemic_duration)
+              << "s per step\n";
+  }
+}
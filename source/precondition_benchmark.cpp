@@ -0,0 +1,139 @@
+#include <cfepi/modeling.h>
+#include <cfepi/sir.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <span>
+#include <string>
+#include <vector>
+
+// Compare checking the preconditions of a batch of infection events against several worlds with
+// the per event checks (any_state_check_preconditions and static_event_application) and with a
+// precondition_batch built once and checked against every world. The events are sampled from the
+// susceptible and infected people in the order sample_event_type produces them.
+// Usage: precondition_benchmark [number_of_events] [population_size] [number_of_worlds]
+
+namespace detail {
+  struct sir_epidemic_states {
+  public:
+    enum state { S, I, R, n_compartments };
+    constexpr static auto size() { return (static_cast<size_t>(n_compartments)); }
+  };
+
+  struct sir_recovery_event_type : public cfepi::transition_event_type<sir_epidemic_states> {
+    constexpr sir_recovery_event_type() noexcept
+        : transition_event_type<sir_epidemic_states>(
+            {std::bitset<std::size(sir_epidemic_states{})>{1 << sir_epidemic_states::I}},
+            sir_epidemic_states::R){};
+  };
+
+  struct sir_infection_event_type : public cfepi::interaction_event_type<sir_epidemic_states> {
+    constexpr sir_infection_event_type() noexcept
+        : interaction_event_type<sir_epidemic_states>(
+            {std::bitset<std::size(sir_epidemic_states{})>{1 << sir_epidemic_states::S}},
+            {std::bitset<std::size(sir_epidemic_states{})>{1 << sir_epidemic_states::I}},
+            sir_epidemic_states::I){};
+  };
+
+  typedef std::variant<sir_recovery_event_type, sir_infection_event_type> any_sir_event_type;
+  typedef cfepi::any_event<any_sir_event_type>::type any_sir_event;
+
+  double nanoseconds_per(std::chrono::steady_clock::time_point start, size_t checks) {
+    const auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now()
+                                                                  - start);
+    return (elapsed.count() / static_cast<double>(checks));
+  }
+}  // namespace detail
+
+int main(int argc, char **argv) {
+  const size_t number_of_events = argc > 1 ? std::stoul(argv[1]) : 1000000UL;
+  const cfepi::person_t population_size = argc > 2 ? std::stoul(argv[2]) : 1000000UL;
+  const size_t number_of_worlds = argc > 3 ? std::stoul(argv[3]) : 8UL;
+
+  // Worlds in which a tenth of the population is infected and a tenth recovered, differing in
+  // who is infected
+  std::default_random_engine rng{2};
+  std::uniform_int_distribution<size_t> compartment(0, 9);
+  std::vector<cfepi::sir_state<detail::sir_epidemic_states>> worlds{};
+  for (size_t world = 0; world < number_of_worlds; ++world) {
+    worlds.emplace_back(population_size);
+    for (auto &potential_states : worlds.back().potential_states) {
+      const auto this_compartment = compartment(rng);
+      potential_states.set(this_compartment == 0   ? detail::sir_epidemic_states::I
+                           : this_compartment == 1 ? detail::sir_epidemic_states::R
+                                                   : detail::sir_epidemic_states::S);
+    }
+  }
+
+  // Infection events over the people susceptible or infected in the first world, in increasing
+  // order of their position in the cartesian product as the sampler produces them
+  std::vector<cfepi::person_t> susceptible{};
+  std::vector<cfepi::person_t> infected{};
+  for (cfepi::person_t person = 0; person < population_size; ++person) {
+    if (worlds[0].potential_states[person].test(detail::sir_epidemic_states::S)) {
+      susceptible.push_back(person);
+    } else if (worlds[0].potential_states[person].test(detail::sir_epidemic_states::I)) {
+      infected.push_back(person);
+    }
+  }
+  std::uniform_int_distribution<size_t> position(
+      0, std::size(susceptible) * std::size(infected) - 1);
+  std::vector<size_t> positions(number_of_events);
+  for (auto &this_position : positions) {
+    this_position = position(rng);
+  }
+  std::ranges::sort(positions);
+  std::vector<detail::any_sir_event> events(number_of_events);
+  for (size_t index = 0; index < number_of_events; ++index) {
+    events[index].type_index = 1;
+    events[index].affected_people = {susceptible[positions[index] / std::size(infected)],
+                                     infected[positions[index] % std::size(infected)]};
+  }
+
+  const cfepi::event_type_table<detail::sir_epidemic_states, detail::any_sir_event_type>
+      event_types{cfepi::all_event_types<detail::any_sir_event_type>{}};
+  const size_t checks = number_of_worlds * number_of_events;
+
+  size_t scalar_valid = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (const auto &state : worlds) {
+    const cfepi::any_state_check_preconditions<detail::any_sir_event_type,
+                                               detail::sir_epidemic_states>
+        check{state, event_types};
+    for (const auto &event : events) {
+      scalar_valid += check(event) ? 1 : 0;
+    }
+  }
+  std::cout << "per event check: " << detail::nanoseconds_per(start, checks)
+            << "ns per event and world (" << scalar_valid << " valid)\n";
+
+  size_t static_valid = 0;
+  start = std::chrono::steady_clock::now();
+  for (const auto &state : worlds) {
+    for (const auto &event : events) {
+      static_valid
+          += cfepi::static_event_application<detail::sir_infection_event_type>::check(state, event)
+                 ? 1
+                 : 0;
+    }
+  }
+  std::cout << "static check: " << detail::nanoseconds_per(start, checks)
+            << "ns per event and world (" << static_valid << " valid)\n";
+
+  size_t batch_valid = 0;
+  std::vector<std::uint8_t> valid{};
+  start = std::chrono::steady_clock::now();
+  const cfepi::precondition_batch batch{event_types[1],
+                                        std::span<const detail::any_sir_event>(events)};
+  for (const auto &state : worlds) {
+    batch.check(state, valid);
+    for (auto this_valid : valid) {
+      batch_valid += this_valid;
+    }
+  }
+  std::cout << "batch check: " << detail::nanoseconds_per(start, checks)
+            << "ns per event and world, including building the batch (" << batch_valid
+            << " valid)\n";
+}
@@ -0,0 +1,95 @@
+#include <cfepi/random.h>
+#include <cfepi/sample_view.h>
+
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+// Compare the per draw cost of random number engines in the two places the simulation spends its
+// random numbers: skipping through candidate events in sample_view, and the per event filter
+// loop (one uniform per sampled event, as in a flat reduction filter). Each engine is timed with
+// one call per draw and, where it applies, with the bulk fill_uniform / fill_geometric API.
+// Usage: random_benchmark [number_of_candidates] [probability]
+
+namespace detail {
+  double nanoseconds_per(std::chrono::steady_clock::time_point start, size_t draws) {
+    const auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now()
+                                                                  - start);
+    return (elapsed.count() / static_cast<double>(draws == 0 ? 1 : draws));
+  }
+
+  template <typename Gen>
+  void benchmark(const std::string &name, size_t number_of_candidates, double probability) {
+    constexpr size_t buffer_size = 4096;
+    Gen gen{2};
+
+    // sample_view over the candidate events
+    auto start = std::chrono::steady_clock::now();
+    size_t sampled = 0;
+    size_t checksum = 0;
+    for (auto x : std::ranges::views::iota(0UL, number_of_candidates)
+                      | probability::views::sample(probability, gen)) {
+      ++sampled;
+      checksum += x;
+    }
+    std::cout << name << " sample_view: " << nanoseconds_per(start, sampled) << "ns per draw ("
+              << sampled << " sampled)\n";
+
+    // The same skips, drawn in bulk
+    start = std::chrono::steady_clock::now();
+    std::vector<size_t> skips(buffer_size);
+    size_t bulk_sampled = 0;
+    for (size_t position = 0; position < number_of_candidates;) {
+      probability::fill_geometric(gen, skips, probability);
+      for (auto skip : skips) {
+        position += skip;
+        if (position >= number_of_candidates) {
+          break;
+        }
+        ++bulk_sampled;
+        checksum += position;
+        ++position;
+      }
+    }
+    std::cout << name << " bulk geometric skips: " << nanoseconds_per(start, bulk_sampled)
+              << "ns per draw (" << bulk_sampled << " sampled)\n";
+
+    // Filter loop, one uniform per event
+    const size_t number_of_events = number_of_candidates / 10;
+    start = std::chrono::steady_clock::now();
+    size_t kept = 0;
+    std::uniform_real_distribution<double> dist(0, 1);
+    for (size_t event = 0; event < number_of_events; ++event) {
+      kept += (dist(gen) < 0.5) ? 1 : 0;
+    }
+    std::cout << name << " filter loop: " << nanoseconds_per(start, number_of_events)
+              << "ns per draw (" << kept << " kept)\n";
+
+    start = std::chrono::steady_clock::now();
+    std::vector<double> uniforms(buffer_size);
+    kept = 0;
+    // Whole buffers are drawn, so this can draw up to buffer_size - 1 more than number_of_events
+    size_t drawn = 0;
+    for (; drawn < number_of_events; drawn += buffer_size) {
+      probability::fill_uniform(gen, uniforms);
+      for (auto u : uniforms) {
+        kept += (u < 0.5) ? 1 : 0;
+      }
+    }
+    std::cout << name << " bulk filter loop: " << nanoseconds_per(start, drawn)
+              << "ns per draw (" << kept << " kept, checksum " << checksum % 10 << ")\n";
+  }
+}  // namespace detail
+
+int main(int argc, char **argv) {
+  const size_t number_of_candidates = argc > 1 ? std::stoul(argv[1]) : 1000000000UL;
+  const double probability = argc > 2 ? std::stod(argv[2]) : 0.01;
+
+  detail::benchmark<std::default_random_engine>("default_random_engine", number_of_candidates,
+                                                probability);
+  detail::benchmark<std::mt19937_64>("mt19937_64", number_of_candidates, probability);
+  detail::benchmark<probability::xoshiro256starstar>("xoshiro256starstar", number_of_candidates,
+                                                     probability);
+}
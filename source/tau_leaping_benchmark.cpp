@@ -0,0 +1,131 @@
+#include <cfepi/modeling.h>
+#include <cfepi/sample_view.h>
+#include <cfepi/sir.h>
+#include <cfepi/tau_leaping.h>
+
+#include <chrono>
+#include <iostream>
+#include <string>
+
+// Compare the per person engine (run_simulation with a single world) against tau leaping for SIR
+// and SEIR models at several population sizes.
+// Usage: tau_leaping_benchmark [epidemic_duration] [largest_population]
+
+namespace detail {
+  struct sir_epidemic_states {
+  public:
+    enum state { S, I, R, n_compartments };
+    constexpr static auto size() { return (static_cast<size_t>(n_compartments)); }
+  };
+
+  struct sir_recovery_event_type : public cfepi::transition_event_type<sir_epidemic_states> {
+    constexpr sir_recovery_event_type() noexcept
+        : transition_event_type<sir_epidemic_states>(
+            {std::bitset<std::size(sir_epidemic_states{})>{1 << sir_epidemic_states::I}},
+            sir_epidemic_states::R){};
+  };
+
+  struct sir_infection_event_type : public cfepi::interaction_event_type<sir_epidemic_states> {
+    constexpr sir_infection_event_type() noexcept
+        : interaction_event_type<sir_epidemic_states>(
+            {std::bitset<std::size(sir_epidemic_states{})>{1 << sir_epidemic_states::S}},
+            {std::bitset<std::size(sir_epidemic_states{})>{1 << sir_epidemic_states::I}},
+            sir_epidemic_states::I){};
+  };
+
+  typedef std::variant<sir_recovery_event_type, sir_infection_event_type> any_sir_event_type;
+  typedef cfepi::any_event<any_sir_event_type>::type any_sir_event;
+
+  struct seir_epidemic_states {
+  public:
+    enum state { S, E, I, R, n_compartments };
+    constexpr static auto size() { return (static_cast<size_t>(n_compartments)); }
+  };
+
+  struct seir_exposure_event_type : public cfepi::interaction_event_type<seir_epidemic_states> {
+    constexpr seir_exposure_event_type() noexcept
+        : interaction_event_type<seir_epidemic_states>(
+            {std::bitset<std::size(seir_epidemic_states{})>{1 << seir_epidemic_states::S}},
+            {std::bitset<std::size(seir_epidemic_states{})>{1 << seir_epidemic_states::I}},
+            seir_epidemic_states::E){};
+  };
+
+  struct seir_recovery_event_type : public cfepi::transition_event_type<seir_epidemic_states> {
+    constexpr seir_recovery_event_type() noexcept
+        : transition_event_type<seir_epidemic_states>(
+            {std::bitset<std::size(seir_epidemic_states{})>{1 << seir_epidemic_states::I}},
+            seir_epidemic_states::R){};
+  };
+
+  struct seir_infection_event_type : public cfepi::transition_event_type<seir_epidemic_states> {
+    constexpr seir_infection_event_type() noexcept
+        : transition_event_type<seir_epidemic_states>(
+            {std::bitset<std::size(seir_epidemic_states{})>{1 << seir_epidemic_states::E}},
+            seir_epidemic_states::I){};
+  };
+
+  typedef std::variant<seir_recovery_event_type, seir_infection_event_type,
+                       seir_exposure_event_type>
+      any_seir_event_type;
+  typedef cfepi::any_event<any_seir_event_type>::type any_seir_event;
+
+  template <typename states_t, typename any_event_type, typename any_event>
+  void benchmark(const std::string &name,
+                 const std::array<double, std::variant_size_v<any_event_type>> &rates,
+                 cfepi::person_t population_size, cfepi::epidemic_time_t epidemic_duration) {
+    auto initial_conditions = cfepi::default_state<states_t>(
+        states_t::S, states_t::I, population_size, population_size / 100000 + 1);
+    auto always_true_event
+        = [](const auto &param __attribute__((unused)), const auto &state __attribute__((unused)),
+             std::default_random_engine &rng __attribute__((unused))) { return (true); };
+    auto always_true_state
+        = [](const auto &first_param __attribute__((unused)),
+             const auto &second_param __attribute__((unused)),
+             std::default_random_engine &rng __attribute__((unused))) { return (true); };
+    auto do_nothing = [](auto &param __attribute__((unused)),
+                         std::default_random_engine &rng __attribute__((unused))) { return; };
+
+    auto start = std::chrono::steady_clock::now();
+    const auto per_person_results = cfepi::run_simulation<states_t, any_event_type, any_event>(
+        cfepi::all_event_types<any_event_type>{}, initial_conditions, rates,
+        {std::make_tuple(always_true_event, always_true_state, do_nothing)}, epidemic_duration);
+    auto per_person_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start);
+
+    std::cout << name << " population " << population_size << " per person engine: "
+              << per_person_time.count() << "s\n";
+    for (double epsilon : {0.01, 0.03, 0.1}) {
+      start = std::chrono::steady_clock::now();
+      const auto tau_leaping_results
+          = cfepi::run_tau_leaping_simulation<states_t, any_event_type>(
+              cfepi::all_event_types<any_event_type>{}, initial_conditions, rates,
+              epidemic_duration, 2, epsilon);
+      auto tau_leaping_time
+          = std::chrono::duration<double>(std::chrono::steady_clock::now() - start);
+      std::cout << name << " population " << population_size << " tau leaping (epsilon "
+                << epsilon << "): " << tau_leaping_time.count() << "s, final recovered "
+                << tau_leaping_results.back().potential_state_counts[1 << states_t::R]
+                << " vs "
+                << per_person_results.back()[0].potential_state_counts[1 << states_t::R]
+                << "\n";
+    }
+  }
+}  // namespace detail
+
+int main(int argc, char **argv) {
+  const cfepi::epidemic_time_t epidemic_duration = argc > 1 ? std::stoll(argv[1]) : 100;
+  const cfepi::person_t largest_population = argc > 2 ? std::stoul(argv[2]) : 30000000UL;
+
+  for (cfepi::person_t population_size : {1000000UL, 3000000UL, 10000000UL, 30000000UL}) {
+    if (population_size > largest_population) {
+      break;
+    }
+    const double population = static_cast<double>(population_size);
+    detail::benchmark<detail::sir_epidemic_states, detail::any_sir_event_type,
+                      detail::any_sir_event>("SIR", {1. / 4.5, 1.75 / 4.5 / population},
+                                             population_size, epidemic_duration);
+    detail::benchmark<detail::seir_epidemic_states, detail::any_seir_event_type,
+                      detail::any_seir_event>("SEIR",
+                                              {1. / 4.5, 1. / 5.2, 1.75 / 4.5 / population},
+                                              population_size, epidemic_duration);
+  }
+}
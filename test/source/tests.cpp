@@ -1,8 +1,19 @@
 #include <cfepi/config.h>
+#include <cfepi/gillespie.h>
+#include <cfepi/hybrid.h>
+#include <cfepi/metapopulation.h>
 #include <cfepi/modeling.h>
+#include <cfepi/network.h>
+#include <cfepi/output.h>
+#include <cfepi/partition.h>
+#include <cfepi/random.h>
 #include <cfepi/sir.h>
+#include <cfepi/strata.h>
+#include <cfepi/tau_leaping.h>
 #include <doctest/doctest.h>
 
+#include <atomic>
+#include <filesystem>
 #include <iostream>
 
 // TEST OF SIR
@@ -54,6 +65,342 @@ namespace detail {
          std::make_tuple(always_true_event, always_true_state, do_nothing)});
   }
 
+  TEST_CASE("[sir_event] Compact events look up their event type in a shared table") {
+    static_assert(std::same_as<any_sir_event, cfepi::compact_sir_event<2>>);
+    const cfepi::event_type_table<sir_epidemic_states, any_sir_event_type> event_types{
+        cfepi::all_event_types<any_sir_event_type>{}};
+    CHECK(event_types[0].size == 1UL);
+    CHECK(event_types[1].size == 2UL);
+
+    const cfepi::person_t population_size = 5;
+    auto current_state = cfepi::default_state<sir_epidemic_states>(
+        sir_epidemic_states::S, sir_epidemic_states::I, population_size, 1UL);
+    auto event_range_generator = cfepi::single_type_event_generator<sir_infection_event_type>(
+        sir_infection_event_type{}, current_state, 1UL);
+
+    size_t counter = 0;
+    for (auto event : event_range_generator.event_range<any_sir_event>()) {
+      ++counter;
+      CHECK(event.index() == 1UL);
+      CHECK(event.affected_people[0] == counter);
+      CHECK(event.affected_people[1] == 0UL);
+      CHECK(cfepi::any_state_check_preconditions<any_sir_event_type, sir_epidemic_states>{
+          current_state, event_types}(event));
+    }
+    CHECK(counter == population_size - 1);
+
+    auto states_entered = current_state;
+    auto states_remained = current_state;
+    states_entered.reset();
+    const any_sir_event infection{3, {2UL, 0UL}, 1UL};
+    cfepi::any_event_apply_entered_states{states_entered, event_types}(infection);
+    cfepi::any_event_apply_left_states{states_remained, event_types}(infection);
+    auto next_state = states_entered || states_remained;
+    CHECK(next_state.potential_states[2][sir_epidemic_states::I]);
+    CHECK(!next_state.potential_states[2][sir_epidemic_states::S]);
+    CHECK(next_state.potential_states[0][sir_epidemic_states::I]);
+  }
+
+  TEST_CASE("[sir_event] Weighted sampling keeps each candidate with its own probability") {
+    const cfepi::person_t population_size = 40000;
+    auto current_state = cfepi::default_state<sir_epidemic_states>(
+        sir_epidemic_states::S, sir_epidemic_states::I, population_size, population_size);
+    auto event_range_generator = cfepi::single_type_event_generator<sir_recovery_event_type>(
+        sir_recovery_event_type{}, current_state, 0UL);
+
+    // A quarter each with weights 1, 0.25, 0.001 and 0
+    cfepi::event_weights<1> weights{};
+    weights.person_weights[0].resize(population_size);
+    for (auto person : std::ranges::views::iota(0UL, population_size)) {
+      weights.person_weights[0][person] = std::array<double, 4>{1, 0.25, 0.001, 0}[person % 4];
+    }
+    probability::xoshiro256starstar gen{2};
+    const auto sampled
+        = event_range_generator.weighted_event_sample<any_sir_event>(weights, 0.2, gen);
+    std::array<size_t, 4> counts{};
+    for (const auto &event : sampled) {
+      CHECK(event.index() == 0UL);
+      ++counts[event.affected_people[0] % 4];
+    }
+    CHECK(counts[0] > 1800UL);
+    CHECK(counts[0] < 2200UL);
+    CHECK(counts[1] > 400UL);
+    CHECK(counts[1] < 600UL);
+    CHECK(counts[2] < 10UL);
+    CHECK(counts[3] == 0UL);
+  }
+
+  TEST_CASE("[sir_event] Weighted sampling supports pair weights") {
+    const cfepi::person_t population_size = 400;
+    auto current_state = cfepi::default_state<sir_epidemic_states>(
+        sir_epidemic_states::S, sir_epidemic_states::I, population_size, population_size / 2);
+    auto event_range_generator = cfepi::single_type_event_generator<sir_infection_event_type>(
+        sir_infection_event_type{}, current_state, 1UL);
+
+    cfepi::event_weights<2> weights{};
+    weights.pair_weight = [](const std::array<cfepi::person_t, 2> &people) {
+      return (((people[0] + people[1]) % 2 == 1) ? 2.0 : 0.0);
+    };
+    weights.max_pair_weight = 2.0;
+    probability::xoshiro256starstar gen{2};
+    const auto sampled
+        = event_range_generator.weighted_event_sample<any_sir_event>(weights, 0.05, gen);
+    for (const auto &event : sampled) {
+      CHECK((event.affected_people[0] + event.affected_people[1]) % 2 == 1UL);
+    }
+    // 200 * 200 / 2 candidates with probability 0.1
+    CHECK(std::size(sampled) > 1800UL);
+    CHECK(std::size(sampled) < 2200UL);
+  }
+
+  TEST_CASE("[sir_generator] SIR model works with a weighted event type") {
+    typedef std::variant<cfepi::weighted_event_type<sir_recovery_event_type>,
+                         sir_infection_event_type>
+        any_weighted_sir_event_type;
+    typedef cfepi::any_event<any_weighted_sir_event_type>::type any_weighted_sir_event;
+    cfepi::person_t population_size = 1000;
+    auto initial_conditions = cfepi::default_state<sir_epidemic_states>(
+        sir_epidemic_states::S, sir_epidemic_states::I, population_size, 10UL);
+    auto always_true_event
+        = [](const auto &param __attribute__((unused)), const auto &state __attribute__((unused)),
+             std::default_random_engine &rng __attribute__((unused))) { return (true); };
+    auto always_true_state
+        = [](const auto &first_param __attribute__((unused)),
+             const auto &second_param __attribute__((unused)),
+             std::default_random_engine &rng __attribute__((unused))) { return (true); };
+    auto do_nothing = [](auto &param __attribute__((unused)),
+                         std::default_random_engine &rng __attribute__((unused))) { return; };
+
+    // Only the even numbered people can recover
+    auto event_types = cfepi::all_event_types<any_weighted_sir_event_type>{};
+    auto &recovery_weights = std::get<0>(event_types).weights.person_weights[0];
+    recovery_weights.resize(population_size);
+    for (auto person : std::ranges::views::iota(0UL, population_size)) {
+      recovery_weights[person] = (person % 2 == 0) ? 1.0 : 0.0;
+    }
+    auto test_results = cfepi::run_simulation<sir_epidemic_states, any_weighted_sir_event_type,
+                                              any_weighted_sir_event>(
+        event_types, initial_conditions,
+        std::array<double, 2>({.5, 2. / static_cast<double>(population_size)}),
+        {std::make_tuple(always_true_event, always_true_state, do_nothing)}, 30);
+    const auto &counts = test_results.back()[0].potential_state_counts;
+    CHECK(counts[1 << sir_epidemic_states::R] > 0UL);
+    CHECK(counts[1 << sir_epidemic_states::R] <= population_size / 2);
+    CHECK(counts[1 << sir_epidemic_states::I] >= 5UL);
+  }
+
+  TEST_CASE("[network] Contact network round trips through a memory mapped file") {
+    const auto network = cfepi::contact_network::from_edges(5, {{0, 1}, {1, 2}, {3, 1}});
+    CHECK(network.size() == 5UL);
+    CHECK(network.number_of_edges() == 6UL);
+    CHECK(std::ranges::equal(network.neighbours(1), std::vector<std::uint32_t>{0, 2, 3}));
+    CHECK(std::empty(network.neighbours(4)));
+
+    const auto path
+        = (std::filesystem::temp_directory_path() / "cfepi_contact_network.bin").string();
+    network.write(path);
+    const auto mapped = cfepi::contact_network::map_file(path);
+    std::filesystem::remove(path);
+    CHECK(std::ranges::equal(mapped.offsets(), network.offsets()));
+    for (auto person : std::ranges::views::iota(0UL, network.size())) {
+      CHECK(std::ranges::equal(mapped.neighbours(person), network.neighbours(person)));
+    }
+  }
+
+  TEST_CASE("[output] Results written as steps complete read back as columns") {
+    cfepi::person_t population_size = 1000;
+    auto initial_conditions = cfepi::default_state<sir_epidemic_states>(
+        sir_epidemic_states::S, sir_epidemic_states::I, population_size, 10UL);
+    auto always_true_event
+        = [](const auto &param __attribute__((unused)), const auto &state __attribute__((unused)),
+             std::default_random_engine &rng __attribute__((unused))) { return (true); };
+    auto always_true_state
+        = [](const auto &first_param __attribute__((unused)),
+             const auto &second_param __attribute__((unused)),
+             std::default_random_engine &rng __attribute__((unused))) { return (true); };
+    auto do_nothing = [](auto &param __attribute__((unused)),
+                         std::default_random_engine &rng __attribute__((unused))) { return; };
+
+    const auto path = (std::filesystem::temp_directory_path() / "cfepi_results.bin").string();
+    std::vector<std::vector<cfepi::aggregated_sir_state<sir_epidemic_states>>> results{};
+    {
+      cfepi::results_writer<sir_epidemic_states> writer{path};
+      results = cfepi::run_simulation<sir_epidemic_states, any_sir_event_type, any_sir_event>(
+          cfepi::all_event_types<any_sir_event_type>{}, initial_conditions,
+          std::array<double, 2>({.1, 2. / static_cast<double>(population_size)}),
+          {std::make_tuple(always_true_event, always_true_state, do_nothing),
+           std::make_tuple(always_true_event, always_true_state, do_nothing)},
+          10, 2, 1, false, [&writer](const auto &step) { writer.write_step(3, step); });
+    }
+    const cfepi::results_reader reader{path};
+    std::filesystem::remove(path);
+    CHECK(reader.number_of_compartments() == 3UL);
+    REQUIRE(std::size(reader.blocks()) == std::size(results));
+    for (auto step : std::ranges::views::iota(0UL, std::size(results))) {
+      const auto &block = reader.blocks()[step];
+      std::vector<cfepi::aggregated_sir_state<sir_epidemic_states>> read(std::size(results[step]));
+      for (auto row : std::ranges::views::iota(0UL, block.size())) {
+        CHECK(block.replicate[row] == 3U);
+        CHECK(block.time[row] == results[step][block.world[row]].time);
+        read[block.world[row]].potential_state_counts[block.mask[row]] = block.count[row];
+      }
+      for (auto world : std::ranges::views::iota(0UL, std::size(results[step]))) {
+        CHECK(read[world] == results[step][world]);
+      }
+    }
+
+    // A block cut short by a crash while writing is reported rather than read
+    {
+      cfepi::results_writer<sir_epidemic_states> writer{path};
+      writer.write_results(0, results);
+    }
+    std::filesystem::resize_file(path, std::filesystem::file_size(path) - 4);
+    CHECK_THROWS(cfepi::results_reader{path});
+    std::filesystem::remove(path);
+  }
+
+  TEST_CASE("[sir_generator] SIR model on a contact network only infects along edges") {
+    typedef std::variant<sir_recovery_event_type,
+                         cfepi::network_event_type<sir_infection_event_type>>
+        any_network_sir_event_type;
+    typedef cfepi::any_event<any_network_sir_event_type>::type any_network_sir_event;
+    cfepi::person_t population_size = 1000;
+    auto initial_conditions = cfepi::default_state<sir_epidemic_states>(
+        sir_epidemic_states::S, sir_epidemic_states::I, population_size, 1UL);
+    auto always_true_event
+        = [](const auto &param __attribute__((unused)), const auto &state __attribute__((unused)),
+             std::default_random_engine &rng __attribute__((unused))) { return (true); };
+    auto always_true_state
+        = [](const auto &first_param __attribute__((unused)),
+             const auto &second_param __attribute__((unused)),
+             std::default_random_engine &rng __attribute__((unused))) { return (true); };
+    auto do_nothing = [](auto &param __attribute__((unused)),
+                         std::default_random_engine &rng __attribute__((unused))) { return; };
+
+    // A line, so certain infection moves exactly one person further each step
+    std::vector<std::pair<cfepi::person_t, cfepi::person_t>> edges{};
+    for (auto person : std::ranges::views::iota(1UL, population_size)) {
+      edges.emplace_back(person - 1, person);
+    }
+    auto event_types = cfepi::all_event_types<any_network_sir_event_type>{};
+    std::get<1>(event_types).network = std::make_shared<const cfepi::contact_network>(
+        cfepi::contact_network::from_edges(population_size, edges));
+    auto test_results = cfepi::run_simulation<sir_epidemic_states, any_network_sir_event_type,
+                                              any_network_sir_event>(
+        event_types, initial_conditions, std::array<double, 2>({0., 1.}),
+        {std::make_tuple(always_true_event, always_true_state, do_nothing)}, 10);
+    // The first two entries are the initial conditions, then one for each step
+    for (auto step : std::ranges::views::iota(0UL, 10UL)) {
+      CHECK(test_results[step + 2][0].potential_state_counts[1 << sir_epidemic_states::I]
+            == step + 2);
+    }
+  }
+
+  TEST_CASE("[sir_generator] SIR model with strata only mixes along the contact matrix") {
+    typedef std::variant<sir_recovery_event_type,
+                         cfepi::stratified_event_type<sir_infection_event_type>>
+        any_stratified_sir_event_type;
+    typedef cfepi::any_event<any_stratified_sir_event_type>::type any_stratified_sir_event;
+    cfepi::person_t population_size = 1000;
+    auto initial_conditions = cfepi::default_state<sir_epidemic_states>(
+        sir_epidemic_states::S, sir_epidemic_states::I, population_size, 10UL);
+    auto always_true_event
+        = [](const auto &param __attribute__((unused)), const auto &state __attribute__((unused)),
+             std::default_random_engine &rng __attribute__((unused))) { return (true); };
+    auto always_true_state
+        = [](const auto &first_param __attribute__((unused)),
+             const auto &second_param __attribute__((unused)),
+             std::default_random_engine &rng __attribute__((unused))) { return (true); };
+    auto do_nothing = [](auto &param __attribute__((unused)),
+                         std::default_random_engine &rng __attribute__((unused))) { return; };
+
+    // Three strata of people by person % 3; the initially infected are in every stratum, but
+    // stratum 1 can only be infected by stratum 0 and stratum 2 has no contacts at all
+    auto mixing = std::make_shared<cfepi::contact_matrix>();
+    mixing->number_of_strata = 3;
+    mixing->rates = {1., 0., 0., 1., 0., 0., 0., 0., 0.};
+    mixing->stratum.resize(population_size);
+    for (auto person : std::ranges::views::iota(0UL, population_size)) {
+      mixing->stratum[person] = person % 3;
+    }
+    auto event_types = cfepi::all_event_types<any_stratified_sir_event_type>{};
+    std::get<1>(event_types).mixing = mixing;
+    auto test_results = cfepi::run_simulation<sir_epidemic_states, any_stratified_sir_event_type,
+                                              any_stratified_sir_event>(
+        event_types, initial_conditions,
+        std::array<double, 2>({0., 2. / static_cast<double>(population_size)}),
+        {std::make_tuple(always_true_event, always_true_state, do_nothing)}, 30);
+
+    const auto &final_counts = test_results.back()[0].potential_state_counts;
+    CHECK(final_counts[1 << sir_epidemic_states::I] > 10UL);
+    CHECK(final_counts[1 << sir_epidemic_states::S] + final_counts[1 << sir_epidemic_states::I]
+          == population_size);
+
+
+    // At probability one every candidate event in a block with a positive rate is sampled
+    std::vector<size_t> susceptible{};
+    std::vector<size_t> infected{};
+    for (auto person : std::ranges::views::iota(0UL, population_size)) {
+      (person < 10 ? infected : susceptible).push_back(person);
+    }
+    std::default_random_engine rng{2};
+    const auto events = std::get<1>(event_types).sample_events<any_stratified_sir_event>(
+        initial_conditions, susceptible, infected, 1UL, 1.0, rng);
+    CHECK(std::size(events) == 2 * 330 * 4UL);
+    CHECK(std::ranges::all_of(events, [](const auto &event) {
+      return ((event.affected_people[1] % 3 == 0) && (event.affected_people[0] % 3 != 2));
+    }));
+
+    const auto initial_by_stratum = cfepi::aggregate_by_stratum(initial_conditions, *mixing);
+    CHECK(std::size(initial_by_stratum) == 3UL);
+    CHECK(initial_by_stratum[2].potential_state_counts[1 << sir_epidemic_states::I] == 3UL);
+    CHECK(initial_by_stratum[2].potential_state_counts[1 << sir_epidemic_states::S] == 330UL);
+
+    // A person in a stratum that does not exist is caught before the run starts
+    mixing->stratum[5] = 3;
+    CHECK_THROWS((cfepi::run_simulation<sir_epidemic_states, any_stratified_sir_event_type,
+                                        any_stratified_sir_event>(
+        event_types, initial_conditions, std::array<double, 2>({0., 0.}),
+        {std::make_tuple(always_true_event, always_true_state, do_nothing)}, 1)));
+  }
+
+  TEST_CASE("[sir_generator] SIR model works with a time varying schedule") {
+    const auto schedule = cfepi::piecewise_constant_schedule<2>(
+        {{0, {.1, .01}}, {5, {.1, 0.}}, {10, {.2, 0.}}});
+    CHECK(schedule(-1)[1] == .01);
+    CHECK(schedule(4)[1] == .01);
+    CHECK(schedule(5)[1] == 0.);
+    CHECK(schedule(100)[0] == .2);
+
+    cfepi::person_t population_size = 1000;
+    auto initial_conditions = cfepi::default_state<sir_epidemic_states>(
+        sir_epidemic_states::S, sir_epidemic_states::I, population_size, 10UL);
+    auto always_true_event
+        = [](const auto &param __attribute__((unused)), const auto &state __attribute__((unused)),
+             std::default_random_engine &rng __attribute__((unused))) { return (true); };
+    auto always_true_state
+        = [](const auto &first_param __attribute__((unused)),
+             const auto &second_param __attribute__((unused)),
+             std::default_random_engine &rng __attribute__((unused))) { return (true); };
+    auto do_nothing = [](auto &param __attribute__((unused)),
+                         std::default_random_engine &rng __attribute__((unused))) { return; };
+    auto test_results
+        = cfepi::run_simulation<sir_epidemic_states, any_sir_event_type, any_sir_event>(
+            cfepi::all_event_types<any_sir_event_type>{}, initial_conditions,
+            [](cfepi::epidemic_time_t t) {
+              return (std::array<double, 2>{.1, t < 5 ? .001 : 0.});
+            },
+            {std::make_tuple(always_true_event, always_true_state, do_nothing)}, 20);
+    // The first two entries are the initial conditions, then one for each step
+    const auto susceptible = [&test_results](size_t step) {
+      return (test_results[step + 2][0].potential_state_counts[1 << sir_epidemic_states::S]);
+    };
+    CHECK(susceptible(4) < population_size - 10);
+    for (auto step : std::ranges::views::iota(5UL, 20UL)) {
+      CHECK(susceptible(step) == susceptible(4));
+    }
+  }
+
   /*
   TEST_CASE("Single Time Event Generator works as expected") {
   const cfepi::person_t population_size = 5;
@@ -134,6 +481,147 @@ namespace detail {
     CHECK(base_counter == fully_sampled_counter);
   }
 
+  TEST_CASE("[random] xoshiro256starstar is a reproducible random number engine") {
+    static_assert(probability::uniform_random_number_engine<probability::xoshiro256starstar>);
+    static_assert(probability::bulk_random_number_engine<probability::xoshiro256starstar>);
+    probability::xoshiro256starstar gen1{42};
+    probability::xoshiro256starstar gen2{gen1};
+    probability::xoshiro256starstar gen3{43};
+    CHECK(gen1 == gen2);
+    CHECK(gen1 != gen3);
+
+    std::array<probability::xoshiro256starstar::result_type, 100> bulk_draws{};
+    gen2.generate(bulk_draws);
+    for (auto draw : bulk_draws) {
+      CHECK(draw == gen1());
+    }
+    CHECK(gen1 == gen2);
+    gen1.seed(42);
+    gen2.discard(1);
+    CHECK(gen1() != gen2());
+  }
+
+  TEST_CASE("[random] philox4x32_engine matches the Random123 known answers") {
+    static_assert(
+        probability::counter_based_random_number_engine<probability::philox4x32_engine>);
+    static_assert(!probability::counter_based_random_number_engine<std::default_random_engine>);
+    using block_type = probability::philox4x32_engine::counter_type;
+    CHECK(probability::philox4x32_engine::block({0U, 0U}, {0U, 0U, 0U, 0U})
+          == block_type{0x6627e8d5U, 0xe169c58dU, 0xbc57ac4cU, 0x9b00dbd8U});
+    CHECK(probability::philox4x32_engine::block(
+              {0xa4093822U, 0x299f31d0U}, {0x243f6a88U, 0x85a308d3U, 0x13198a2eU, 0x03707344U})
+          == block_type{0xd16cfe09U, 0x94fdccebU, 0x5001e420U, 0x24126ea1U});
+
+    probability::philox4x32_engine gen1{7};
+    probability::philox4x32_engine gen2{7};
+    for (size_t i = 0; i < 11; ++i) {
+      gen1();
+    }
+    gen2.discard(11);
+    CHECK(gen1 == gen2);
+
+    auto stream1 = probability::philox4x32_engine::stream(7, {1U, 0U, 2U, 3U}, 5);
+    auto stream2 = probability::philox4x32_engine::stream(7, {1U, 0U, 2U, 3U}, 5);
+    auto stream3 = probability::philox4x32_engine::stream(7, {1U, 0U, 2U, 4U}, 5);
+    auto stream4 = probability::philox4x32_engine::stream(7, {1U, 0U, 2U, 3U}, 6);
+    const auto first_draw = stream1();
+    CHECK(first_draw == stream2());
+    CHECK(first_draw != stream3());
+    CHECK(first_draw != stream4());
+  }
+
+  TEST_CASE("[random] Bulk uniforms and geometric skips have the right distribution") {
+    probability::xoshiro256starstar gen{2};
+    std::default_random_engine fallback_gen{2};
+    std::vector<double> uniforms(100000);
+    std::vector<double> fallback_uniforms(100000);
+    probability::fill_uniform(gen, uniforms);
+    probability::fill_uniform(fallback_gen, fallback_uniforms);
+    for (const auto &these_uniforms : {uniforms, fallback_uniforms}) {
+      CHECK(std::ranges::all_of(these_uniforms, [](double x) { return ((x >= 0) && (x < 1)); }));
+      const double mean = std::reduce(std::begin(these_uniforms), std::end(these_uniforms))
+                          / static_cast<double>(std::size(these_uniforms));
+      CHECK(std::abs(mean - 0.5) < 0.01);
+    }
+
+    const double probability = 0.01;
+    std::vector<size_t> skips(100000);
+    probability::fill_geometric(gen, skips, probability);
+    const double mean_skip = static_cast<double>(std::reduce(std::begin(skips), std::end(skips)))
+                             / static_cast<double>(std::size(skips));
+    CHECK(std::abs(mean_skip - (1 - probability) / probability) < 2);
+
+    probability::fill_geometric(gen, skips, 1.0);
+    CHECK(std::ranges::all_of(skips, [](size_t x) { return (x == 0); }));
+  }
+
+  TEST_CASE("[sample_view] Random access sample_view positions match iteration") {
+    const auto check_positions = [](auto gen) {
+      auto base_view = std::ranges::views::iota(0UL, 100000UL);
+      probability::sample_view sampled_view(base_view, 0.01, gen);
+      CHECK(sampled_view.expected_size() == 1000UL);
+      const auto positions = sampled_view.positions();
+      std::vector<size_t> iterated{};
+      for (auto elem : sampled_view) {
+        iterated.push_back(elem);
+      }
+      CHECK(positions == iterated);
+      CHECK(std::size(positions) > 800UL);
+      CHECK(std::size(positions) < 1200UL);
+    };
+    check_positions(std::default_random_engine{2});
+    check_positions(probability::xoshiro256starstar{2});
+  }
+
+  TEST_CASE("[sample_view] sample_view splits into independent chunks") {
+    auto base_view = std::ranges::views::iota(0UL, 100000UL);
+    probability::sample_view sampled_view(base_view, 0.01, probability::xoshiro256starstar{2});
+    const auto chunks = sampled_view.chunks(7);
+    CHECK(std::size(chunks) == 7UL);
+    std::vector<size_t> all_sampled{};
+    size_t chunk_index = 0;
+    for (const auto &chunk : chunks) {
+      for (auto elem : chunk) {
+        CHECK(elem >= 100000UL * chunk_index / 7);
+        CHECK(elem < 100000UL * (chunk_index + 1) / 7);
+        all_sampled.push_back(elem);
+      }
+      ++chunk_index;
+    }
+    CHECK(std::ranges::is_sorted(all_sampled));
+    CHECK(std::ranges::adjacent_find(all_sampled) == std::end(all_sampled));
+    CHECK(std::size(all_sampled) > 800UL);
+    CHECK(std::size(all_sampled) < 1200UL);
+    CHECK(all_sampled != sampled_view.positions());
+  }
+
+  TEST_CASE("[sample_view] Count first sampling is exactly pre-sized") {
+    auto base_view = std::ranges::views::iota(0UL, 100000UL);
+    probability::sample_view sampled_view(base_view, 0.01, probability::xoshiro256starstar{2});
+    for (size_t number_of_chunks : {1UL, 4UL}) {
+      const auto counts = sampled_view.chunk_counts(number_of_chunks);
+      const auto positions = sampled_view.count_first_positions(number_of_chunks);
+      CHECK(std::size(counts) == number_of_chunks);
+      CHECK(std::size(positions) == std::reduce(std::begin(counts), std::end(counts)));
+      CHECK(std::ranges::is_sorted(positions));
+      CHECK(std::ranges::adjacent_find(positions) == std::end(positions));
+      CHECK(positions.back() < 100000UL);
+      CHECK(std::size(positions) > 800UL);
+      CHECK(std::size(positions) < 1200UL);
+      CHECK(positions == sampled_view.count_first_positions(number_of_chunks));
+    }
+    probability::sample_view fully_sampled_view(base_view, 1.0, probability::xoshiro256starstar{2});
+    CHECK(std::size(fully_sampled_view.count_first_positions(3)) == 100000UL);
+    // Sparse enough to redraw duplicates instead of marking a bitmap
+    probability::sample_view sparse_view(std::ranges::views::iota(0UL, 10000000UL), 1e-5,
+                                         probability::xoshiro256starstar{2});
+    const auto sparse_positions = sparse_view.count_first_positions(2);
+    CHECK(std::ranges::is_sorted(sparse_positions));
+    CHECK(std::ranges::adjacent_find(sparse_positions) == std::end(sparse_positions));
+    CHECK(std::size(sparse_positions) > 50UL);
+    CHECK(std::size(sparse_positions) < 150UL);
+  }
+
   TEST_CASE(" States are properly separated") {
     struct test_epidemic_states {
     public:
@@ -358,6 +846,1011 @@ namespace detail {
     }
   }
 
+  TEST_CASE("[gillespie] Indexed priority queue keeps the smallest priority on top") {
+    cfepi::detail::indexed_priority_queue queue{std::vector<double>{3., 1., 2., 5.}};
+    CHECK(queue.top() == 1UL);
+    queue.update(1, 4.);
+    CHECK(queue.top() == 2UL);
+    queue.update(3, 0.5);
+    CHECK(queue.top() == 3UL);
+    CHECK(queue.priority(1) == 4.);
+  }
+
+  TEST_CASE("[gillespie] Exact SEIR simulation reports a conserved population at each time") {
+    cfepi::person_t population_size = 10000;
+    constexpr cfepi::epidemic_time_t simulation_length{100};
+    auto initial_conditions = cfepi::default_state<seir_epidemic_states>(
+        seir_epidemic_states::S, seir_epidemic_states::I, population_size, 1UL);
+    const auto event_rates
+        = std::array<double, 3>({.1, .8, 2. / static_cast<double>(population_size)});
+    auto results = cfepi::run_exact_simulation<seir_epidemic_states, any_seir_event_type>(
+        cfepi::all_event_types<any_seir_event_type>{}, initial_conditions, event_rates,
+        simulation_length, 2);
+    auto repeated_results = cfepi::run_exact_simulation<seir_epidemic_states, any_seir_event_type>(
+        cfepi::all_event_types<any_seir_event_type>{}, initial_conditions, event_rates,
+        simulation_length, 2);
+
+    CHECK(std::size(results) == static_cast<size_t>(simulation_length + 1));
+    size_t previously_recovered = 0UL;
+    for (auto time : std::ranges::views::iota(0UL, std::size(results))) {
+      const auto &counts = results[time].potential_state_counts;
+      CHECK(results[time].time == static_cast<cfepi::epidemic_time_t>(time));
+      CHECK(cfepi::is_simple(results[time]));
+      CHECK(std::reduce(std::begin(counts), std::end(counts)) == population_size);
+      CHECK(counts[1 << seir_epidemic_states::R] >= previously_recovered);
+      previously_recovered = counts[1 << seir_epidemic_states::R];
+      CHECK(results[time] == repeated_results[time]);
+    }
+  }
+
+  TEST_CASE("[tau_leaping] Tau leaping SEIR simulation conserves the population") {
+    cfepi::person_t population_size = 1000000;
+    constexpr cfepi::epidemic_time_t simulation_length{100};
+    const cfepi::compartment_counts<seir_epidemic_states> initial_counts{population_size - 10, 0,
+                                                                         10, 0};
+    const auto event_rates
+        = std::array<double, 3>({.1, .8, 2. / static_cast<double>(population_size)});
+    auto results = cfepi::run_tau_leaping_simulation<seir_epidemic_states, any_seir_event_type>(
+        cfepi::all_event_types<any_seir_event_type>{}, initial_counts, event_rates,
+        simulation_length, 2);
+
+    CHECK(std::size(results) == static_cast<size_t>(simulation_length + 1));
+    size_t previously_recovered = 0UL;
+    for (const auto &result : results) {
+      const auto &counts = result.potential_state_counts;
+      CHECK(cfepi::is_simple(result));
+      CHECK(std::reduce(std::begin(counts), std::end(counts)) == population_size);
+      CHECK(counts[1 << seir_epidemic_states::R] >= previously_recovered);
+      previously_recovered = counts[1 << seir_epidemic_states::R];
+    }
+    // With R0 = 20 almost everyone is infected
+    CHECK(previously_recovered > population_size / 2);
+  }
+
+  TEST_CASE("[random] SEIR model runs with a pluggable random engine") {
+    cfepi::person_t population_size = 1000;
+    constexpr cfepi::epidemic_time_t simulation_length{30};
+    auto initial_conditions = cfepi::default_state<seir_epidemic_states>(
+        seir_epidemic_states::S, seir_epidemic_states::I, population_size, 1UL);
+    auto always_true_event = [](const auto &param __attribute__((unused)),
+                                const auto &state __attribute__((unused)),
+                                probability::xoshiro256starstar &rng __attribute__((unused))) {
+      return (true);
+    };
+    auto always_true_state = [](const auto &first_param __attribute__((unused)),
+                                const auto &second_param __attribute__((unused)),
+                                probability::xoshiro256starstar &rng __attribute__((unused))) {
+      return (true);
+    };
+    auto do_nothing = [](auto &param __attribute__((unused)),
+                         probability::xoshiro256starstar &rng __attribute__((unused))) { return; };
+
+    auto test_results
+        = cfepi::run_simulation<seir_epidemic_states, any_seir_event_type, any_seir_event,
+                                probability::xoshiro256starstar>(
+            cfepi::all_event_types<any_seir_event_type>{}, initial_conditions,
+            std::array<double, 3>({.1, .8, 2. / static_cast<double>(population_size)}),
+            {std::make_tuple(always_true_event, always_true_state, do_nothing),
+             std::make_tuple(always_true_event, always_true_state, do_nothing)},
+            simulation_length);
+
+    for (const auto &result : test_results) {
+      CHECK(result[0] == result[1]);
+      const auto &counts = result[0].potential_state_counts;
+      CHECK(std::reduce(std::begin(counts), std::end(counts)) == population_size);
+    }
+    CHECK(test_results.back()[0].potential_state_counts[1 << seir_epidemic_states::S]
+          < population_size - 1);
+  }
+
+  TEST_CASE("[random] Event types sampled in parallel do not depend on the number of threads") {
+    cfepi::person_t population_size = 1000;
+    auto initial_conditions = cfepi::default_state<seir_epidemic_states>(
+        seir_epidemic_states::S, seir_epidemic_states::I, population_size, 5UL);
+    const auto run = [&]<typename random_engine_t>(random_engine_t, size_t number_of_threads) {
+      auto half_of_events
+          = [](const auto &param __attribute__((unused)),
+               const auto &state __attribute__((unused)),
+               random_engine_t &rng) { return (std::uniform_real_distribution<>(0, 1)(rng) < .5); };
+      auto always_true_state = [](const auto &first_param __attribute__((unused)),
+                                  const auto &second_param __attribute__((unused)),
+                                  random_engine_t &rng __attribute__((unused))) { return (true); };
+      auto do_nothing
+          = [](auto &param __attribute__((unused)), random_engine_t &rng __attribute__((unused))) {
+              return;
+            };
+      auto always_true_event = [](const auto &param __attribute__((unused)),
+                                  const auto &state __attribute__((unused)),
+                                  random_engine_t &rng __attribute__((unused))) { return (true); };
+      return (cfepi::run_simulation<seir_epidemic_states, any_seir_event_type, any_seir_event,
+                                    random_engine_t>(
+          cfepi::all_event_types<any_seir_event_type>{}, initial_conditions,
+          std::array<double, 3>({.1, .3, 2. / static_cast<double>(population_size)}),
+          {std::make_tuple(always_true_event, always_true_state, do_nothing),
+           std::make_tuple(half_of_events, always_true_state, do_nothing)},
+          30, 2, number_of_threads));
+    };
+    // With a counter based engine parallel runs are the sequential run
+    const auto philox_sequential = run(probability::philox4x32_engine{}, 1);
+    const auto philox_parallel = run(probability::philox4x32_engine{}, 3);
+    // Threads beyond one per event type draw the chunks of each sample
+    const auto philox_spare_threads = run(probability::philox4x32_engine{}, 7);
+    const auto xoshiro_two_threads = run(probability::xoshiro256starstar{}, 2);
+    const auto xoshiro_three_threads = run(probability::xoshiro256starstar{}, 3);
+    for (auto t : std::ranges::views::iota(0UL, std::size(philox_sequential))) {
+      for (auto world : std::ranges::views::iota(0UL, 2UL)) {
+        CHECK(philox_sequential[t][world] == philox_parallel[t][world]);
+        CHECK(philox_sequential[t][world] == philox_spare_threads[t][world]);
+        CHECK(xoshiro_two_threads[t][world] == xoshiro_three_threads[t][world]);
+      }
+    }
+    const auto &final_counts = xoshiro_two_threads.back()[1].potential_state_counts;
+    CHECK(final_counts[1 << seir_epidemic_states::S] < population_size - 5);
+  }
+
+  TEST_CASE("[sir_event] Compile time event application matches the generic visitors") {
+    static_assert(cfepi::constexpr_event_type<sir_infection_event_type>);
+    static_assert(
+        !cfepi::constexpr_event_type<cfepi::weighted_event_type<sir_recovery_event_type>>);
+    using infection = cfepi::static_event_application<sir_infection_event_type>;
+    static_assert(infection::changes[0] && !infection::changes[1]);
+    static_assert(infection::entered_masks[0][sir_epidemic_states::I]);
+
+    cfepi::person_t population_size = 100;
+    auto state = cfepi::default_state<sir_epidemic_states>(
+        sir_epidemic_states::S, sir_epidemic_states::I, population_size, 10UL);
+    state.potential_states[50].set(sir_epidemic_states::R);
+    const cfepi::event_type_table<sir_epidemic_states, any_sir_event_type> event_types{
+        cfepi::all_event_types<any_sir_event_type>{}};
+    auto generic_entered = state;
+    generic_entered.reset();
+    auto generic_remained = state;
+    auto static_entered = generic_entered;
+    auto static_remained = generic_remained;
+    for (auto person : std::ranges::views::iota(0UL, population_size)) {
+      any_sir_event recovery{};
+      recovery.type_index = 0;
+      recovery.affected_people[0] = person;
+      any_sir_event infection_event{};
+      infection_event.type_index = 1;
+      infection_event.affected_people = {person, person % 10};
+      const cfepi::any_state_check_preconditions<any_sir_event_type, sir_epidemic_states> check{
+          state, event_types};
+      CHECK(check(recovery)
+            == cfepi::static_event_application<sir_recovery_event_type>::check(state, recovery));
+      CHECK(check(infection_event) == infection::check(state, infection_event));
+      if (check(recovery)) {
+        cfepi::any_event_apply_entered_states{generic_entered, event_types}(recovery);
+        cfepi::any_event_apply_left_states{generic_remained, event_types}(recovery);
+        cfepi::static_event_application<sir_recovery_event_type>::apply(
+            static_entered, static_remained, recovery);
+      }
+      if (check(infection_event)) {
+        cfepi::any_event_apply_entered_states{generic_entered, event_types}(infection_event);
+        cfepi::any_event_apply_left_states{generic_remained, event_types}(infection_event);
+        infection::apply(static_entered, static_remained, infection_event);
+      }
+    }
+    CHECK(static_entered.potential_states == generic_entered.potential_states);
+    CHECK(static_remained.potential_states == generic_remained.potential_states);
+  }
+
+  TEST_CASE("[sir_event] Batched precondition checks match the per event check") {
+    cfepi::person_t population_size = 1000;
+    cfepi::sir_state<sir_epidemic_states> state{population_size};
+    for (auto person : std::ranges::views::iota(0UL, population_size)) {
+      state.potential_states[person].set(person % 3);
+      if (person % 7 == 0) {
+        state.potential_states[person].set(sir_epidemic_states::I);
+      }
+    }
+    const cfepi::event_type_table<sir_epidemic_states, any_sir_event_type> event_types{
+        cfepi::all_event_types<any_sir_event_type>{}};
+    const cfepi::any_state_check_preconditions<any_sir_event_type, sir_epidemic_states> check{
+        state, event_types};
+    std::default_random_engine rng{2};
+    std::uniform_int_distribution<cfepi::person_t> person(0, population_size - 1);
+    // Recoveries affect one person, infections two
+    for (size_t type_index : {0UL, 1UL}) {
+      std::vector<any_sir_event> events(1000);
+      for (auto &event : events) {
+        event.type_index = type_index;
+        event.affected_people = {person(rng), person(rng)};
+      }
+      const cfepi::precondition_batch batch{event_types[type_index],
+                                            std::span<const any_sir_event>(events)};
+      std::vector<std::uint8_t> valid{};
+      batch.check(state, valid);
+      REQUIRE(std::size(valid) == std::size(events));
+      size_t number_valid = 0;
+      for (auto index : std::ranges::views::iota(0UL, std::size(events))) {
+        CHECK((valid[index] == 1) == check(events[index]));
+        number_valid += valid[index];
+      }
+      CHECK(number_valid > 0UL);
+      CHECK(number_valid < std::size(events));
+    }
+  }
+
+  TEST_CASE("[sir_event] Events applied from many threads match serial application") {
+    cfepi::person_t population_size = 1000;
+    auto initial_conditions = cfepi::default_state<sir_epidemic_states>(
+        sir_epidemic_states::S, sir_epidemic_states::I, population_size, 10UL);
+    auto always_true_event
+        = [](const auto &param __attribute__((unused)), const auto &state __attribute__((unused)),
+             std::default_random_engine &rng __attribute__((unused))) { return (true); };
+    auto always_true_state
+        = [](const auto &first_param __attribute__((unused)),
+             const auto &second_param __attribute__((unused)),
+             std::default_random_engine &rng __attribute__((unused))) { return (true); };
+    auto do_nothing = [](auto &param __attribute__((unused)),
+                         std::default_random_engine &rng __attribute__((unused))) { return; };
+    const cfepi::event_type_table<sir_epidemic_states, any_sir_event_type> event_types{
+        cfepi::all_event_types<any_sir_event_type>{}};
+    std::vector<cfepi::filtration_setup<sir_epidemic_states, any_sir_event>> serial{};
+    for (size_t world = 0; world < 2; ++world) {
+      serial.emplace_back(initial_conditions,
+                          std::make_tuple(always_true_event, always_true_state, do_nothing));
+    }
+    auto concurrent = serial;
+
+    // Recoveries of the infected, and infections of some people more than once
+    std::vector<any_sir_event> events{};
+    for (auto person : std::ranges::views::iota(0UL, 10UL)) {
+      any_sir_event event{};
+      event.type_index = 0;
+      event.affected_people[0] = person;
+      events.push_back(event);
+    }
+    for (auto person : std::ranges::views::iota(10UL, population_size)) {
+      for (auto infector : std::ranges::views::iota(0UL, 1 + person % 3)) {
+        any_sir_event event{};
+        event.type_index = 1;
+        event.affected_people = {person, infector};
+        events.push_back(event);
+      }
+    }
+    for (auto index : std::ranges::views::iota(0UL, std::size(events))) {
+      cfepi::apply_accepted_event(serial[index % 2], event_types, events[index]);
+    }
+
+    constexpr size_t number_of_threads = 4;
+    cfepi::concurrent_state_changes<sir_epidemic_states> changes{population_size,
+                                                                 number_of_threads, 3};
+    {
+      std::vector<std::jthread> threads{};
+      for (auto thread : std::ranges::views::iota(0UL, number_of_threads)) {
+        threads.emplace_back([&, thread]() {
+          for (size_t index = thread; index < std::size(events); index += number_of_threads) {
+            changes.record(thread, index % 2, event_types, events[index]);
+          }
+        });
+      }
+    }
+    changes.merge(concurrent);
+    for (auto world : std::ranges::views::iota(0UL, 2UL)) {
+      CHECK(concurrent[world].states_entered.potential_states
+            == serial[world].states_entered.potential_states);
+      CHECK(concurrent[world].states_remained.potential_states
+            == serial[world].states_remained.potential_states);
+    }
+    CHECK(serial[0].states_entered.potential_states[0][sir_epidemic_states::R]);
+  }
+
+  TEST_CASE("[random] Counter based streams do not depend on the order work is done in") {
+    cfepi::person_t population_size = 1000;
+    auto initial_conditions = cfepi::default_state<seir_epidemic_states>(
+        seir_epidemic_states::S, seir_epidemic_states::I, population_size, 50UL);
+    auto coin_flip_event
+        = [](const auto &param __attribute__((unused)), const auto &state __attribute__((unused)),
+             probability::philox4x32_engine &rng) {
+            return (std::bernoulli_distribution{0.5}(rng));
+          };
+    auto always_true_state = [](const auto &first_param __attribute__((unused)),
+                                const auto &second_param __attribute__((unused)),
+                                probability::philox4x32_engine &rng __attribute__((unused))) {
+      return (true);
+    };
+    auto do_nothing = [](auto &param __attribute__((unused)),
+                         probability::philox4x32_engine &rng __attribute__((unused))) { return; };
+    const auto filter = std::make_tuple(coin_flip_event, always_true_state, do_nothing);
+
+    const cfepi::event_type_table<seir_epidemic_states, any_seir_event_type> event_types{
+        cfepi::all_event_types<any_seir_event_type>{}};
+    const std::array<double, 3> event_probabilities{
+        {.1, .8, 4. / static_cast<double>(population_size)}};
+    const auto run_event_types = [&](auto... event_indices) {
+      std::vector<cfepi::filtration_setup<seir_epidemic_states, any_seir_event,
+                                          probability::philox4x32_engine>>
+          setups{};
+      setups.emplace_back(initial_conditions, filter);
+      setups.emplace_back(initial_conditions, filter);
+      probability::philox4x32_engine random_source{};
+      (cfepi::single_event_type_run<seir_epidemic_states, any_seir_event_type, any_seir_event>(
+           cfepi::all_event_types<any_seir_event_type>{}, event_types, setups, random_source,
+           initial_conditions, event_probabilities, event_indices,
+           cfepi::random_stream_address{2, 0, 0}),
+       ...);
+      return (setups);
+    };
+
+    const auto forward = run_event_types(std::integral_constant<size_t, 0UL>(),
+                                         std::integral_constant<size_t, 1UL>(),
+                                         std::integral_constant<size_t, 2UL>());
+    const auto backward = run_event_types(std::integral_constant<size_t, 2UL>(),
+                                          std::integral_constant<size_t, 1UL>(),
+                                          std::integral_constant<size_t, 0UL>());
+    for (auto world : {0UL, 1UL}) {
+      CHECK(forward[world].states_entered.potential_states
+            == backward[world].states_entered.potential_states);
+      CHECK(forward[world].states_remained.potential_states
+            == backward[world].states_remained.potential_states);
+    }
+    // Each world flips its own coins
+    CHECK(forward[0].states_entered.potential_states
+          != forward[1].states_entered.potential_states);
+  }
+
+  TEST_CASE("[hybrid] Hybrid SEIR simulation matches across identical worlds") {
+    cfepi::person_t population_size = 100000;
+    constexpr cfepi::epidemic_time_t simulation_length{60};
+    auto initial_conditions = cfepi::default_state<seir_epidemic_states>(
+        seir_epidemic_states::S, seir_epidemic_states::I, population_size, 1UL);
+    auto always_true_event
+        = [](const auto &param __attribute__((unused)), const auto &state __attribute__((unused)),
+             std::default_random_engine &rng __attribute__((unused))) { return (true); };
+    auto always_true_state
+        = [](const auto &first_param __attribute__((unused)),
+             const auto &second_param __attribute__((unused)),
+             std::default_random_engine &rng __attribute__((unused))) { return (true); };
+    auto do_nothing = [](auto &param __attribute__((unused)),
+                         std::default_random_engine &rng __attribute__((unused))) { return; };
+
+    cfepi::hybrid_population<seir_epidemic_states> population{initial_conditions, 1000UL};
+    CHECK(population.counted_compartments[seir_epidemic_states::S]);
+    CHECK(!population.counted_compartments[seir_epidemic_states::I]);
+    CHECK(population.initial_individuals.size() == 1UL);
+
+    auto test_results
+        = cfepi::run_hybrid_simulation<seir_epidemic_states, any_seir_event_type, any_seir_event>(
+            cfepi::all_event_types<any_seir_event_type>{}, initial_conditions,
+            std::array<double, 3>({.1, .8, 2. / static_cast<double>(population_size)}),
+            {std::make_tuple(always_true_event, always_true_state, do_nothing),
+             std::make_tuple(always_true_event, always_true_state, do_nothing)},
+            simulation_length, 2, 1000UL);
+
+    CHECK(std::size(test_results) == static_cast<size_t>(simulation_length + 1));
+    for (const auto &result : test_results) {
+      CHECK(result[0] == result[1]);
+      CHECK(cfepi::is_simple(result[0]));
+      const auto &counts = result[0].potential_state_counts;
+      CHECK(std::reduce(std::begin(counts), std::end(counts)) == population_size);
+    }
+    CHECK(test_results.back()[0].potential_state_counts[1 << seir_epidemic_states::S]
+          < population_size - 1);
+
+    // Every step is rejected once. The people materialized by the rejected attempt go back to the
+    // pool, so everyone materialized from S by an accepted step has been infected.
+    using random_engine_t = probability::philox4x32_engine;
+    size_t attempts = 0;
+    size_t left_in_s = 0;
+    auto reject_first_attempt
+        = [&attempts, &left_in_s](const auto &setup __attribute__((unused)),
+                                  const auto &new_state,
+                                  random_engine_t &rng __attribute__((unused))) {
+            if (++attempts % 2 == 1) {
+              return (false);
+            }
+            left_in_s += std::ranges::count_if(new_state.potential_states, [](const auto &x) {
+              return (x.test(seir_epidemic_states::S));
+            });
+            return (true);
+          };
+    auto always_true_philox_event
+        = [](const auto &param __attribute__((unused)), const auto &state __attribute__((unused)),
+             random_engine_t &rng __attribute__((unused))) { return (true); };
+    auto do_nothing_philox
+        = [](auto &param __attribute__((unused)), random_engine_t &rng __attribute__((unused))) {
+            return;
+          };
+    const auto rejected_results
+        = cfepi::run_hybrid_simulation<seir_epidemic_states, any_seir_event_type, any_seir_event,
+                                       random_engine_t>(
+            cfepi::all_event_types<any_seir_event_type>{}, initial_conditions,
+            std::array<double, 3>({.1, .8, 2. / static_cast<double>(population_size)}),
+            {std::make_tuple(always_true_philox_event, reject_first_attempt, do_nothing_philox)},
+            simulation_length, 2, 1000UL);
+    CHECK(attempts == 2 * static_cast<size_t>(simulation_length));
+    CHECK(left_in_s == 0UL);
+    CHECK(rejected_results.back()[0].potential_state_counts[1 << seir_epidemic_states::S]
+          < population_size - 1);
+    for (const auto &result : rejected_results) {
+      const auto &counts = result[0].potential_state_counts;
+      CHECK(std::reduce(std::begin(counts), std::end(counts)) == population_size);
+    }
+  }
+
+  TEST_CASE("[metapopulation] Metapopulation SIR model migrates and does not depend on threads") {
+    cfepi::person_t population_size = 1000;
+    std::vector<cfepi::sir_state<sir_epidemic_states>> patch_initial_conditions{
+        cfepi::default_state<sir_epidemic_states>(sir_epidemic_states::S, sir_epidemic_states::I,
+                                                  population_size, 10UL),
+        cfepi::default_state<sir_epidemic_states>(sir_epidemic_states::S, sir_epidemic_states::I,
+                                                  population_size, 0UL),
+        cfepi::default_state<sir_epidemic_states>(sir_epidemic_states::S, sir_epidemic_states::I,
+                                                  population_size, 0UL)};
+    auto always_true_event
+        = [](const auto &param __attribute__((unused)), const auto &state __attribute__((unused)),
+             std::default_random_engine &rng __attribute__((unused))) { return (true); };
+    auto always_true_state
+        = [](const auto &first_param __attribute__((unused)),
+             const auto &second_param __attribute__((unused)),
+             std::default_random_engine &rng __attribute__((unused))) { return (true); };
+    auto do_nothing = [](auto &param __attribute__((unused)),
+                         std::default_random_engine &rng __attribute__((unused))) { return; };
+
+    // Counts kept up to date through migration match aggregating the patch
+    std::atomic<size_t> mismatches = 0;
+    auto counts_match = [&mismatches](const auto &setup,
+                                      const auto &new_state __attribute__((unused)),
+                                      std::default_random_engine &rng __attribute__((unused))) {
+      mismatches += (setup.current_counts.potential_state_counts
+                     == cfepi::aggregate_state(setup.current_state).potential_state_counts)
+                        ? 0
+                        : 1;
+      return (true);
+    };
+
+    // Patch 0 exchanges people with patch 1; patch 2 is isolated
+    cfepi::migration_matrix migration{3, {0., .05, 0., .05, 0., 0., 0., 0., 0.}};
+    const auto run = [&](size_t number_of_threads) {
+      return (cfepi::run_metapopulation_simulation<sir_epidemic_states, any_sir_event_type,
+                                                   any_sir_event>(
+          cfepi::all_event_types<any_sir_event_type>{}, patch_initial_conditions,
+          std::array<double, 2>({.1, 2. / static_cast<double>(population_size)}), migration,
+          {std::make_tuple(always_true_event, always_true_state, do_nothing),
+           std::make_tuple(always_true_event, counts_match, do_nothing)},
+          30, 2, number_of_threads));
+    };
+    const auto single_threaded = run(1);
+    const auto multi_threaded = run(3);
+    CHECK(std::size(single_threaded) == 32UL);
+    CHECK(mismatches == 0UL);
+    for (auto t : std::ranges::views::iota(0UL, std::size(single_threaded))) {
+      for (auto patch : std::ranges::views::iota(0UL, 3UL)) {
+        CHECK(single_threaded[t][patch][0] == multi_threaded[t][patch][0]);
+        CHECK(single_threaded[t][patch][1] == multi_threaded[t][patch][1]);
+      }
+    }
+
+    const auto infected_or_recovered = [](const auto &state) {
+      return (state.potential_state_counts[1 << sir_epidemic_states::I]
+              + state.potential_state_counts[1 << sir_epidemic_states::R]);
+    };
+    const auto &final_state = single_threaded.back();
+    CHECK(infected_or_recovered(final_state[1][0]) > 0UL);
+    CHECK(infected_or_recovered(final_state[2][0]) == 0UL);
+    size_t total = 0;
+    for (const auto &patch : final_state) {
+      total += std::reduce(std::begin(patch[0].potential_state_counts),
+                           std::end(patch[0].potential_state_counts));
+    }
+    CHECK(total == 3 * population_size);
+    CHECK(final_state[2][0].potential_state_counts[1 << sir_epidemic_states::S]
+          == population_size);
+  }
+
+  TEST_CASE("[partition] Local socket transport exchanges messages between processes") {
+    CHECK_NOTHROW(cfepi::local_socket_transport::run(3, [](auto &transport) {
+      // Large enough to fill the socket buffers in both directions at once
+      std::vector<cfepi::transport_message> outgoing(transport.size());
+      for (auto rank : std::ranges::views::iota(0UL, transport.size())) {
+        for (auto value : std::ranges::views::iota(0UL, 100000UL)) {
+          cfepi::detail::append_bytes(outgoing[rank], transport.rank() * 1000 + rank + value);
+        }
+      }
+      const auto incoming = transport.exchange(std::move(outgoing));
+      for (auto rank : std::ranges::views::iota(0UL, transport.size())) {
+        size_t offset = 0;
+        for (auto value : std::ranges::views::iota(0UL, 100000UL)) {
+          if (cfepi::detail::read_bytes<size_t>(incoming[rank], offset)
+              != rank * 1000 + transport.rank() + value) {
+            throw "Received the wrong message";
+          }
+        }
+      }
+      if (!cfepi::all_of(transport, true) || cfepi::all_of(transport, transport.rank() != 1)) {
+        throw "all_of is wrong";
+      }
+    }));
+    CHECK_THROWS(cfepi::local_socket_transport::run(2, [](auto &transport) {
+      if (transport.rank() == 1) {
+        throw "Failed";
+      }
+    }));
+  }
+
+  TEST_CASE("[partition] Partitioned SIR model infects across processes") {
+    cfepi::person_t population_size = 1000;
+    auto always_true_event
+        = [](const auto &param __attribute__((unused)), const auto &state __attribute__((unused)),
+             std::default_random_engine &rng __attribute__((unused))) { return (true); };
+    auto always_true_state
+        = [](const auto &first_param __attribute__((unused)),
+             const auto &second_param __attribute__((unused)),
+             std::default_random_engine &rng __attribute__((unused))) { return (true); };
+    auto do_nothing = [](auto &param __attribute__((unused)),
+                         std::default_random_engine &rng __attribute__((unused))) { return; };
+
+    // Only the people of rank 0 start infected
+    std::vector<std::vector<cfepi::aggregated_sir_state<sir_epidemic_states>>> results{};
+    cfepi::local_socket_transport::run(3, [&](auto &transport) {
+      const auto local_initial_conditions = cfepi::default_state<sir_epidemic_states>(
+          sir_epidemic_states::S, sir_epidemic_states::I, population_size,
+          transport.rank() == 0 ? 10UL : 0UL);
+      const auto local_results
+          = cfepi::run_partitioned_simulation<sir_epidemic_states, any_sir_event_type,
+                                              any_sir_event>(
+              transport, cfepi::all_event_types<any_sir_event_type>{}, local_initial_conditions,
+              std::array<double, 2>({.1, 2. / static_cast<double>(3 * population_size)}),
+              {std::make_tuple(always_true_event, always_true_state, do_nothing)}, 30);
+      cfepi::transport_message final_counts{};
+      for (auto count : local_results.back()[0].potential_state_counts) {
+        cfepi::detail::append_bytes(final_counts, count);
+      }
+      for (const auto &received : cfepi::all_gather(transport, final_counts)) {
+        if (received != final_counts) {
+          throw "Processes disagree about the results";
+        }
+      }
+      if (transport.rank() == 0) {
+        results = local_results;
+      }
+    });
+
+    CHECK(std::size(results) == 32UL);
+    for (const auto &result : results) {
+      const auto &counts = result[0].potential_state_counts;
+      CHECK(std::reduce(std::begin(counts), std::end(counts)) == 3 * population_size);
+    }
+    const auto &final_counts = results.back()[0].potential_state_counts;
+    CHECK(final_counts[1 << sir_epidemic_states::I] + final_counts[1 << sir_epidemic_states::R]
+          > population_size);
+
+    cfepi::single_process_transport transport{};
+    const auto single_process_results
+        = cfepi::run_partitioned_simulation<sir_epidemic_states, any_sir_event_type,
+                                            any_sir_event>(
+            transport, cfepi::all_event_types<any_sir_event_type>{},
+            cfepi::default_state<sir_epidemic_states>(sir_epidemic_states::S,
+                                                      sir_epidemic_states::I, population_size,
+                                                      10UL),
+            std::array<double, 2>({.1, 2. / static_cast<double>(population_size)}),
+            {std::make_tuple(always_true_event, always_true_state, do_nothing)}, 30);
+    CHECK(single_process_results.back()[0].potential_state_counts[1 << sir_epidemic_states::S]
+          < population_size - 10);
+  }
+
+  struct sirv_epidemic_states {
+  public:
+    enum state { S, I, R, V, n_compartments };
+    constexpr static auto size() { return (static_cast<size_t>(n_compartments)); }
+  };
+
+  struct sirv_recovery_event_type : public cfepi::transition_event_type<sirv_epidemic_states> {
+    constexpr sirv_recovery_event_type() noexcept
+        : transition_event_type<sirv_epidemic_states>(
+            {std::bitset<std::size(sirv_epidemic_states{})>{1 << sirv_epidemic_states::I}},
+            sirv_epidemic_states::R){};
+  };
+
+  struct sirv_infection_event_type : public cfepi::interaction_event_type<sirv_epidemic_states> {
+    constexpr sirv_infection_event_type() noexcept
+        : interaction_event_type<sirv_epidemic_states>(
+            {std::bitset<std::size(sirv_epidemic_states{})>{1 << sirv_epidemic_states::S}},
+            {std::bitset<std::size(sirv_epidemic_states{})>{1 << sirv_epidemic_states::I}},
+            sirv_epidemic_states::I){};
+  };
+
+  struct sirv_vaccination_event_type
+      : public cfepi::transition_event_type<sirv_epidemic_states> {
+    constexpr sirv_vaccination_event_type() noexcept
+        : transition_event_type<sirv_epidemic_states>(
+            {std::bitset<std::size(sirv_epidemic_states{})>{1 << sirv_epidemic_states::S}},
+            sirv_epidemic_states::V){};
+  };
+
+  typedef std::variant<sirv_recovery_event_type, sirv_infection_event_type,
+                       sirv_vaccination_event_type>
+      any_sirv_event_type;
+  typedef cfepi::any_event<any_sirv_event_type>::type any_sirv_event;
+
+  TEST_CASE("[tau_leaping] People leaving several compartments are split without replacement") {
+    for (size_t draws = 0; draws <= 10; ++draws) {
+      const probability::hypergeometric_distribution split(10, 5, draws);
+      std::default_random_engine rng{draws};
+      double total = 0;
+      bool in_range = true;
+      for (size_t repetition = 0; repetition < 2000; ++repetition) {
+        const auto marked = split(rng);
+        in_range = in_range && (marked >= split.min()) && (marked <= split.max());
+        total += static_cast<double>(marked);
+      }
+      CHECK(in_range);
+      CHECK(std::abs(total / 2000 - static_cast<double>(draws) / 2) < 0.1);
+    }
+
+    // Everyone susceptible or vaccinated is almost surely removed within one leap
+    struct removal_event_type : public cfepi::transition_event_type<sirv_epidemic_states> {
+      constexpr removal_event_type() noexcept
+          : transition_event_type<sirv_epidemic_states>(
+              {std::bitset<std::size(sirv_epidemic_states{})>{(1 << sirv_epidemic_states::S)
+                                                             | (1 << sirv_epidemic_states::V)}},
+              sirv_epidemic_states::R){};
+    };
+    typedef std::variant<removal_event_type> any_removal_event_type;
+    for (size_t seed = 0; seed < 100; ++seed) {
+      const auto results
+          = cfepi::run_tau_leaping_simulation<sirv_epidemic_states, any_removal_event_type>(
+              cfepi::all_event_types<any_removal_event_type>{},
+              cfepi::compartment_counts<sirv_epidemic_states>{5, 0, 0, 5},
+              std::array<double, 1>({20.}), 2, seed, 100.);
+      for (const auto &result : results) {
+        const auto &counts = result.potential_state_counts;
+        CHECK(std::reduce(std::begin(counts), std::end(counts)) == 10UL);
+        CHECK(std::ranges::all_of(counts, [](size_t count) { return (count <= 10UL); }));
+      }
+      CHECK(results.back().potential_state_counts[1 << sirv_epidemic_states::R] == 10UL);
+    }
+  }
+
+  TEST_CASE("[sir_event] Conflicting events keep the change with the smallest key") {
+    const cfepi::event_type_table<sirv_epidemic_states, any_sirv_event_type> event_types{
+        cfepi::all_event_types<any_sirv_event_type>{}};
+    auto states_entered = cfepi::default_state<sirv_epidemic_states>(
+        sirv_epidemic_states::S, sirv_epidemic_states::I, 200UL, 10UL);
+    states_entered.reset();
+    auto states_remained = cfepi::default_state<sirv_epidemic_states>(
+        sirv_epidemic_states::S, sirv_epidemic_states::I, 200UL, 10UL);
+
+    any_sirv_event infection{};
+    infection.type_index = 1;
+    infection.affected_people = {100, 0};
+    any_sirv_event vaccination{};
+    vaccination.type_index = 2;
+    vaccination.affected_people[0] = 100;
+    any_sirv_event other_vaccination{};
+    other_vaccination.type_index = 2;
+    other_vaccination.affected_people[0] = 150;
+
+    cfepi::event_conflicts<sirv_epidemic_states> conflicts{};
+    conflicts.record(event_types, infection, .5);
+    conflicts.record(event_types, other_vaccination, .9);
+    conflicts.record(event_types, vaccination, .2);
+    CHECK(conflicts.conflicts() == 1);
+    CHECK(conflicts.apply(states_entered, states_remained) == 1);
+    CHECK(states_entered.potential_states[100].count() == 1);
+    CHECK(states_entered.potential_states[100][sirv_epidemic_states::V]);
+    CHECK(states_entered.potential_states[150][sirv_epidemic_states::V]);
+    CHECK(states_remained.potential_states[100].none());
+    // The infector is not changed, and the touched bitmap is cleared
+    CHECK(states_entered.potential_states[0].none());
+    conflicts.record(event_types, infection, .5);
+    CHECK(conflicts.conflicts() == 0);
+  }
+
+  TEST_CASE("[sir_generator] Resolving conflicts keeps one state for each person") {
+    cfepi::person_t population_size = 1000;
+    auto initial_conditions = cfepi::default_state<sirv_epidemic_states>(
+        sirv_epidemic_states::S, sirv_epidemic_states::I, population_size, 100UL);
+    using random_engine_t = probability::philox4x32_engine;
+    auto always_true_event = [](const auto &param __attribute__((unused)),
+                                const auto &state __attribute__((unused)),
+                                random_engine_t &rng __attribute__((unused))) { return (true); };
+    auto always_true_state = [](const auto &first_param __attribute__((unused)),
+                                const auto &second_param __attribute__((unused)),
+                                random_engine_t &rng __attribute__((unused))) { return (true); };
+    auto do_nothing
+        = [](auto &param __attribute__((unused)), random_engine_t &rng __attribute__((unused))) {
+            return;
+          };
+    const auto run = [&](size_t number_of_threads, bool resolve_conflicts) {
+      return (cfepi::run_simulation<sirv_epidemic_states, any_sirv_event_type, any_sirv_event,
+                                    random_engine_t>(
+          cfepi::all_event_types<any_sirv_event_type>{}, initial_conditions,
+          std::array<double, 3>({.1, 3. / static_cast<double>(population_size), .3}),
+          {std::make_tuple(always_true_event, always_true_state, do_nothing)}, 10, 2,
+          number_of_threads, resolve_conflicts));
+    };
+    const auto people_in_several_states = [](const auto &aggregated) {
+      size_t rc = 0;
+      for (auto index : std::ranges::views::iota(0UL, 1UL << sirv_epidemic_states::size())) {
+        rc += std::popcount(index) > 1 ? aggregated.potential_state_counts[index] : 0;
+      }
+      return (rc);
+    };
+
+    const auto unresolved = run(1, false);
+    const auto resolved = run(1, true);
+    const auto resolved_parallel = run(2, true);
+    CHECK(people_in_several_states(unresolved.back()[0]) > 0);
+    for (auto t : std::ranges::views::iota(0UL, std::size(resolved))) {
+      CHECK(people_in_several_states(resolved[t][0]) == 0);
+      CHECK(resolved[t][0] == resolved_parallel[t][0]);
+    }
+    const auto &final_counts = resolved.back()[0].potential_state_counts;
+    CHECK(final_counts[1 << sirv_epidemic_states::V] > 0);
+    CHECK(final_counts[1 << sirv_epidemic_states::S] < population_size - 100);
+  }
+
+  struct wide_sir_epidemic_states {
+  public:
+    // Compartments after R stand in for the strata of a larger model, and stay empty
+    enum state { S, I, R, S2, I2, R2, S3, I3, R3, V, n_compartments };
+    constexpr static auto size() { return (static_cast<size_t>(n_compartments)); }
+  };
+
+  struct wide_sir_recovery_event_type
+      : public cfepi::transition_event_type<wide_sir_epidemic_states> {
+    constexpr wide_sir_recovery_event_type() noexcept
+        : transition_event_type<wide_sir_epidemic_states>(
+            {std::bitset<std::size(wide_sir_epidemic_states{})>{1 << wide_sir_epidemic_states::I}},
+            wide_sir_epidemic_states::R){};
+  };
+
+  struct wide_sir_infection_event_type
+      : public cfepi::interaction_event_type<wide_sir_epidemic_states> {
+    constexpr wide_sir_infection_event_type() noexcept
+        : interaction_event_type<wide_sir_epidemic_states>(
+            {std::bitset<std::size(wide_sir_epidemic_states{})>{1 << wide_sir_epidemic_states::S}},
+            {std::bitset<std::size(wide_sir_epidemic_states{})>{1 << wide_sir_epidemic_states::I}},
+            wide_sir_epidemic_states::I){};
+  };
+
+  typedef std::variant<wide_sir_recovery_event_type, wide_sir_infection_event_type>
+      any_wide_sir_event_type;
+  typedef cfepi::any_event<any_wide_sir_event_type>::type any_wide_sir_event;
+
+  TEST_CASE("[sir_generator] Models with many compartments aggregate sparsely") {
+    static_assert(
+        std::same_as<cfepi::potential_state_counts_t<wide_sir_epidemic_states>,
+                     cfepi::sparse_state_counts<cfepi::detail::int_pow(2, 10) + 1>>);
+    static_assert(std::same_as<cfepi::potential_state_counts_t<sir_epidemic_states>,
+                               std::array<size_t, 9>>);
+
+    cfepi::sparse_state_counts<9> first{};
+    cfepi::sparse_state_counts<9> second{};
+    first[4] = 2;
+    first[1] = 3;
+    second[1] = 3;
+    CHECK(first != second);
+    second[4] = 2;
+    second[2] = 0;
+    CHECK(first == second);
+    CHECK(std::as_const(first)[2] == 0);
+    CHECK(std::size(first.entries()) == 2);
+    CHECK(first.entries().front().first == 1);
+
+    cfepi::person_t population_size = 1000;
+    using random_engine_t = probability::philox4x32_engine;
+    auto always_true_event = [](const auto &param __attribute__((unused)),
+                                const auto &state __attribute__((unused)),
+                                random_engine_t &rng __attribute__((unused))) { return (true); };
+    auto always_true_state = [](const auto &first_param __attribute__((unused)),
+                                const auto &second_param __attribute__((unused)),
+                                random_engine_t &rng __attribute__((unused))) { return (true); };
+    auto do_nothing
+        = [](auto &param __attribute__((unused)), random_engine_t &rng __attribute__((unused))) {
+            return;
+          };
+    const std::array<double, 2> event_probabilities{.1, 2. / static_cast<double>(population_size)};
+    const auto wide_results
+        = cfepi::run_simulation<wide_sir_epidemic_states, any_wide_sir_event_type,
+                                any_wide_sir_event, random_engine_t>(
+            cfepi::all_event_types<any_wide_sir_event_type>{},
+            cfepi::default_state<wide_sir_epidemic_states>(
+                wide_sir_epidemic_states::S, wide_sir_epidemic_states::I, population_size, 10UL),
+            event_probabilities,
+            {std::make_tuple(always_true_event, always_true_state, do_nothing)}, 20);
+    const auto narrow_results
+        = cfepi::run_simulation<sir_epidemic_states, any_sir_event_type, any_sir_event,
+                                random_engine_t>(
+            cfepi::all_event_types<any_sir_event_type>{},
+            cfepi::default_state<sir_epidemic_states>(
+                sir_epidemic_states::S, sir_epidemic_states::I, population_size, 10UL),
+            event_probabilities,
+            {std::make_tuple(always_true_event, always_true_state, do_nothing)}, 20);
+
+    // The same events happen, so the compartments in common have the same counts
+    for (auto t : std::ranges::views::iota(0UL, std::size(wide_results))) {
+      const auto &wide = wide_results[t][0];
+      const auto &narrow = narrow_results[t][0];
+      CHECK(cfepi::is_simple(wide));
+      CHECK(std::size(wide.potential_state_counts.entries()) <= 3);
+      CHECK(std::reduce(std::begin(wide.potential_state_counts),
+                        std::end(wide.potential_state_counts))
+            == population_size);
+      for (auto compartment : {0, 1, 2}) {
+        CHECK(wide.potential_state_counts[1UL << compartment]
+              == narrow.potential_state_counts[1UL << compartment]);
+      }
+    }
+    CHECK(wide_results.back()[0].potential_state_counts[1 << wide_sir_epidemic_states::R] > 0);
+  }
+
+  TEST_CASE("[sir_generator] Event counts are the flows between compartments") {
+    cfepi::person_t population_size = 1000;
+    auto initial_conditions = cfepi::default_state<sir_epidemic_states>(
+        sir_epidemic_states::S, sir_epidemic_states::I, population_size, 10UL);
+    using random_engine_t = probability::philox4x32_engine;
+    auto always_true_event = [](const auto &param __attribute__((unused)),
+                                const auto &state __attribute__((unused)),
+                                random_engine_t &rng __attribute__((unused))) { return (true); };
+    auto always_true_state = [](const auto &first_param __attribute__((unused)),
+                                const auto &second_param __attribute__((unused)),
+                                random_engine_t &rng __attribute__((unused))) { return (true); };
+    auto do_nothing
+        = [](auto &param __attribute__((unused)), random_engine_t &rng __attribute__((unused))) {
+            return;
+          };
+    const auto run = [&](size_t number_of_threads, bool resolve_conflicts) {
+      return (cfepi::run_simulation<sir_epidemic_states, any_sir_event_type, any_sir_event,
+                                    random_engine_t>(
+          cfepi::all_event_types<any_sir_event_type>{}, initial_conditions,
+          std::array<double, 2>({.1, 3. / static_cast<double>(population_size)}),
+          {std::make_tuple(always_true_event, always_true_state, do_nothing)}, 20, 2,
+          number_of_threads, resolve_conflicts));
+    };
+    const auto count = [](const auto &aggregated, sir_epidemic_states::state compartment) {
+      return (aggregated.potential_state_counts[1 << compartment]);
+    };
+
+    for (auto number_of_threads : {1UL, 2UL}) {
+      const auto resolved = run(number_of_threads, true);
+      CHECK(resolved.front()[0].event_counts == std::vector<size_t>{0, 0});
+      size_t infections = 0;
+      for (auto t : std::ranges::views::iota(1UL, std::size(resolved) - 1)) {
+        const auto &before = resolved[t][0];
+        const auto &after = resolved[t + 1][0];
+        REQUIRE(std::size(after.event_counts) == 2);
+        CHECK(after.event_counts[1]
+              == count(before, sir_epidemic_states::S) - count(after, sir_epidemic_states::S));
+        CHECK(after.event_counts[0]
+              == count(after, sir_epidemic_states::R) - count(before, sir_epidemic_states::R));
+        infections += after.event_counts[1];
+      }
+      CHECK(infections > 0);
+    }
+    // Without resolution a person infected twice in a step is counted twice
+    const auto check_unresolved = [&count](const auto &unresolved) {
+      REQUIRE(std::size(unresolved.front()[0].event_counts) == 2);
+      CHECK(unresolved.front()[0].event_counts == std::vector<size_t>{0, 0});
+      size_t infections = 0;
+      for (auto t : std::ranges::views::iota(0UL, std::size(unresolved) - 1)) {
+        const auto &before = unresolved[t][0];
+        const auto &after = unresolved[t + 1][0];
+        REQUIRE(std::size(after.event_counts) == 2);
+        CHECK(after.event_counts[1]
+              >= count(before, sir_epidemic_states::S) - count(after, sir_epidemic_states::S));
+        CHECK(after.event_counts[0]
+              == count(after, sir_epidemic_states::R) - count(before, sir_epidemic_states::R));
+        infections += after.event_counts[1];
+      }
+      CHECK(infections > 0);
+    };
+    check_unresolved(run(1, false));
+    check_unresolved(
+        cfepi::run_hybrid_simulation<sir_epidemic_states, any_sir_event_type, any_sir_event,
+                                     random_engine_t>(
+            cfepi::all_event_types<any_sir_event_type>{}, initial_conditions,
+            std::array<double, 2>({.1, 3. / static_cast<double>(population_size)}),
+            {std::make_tuple(always_true_event, always_true_state, do_nothing)}, 20, 2, 100));
+    // Every process gets the flows of the whole population
+    cfepi::local_socket_transport::run(2, [&](auto &transport) {
+      const auto results
+          = cfepi::run_partitioned_simulation<sir_epidemic_states, any_sir_event_type,
+                                              any_sir_event, random_engine_t>(
+              transport, cfepi::all_event_types<any_sir_event_type>{},
+              cfepi::default_state<sir_epidemic_states>(
+                  sir_epidemic_states::S, sir_epidemic_states::I, population_size / 2, 5UL),
+              std::array<double, 2>({.1, 3. / static_cast<double>(population_size)}),
+              {std::make_tuple(always_true_event, always_true_state, do_nothing)}, 20, 2);
+      if (transport.rank() == 0) {
+        check_unresolved(results);
+      }
+    });
+  }
+
+  TEST_CASE("[sir_generator] Incremental counts match aggregating the whole population") {
+    cfepi::person_t population_size = 1000;
+    auto initial_conditions = cfepi::default_state<sirv_epidemic_states>(
+        sirv_epidemic_states::S, sirv_epidemic_states::I, population_size, 20UL);
+    using random_engine_t = probability::philox4x32_engine;
+    using setup_t = cfepi::filtration_setup<sirv_epidemic_states, any_sirv_event, random_engine_t>;
+    auto always_true_event = [](const auto &param __attribute__((unused)),
+                                const auto &state __attribute__((unused)),
+                                random_engine_t &rng __attribute__((unused))) { return (true); };
+    auto do_nothing
+        = [](auto &param __attribute__((unused)), random_engine_t &rng __attribute__((unused))) {
+            return;
+          };
+    size_t mismatches = 0;
+    size_t checks = 0;
+    size_t checks_with_incidence = 0;
+    // Only run_simulation keeps current_counts up to date, so next_counts is checked there
+    bool check_next_counts = true;
+    auto counts_match = [&mismatches, &checks, &checks_with_incidence, &check_next_counts](
+                            const setup_t &setup, const auto &new_state,
+                            random_engine_t &rng __attribute__((unused))) {
+      const auto entered = cfepi::aggregate_state(setup.states_entered);
+      mismatches += (setup.entered_counts() == entered) ? 0 : 1;
+      checks_with_incidence
+          += (entered.potential_state_counts[0] < setup.states_entered.size()) ? 1 : 0;
+      if (check_next_counts && !setup.state_modifier_) {
+        mismatches += (setup.next_counts(new_state) == cfepi::aggregate_state(new_state)) ? 0 : 1;
+      }
+      ++checks;
+      return (true);
+    };
+    for (auto [number_of_threads, resolve_conflicts] :
+         {std::make_pair(1UL, false), std::make_pair(2UL, true)}) {
+      // The first world has no state modifier, so its counts are only updated for people touched
+      // by events, and the second aggregates every step
+      const auto results
+          = cfepi::run_simulation<sirv_epidemic_states, any_sirv_event_type, any_sirv_event,
+                                  random_engine_t>(
+              cfepi::all_event_types<any_sirv_event_type>{}, initial_conditions,
+              std::array<double, 3>({.1, 2. / static_cast<double>(population_size), .05}),
+              {std::make_tuple(always_true_event, counts_match,
+                               typename setup_t::state_modify_fun_type{}),
+               std::make_tuple(always_true_event, counts_match, do_nothing)},
+              20, 2, number_of_threads, resolve_conflicts);
+      for (const auto &step : results) {
+        CHECK(step[0] == step[1]);
+        CHECK(step[0].time == step[1].time);
+      }
+      CHECK(results.back()[0].potential_state_counts[1 << sirv_epidemic_states::R] > 0);
+    }
+    CHECK(checks > 0);
+    CHECK(checks_with_incidence > 0);
+    CHECK(mismatches == 0);
+
+    // The hybrid and partitioned engines write pending changes themselves
+    check_next_counts = false;
+    for (auto engine : {0, 1}) {
+      checks = 0;
+      checks_with_incidence = 0;
+      mismatches = 0;
+      if (engine == 0) {
+        cfepi::run_hybrid_simulation<sirv_epidemic_states, any_sirv_event_type, any_sirv_event,
+                                     random_engine_t>(
+            cfepi::all_event_types<any_sirv_event_type>{}, initial_conditions,
+            std::array<double, 3>({.1, 2. / static_cast<double>(population_size), .05}),
+            {std::make_tuple(always_true_event, counts_match, do_nothing)}, 20, 2, 100);
+      } else {
+        // Only the first process reports back, but it also applies events sent by the second
+        cfepi::local_socket_transport::run(2, [&](auto &transport) {
+          cfepi::run_partitioned_simulation<sirv_epidemic_states, any_sirv_event_type,
+                                            any_sirv_event, random_engine_t>(
+              transport, cfepi::all_event_types<any_sirv_event_type>{},
+              cfepi::default_state<sirv_epidemic_states>(
+                  sirv_epidemic_states::S, sirv_epidemic_states::I, population_size / 2, 10UL),
+              std::array<double, 3>({.1, 2. / static_cast<double>(population_size), .05}),
+              {std::make_tuple(always_true_event, counts_match, do_nothing)}, 20, 2);
+        });
+      }
+      CHECK(checks > 0);
+      CHECK(checks_with_incidence > 0);
+      CHECK(mismatches == 0);
+    }
+
+    // Pending changes written without count_change are still counted
+    setup_t setup{initial_conditions,
+                  std::make_tuple(always_true_event, counts_match, do_nothing)};
+    setup.states_entered.potential_states[2].set(sirv_epidemic_states::I);
+    CHECK(setup.entered_counts() == cfepi::aggregate_state(setup.states_entered));
+  }
+
   /*
   TEST_CASE("[sir_generator] larger SEIR model works with state filter") {
   cfepi::person_t population_size = 100000;
@@ -603,8 +2096,8 @@ namespace detail {
       constexpr auto compartment_to_filter = config_map_sir_epidemic_states{}["I"];
       std::size_t this_time = static_cast<size_t>(new_state.time > 0 ? new_state.time : 0);
       if (this_time < simulation_length) {
-        auto incidence_counts = cfepi::aggregate_state(setup.states_entered)
-                                    .potential_state_counts[1 << compartment_to_filter];
+        auto incidence_counts
+            = setup.entered_counts().potential_state_counts[1 << compartment_to_filter];
         return (incidence_counts == counts_to_filter_to[this_time]);
       }
       return (true);